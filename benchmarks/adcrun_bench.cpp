@@ -0,0 +1,241 @@
+/*******************************************************************************
+
+ File:        adcrun_bench.cpp
+
+ Description: Check and benchmark of the implementations of
+ Frame_ExtractAdcRun() (scalar, SSE2 and AVX2).
+
+ The data is decoded like the frame decoders do: at each ADC sample word the
+ whole run is extracted, otherwise the word is skipped. Every implementation
+ available on the CPU must give the same number of samples and the same values
+ as the scalar one at every run, with the maximum number of samples varied so
+ that runs are also cut by it.
+
+ Usage: adcrun-bench [--check] [file ...]
+
+ The files are read as 16-bit words, e.g. .aqs files written by feminos-daq
+ (the run header words are skipped like any other word that is not an ADC
+ sample). Without file, frames are generated with a fixed seed: channels with
+ 0 to 512 samples, around the 8 and 16 word boundaries in particular, and runs
+ broken by other prefixes. With --check, the data is decoded once and the
+ exit status tells if all the implementations agree.
+
+
+ History:
+   Created with Frame_GetAdcRun()
+
+*******************************************************************************/
+
+#include "frame.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#define ADCRUN_MAX_SAMPLES 512 // maximum number of samples of a channel (as in the ROOT output)
+#define ADCRUN_FRAMES 2000     // number of frames generated without input file
+#define ADCRUN_REPEAT 100      // number of times the data is decoded for the benchmark
+
+static const char* adcrun_names[] = {"scalar", "sse2", "avx2"};
+
+/*******************************************************************************
+ AdcRun_Generate
+
+ Fills words with frames made of a start of event, channels of ADC samples and
+ an end of frame.
+*******************************************************************************/
+static void AdcRun_Generate(std::vector<unsigned short>& words) {
+    std::mt19937 rng(12345);
+    int f;
+    int c;
+    int s;
+    int n;
+    int nch;
+
+    for (f = 0; f < ADCRUN_FRAMES; f++) {
+        words.push_back(PFX_START_OF_EVENT | 1);
+        for (c = 0; c < 5; c++) {
+            words.push_back((unsigned short) (rng() & 0xFFFF));
+        }
+        nch = rng() % 40;
+        for (c = 0; c < nch; c++) {
+            words.push_back((unsigned short) (PFX_CARD_CHIP_CHAN_HIT_IX | (rng() % (4 * 4 * 72))));
+            if (rng() % 3 == 0) {
+                words.push_back((unsigned short) (PFX_TIME_BIN_IX | (rng() % ADCRUN_MAX_SAMPLES)));
+            }
+            switch (rng() % 4) {
+                case 0:
+                    n = rng() % 20;
+                    break;
+                case 1:
+                    n = 8 * (1 + rng() % 64) + (int) (rng() % 3) - 1;
+                    break;
+                default:
+                    n = rng() % (ADCRUN_MAX_SAMPLES + 1);
+                    break;
+            }
+            for (s = 0; s < n; s++) {
+                words.push_back((unsigned short) (PFX_ADC_SAMPLE | (rng() & 0x0FFF)));
+            }
+        }
+        if (rng() % 2) {
+            words.push_back(PFX_END_OF_EVENT | 1);
+            words.push_back((unsigned short) (rng() & 0xFFFF));
+        }
+        words.push_back(PFX_END_OF_FRAME);
+    }
+
+    // End with a run so that the end of the data is reached in the middle of one
+    for (s = 0; s < 37; s++) {
+        words.push_back((unsigned short) (PFX_ADC_SAMPLE | (rng() & 0x0FFF)));
+    }
+}
+
+/*******************************************************************************
+ AdcRun_Read
+
+ Appends the 16-bit words of a file to words.
+*******************************************************************************/
+static int AdcRun_Read(const char* name, std::vector<unsigned short>& words) {
+    FILE* f;
+    unsigned short buf[4096];
+    size_t n;
+
+    if ((f = fopen(name, "rb")) == (FILE*) 0) {
+        printf("AdcRun_Read: could not open %s\n", name);
+        return (-1);
+    }
+    while ((n = fread(buf, sizeof(buf[0]), sizeof(buf) / sizeof(buf[0]), f)) > 0) {
+        words.insert(words.end(), buf, buf + n);
+    }
+    fclose(f);
+    return (0);
+}
+
+/*******************************************************************************
+ AdcRun_Compare
+
+ Decodes words with fn and the scalar implementation and returns the number of
+ runs that differ. The maximum number of samples cycles from 1 to
+ ADCRUN_MAX_SAMPLES, then stays at ADCRUN_MAX_SAMPLES for as many runs.
+*******************************************************************************/
+static unsigned long AdcRun_Compare(FrameAdcRunFn fn, FrameAdcRunFn ref, const std::vector<unsigned short>& words, unsigned long* runs) {
+    unsigned short adc[ADCRUN_MAX_SAMPLES];
+    unsigned short adc_ref[ADCRUN_MAX_SAMPLES];
+    const unsigned short* p = words.data();
+    const unsigned short* end = words.data() + words.size();
+    unsigned long bad = 0;
+    unsigned long i = 0;
+    int max;
+    int n;
+    int n_ref;
+
+    *runs = 0;
+    while (p < end) {
+        if ((*p & PFX_12_BIT_CONTENT_MASK) != PFX_ADC_SAMPLE) {
+            p++;
+            continue;
+        }
+        max = (i < ADCRUN_MAX_SAMPLES) ? (int) (i + 1) : ADCRUN_MAX_SAMPLES;
+        i = (i + 1) % (2 * ADCRUN_MAX_SAMPLES);
+
+        // Fill the outputs differently so that a sample not written is seen
+        memset(adc, 0xAA, sizeof(adc));
+        memset(adc_ref, 0x55, sizeof(adc_ref));
+        n = fn(p, end, adc, max);
+        n_ref = ref(p, end, adc_ref, max);
+        if ((n != n_ref) || (n < 1) || (memcmp(adc, adc_ref, n * sizeof(adc[0])) != 0)) {
+            if (bad == 0) {
+                printf("AdcRun_Compare: first mismatch at word %ld: %d samples instead of %d\n", (long) (p - words.data()), n, n_ref);
+            }
+            bad++;
+        }
+        (*runs)++;
+        p += (n_ref > 0) ? n_ref : 1;
+    }
+    return (bad);
+}
+
+/*******************************************************************************
+ AdcRun_Time
+
+ Returns the words decoded per second by fn, in millions.
+*******************************************************************************/
+static double AdcRun_Time(FrameAdcRunFn fn, const std::vector<unsigned short>& words) {
+    unsigned short adc[ADCRUN_MAX_SAMPLES];
+    const unsigned short* p;
+    const unsigned short* end = words.data() + words.size();
+    unsigned long sum = 0;
+    int r;
+    int n;
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (r = 0; r < ADCRUN_REPEAT; r++) {
+        p = words.data();
+        while (p < end) {
+            if ((*p & PFX_12_BIT_CONTENT_MASK) == PFX_ADC_SAMPLE) {
+                n = fn(p, end, adc, ADCRUN_MAX_SAMPLES);
+                sum += adc[n - 1];
+                p += n;
+            } else {
+                p++;
+            }
+        }
+    }
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    // Keep the decoding from being optimized away
+    if (sum == 1) {
+        printf(" ");
+    }
+    return ((double) words.size() * ADCRUN_REPEAT / s / 1e6);
+}
+
+/*******************************************************************************
+ main
+*******************************************************************************/
+int main(int argc, char** argv) {
+    std::vector<unsigned short> words;
+    FrameAdcRunFn ref;
+    FrameAdcRunFn fn;
+    unsigned long bad = 0;
+    unsigned long runs;
+    unsigned long n;
+    int check = 0;
+    int files = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--check") == 0) {
+            check = 1;
+        } else {
+            if (AdcRun_Read(argv[i], words) < 0) {
+                return (1);
+            }
+            files++;
+        }
+    }
+    if (files == 0) {
+        AdcRun_Generate(words);
+    }
+    printf("%lu words (%s)\n", (unsigned long) words.size(), files ? "files" : "generated frames");
+
+    ref = Frame_GetAdcRun("scalar");
+    for (i = 0; i < (int) (sizeof(adcrun_names) / sizeof(adcrun_names[0])); i++) {
+        if ((fn = Frame_GetAdcRun(adcrun_names[i])) == (FrameAdcRunFn) 0) {
+            printf("%-6s: not available on this CPU\n", adcrun_names[i]);
+            continue;
+        }
+        n = AdcRun_Compare(fn, ref, words, &runs);
+        bad += n;
+        if (check) {
+            printf("%-6s: %lu runs, %lu mismatches\n", adcrun_names[i], runs, n);
+        } else {
+            printf("%-6s: %lu runs, %lu mismatches, %.0f Mwords/s\n", adcrun_names[i], runs, n, AdcRun_Time(fn, words));
+        }
+    }
+
+    return (bad ? 1 : 0);
+}
@@ -0,0 +1,384 @@
+/*******************************************************************************
+
+ File:        bufpool_bench.cpp
+
+ Description: Check and benchmark of the buffer pool (BufPool_GiveBuffer()
+ and BufPool_ReturnBuffer()) against the implementation it replaced.
+
+ The previous pool scanned the busy flags circularly for a free buffer and was
+ only safe under the network mutex held by its callers; it is reproduced here
+ (OldPool), alone and under a mutex. The current pool is lock-free and is
+ measured with and without the thread caches. The time of a give + return
+ pair is measured:
+ - single:    one thread gives a buffer and returns it at once;
+ - batch:     one thread gives 64 buffers, then returns them;
+ - contended: 2 and 4 threads do batches of 16 at the same time;
+ - handoff:   one thread gives buffers and another one returns them, like a
+              receive thread and the event builder.
+
+ Usage: bufpool-bench [--check]
+
+ With --check, the current pool is run shortly in all the cases and the exit
+ status tells if a buffer was ever given twice, if a buffer could not be given
+ while some were free, or if buffers were lost. It also closes and opens a
+ pool again on the same thread, which must then get a new cache.
+
+
+ History:
+   Created to compare the lock-free pool with the scan of the busy flags
+
+*******************************************************************************/
+
+#include "bufpool.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define BENCH_BUF_NB 512      // buffers in the pool (default pool)
+#define BENCH_BUF_SZ 8192     // size of a buffer (default pool)
+#define BENCH_PAIRS 4000000   // give + return pairs per thread for the benchmark
+#define BENCH_CHECK_PAIRS 200000 // give + return pairs per thread for the check
+#define BENCH_HANDOFF_SZ 128  // buffers in flight between the two threads of the handoff case
+
+/*******************************************************************************
+ OldPool: the pool before it was made lock-free
+*******************************************************************************/
+typedef struct _OldPool {
+    unsigned char* buf;
+    unsigned char* busy;
+    unsigned int buf_nb;
+    unsigned int buf_sz;
+    unsigned int cur_buf_ix;
+    unsigned int free_cnt;
+    std::mutex* mutex; // taken around each call when not null, like the network mutex
+} OldPool;
+
+static void OldPool_Open(OldPool* op, std::mutex* mutex) {
+    op->buf_nb = BENCH_BUF_NB;
+    op->buf_sz = BENCH_BUF_SZ;
+    op->buf = (unsigned char*) calloc(op->buf_nb, op->buf_sz);
+    op->busy = (unsigned char*) calloc(op->buf_nb, 1);
+    op->cur_buf_ix = 0;
+    op->free_cnt = op->buf_nb;
+    op->mutex = mutex;
+}
+
+static void OldPool_Close(OldPool* op) {
+    free(op->buf);
+    free(op->busy);
+}
+
+static int OldPool_GiveBuffer(OldPool* op, void** bu) {
+    unsigned int i;
+
+    if (op->free_cnt) {
+        for (i = 0; i < op->buf_nb; i++) {
+            if (op->busy[op->cur_buf_ix] == BUFFER_FREE) {
+                if (op->free_cnt > 1) {
+                    *bu = (void*) (op->buf + (unsigned long) op->cur_buf_ix * op->buf_sz);
+                    op->busy[op->cur_buf_ix] = BUFFER_BUSY;
+                    op->cur_buf_ix = (op->cur_buf_ix + 1) % op->buf_nb;
+                    op->free_cnt--;
+                    return (0);
+                }
+                *bu = (void*) 0;
+                return (-1);
+            }
+            op->cur_buf_ix = (op->cur_buf_ix + 1) % op->buf_nb;
+        }
+    }
+    *bu = (void*) 0;
+    return (-1);
+}
+
+static void OldPool_ReturnBuffer(OldPool* op, unsigned long bu) {
+    unsigned long ix = (bu - (unsigned long) op->buf) / op->buf_sz;
+
+    if ((op->busy[ix] & BUFFER_BUSY) == BUFFER_BUSY) {
+        op->busy[ix] = BUFFER_FREE;
+        if (op->free_cnt < op->buf_nb) {
+            op->free_cnt++;
+        }
+    }
+}
+
+/*******************************************************************************
+ Pool under test: the old one (with or without mutex) or the current one
+*******************************************************************************/
+typedef struct _BenchPool {
+    OldPool* op; // not null: old pool
+    BufPool* bp; // not null: current pool
+
+    std::atomic<unsigned char>* given; // check: 1 for each buffer given and not returned yet
+    std::atomic<unsigned long> dup_cnt;  // check: buffers given while they were already given
+    std::atomic<unsigned long> fail_cnt; // check: buffers that could not be given
+    int check;
+} BenchPool;
+
+static void* Bench_Give(BenchPool* p) {
+    void* bu;
+    int err;
+
+    if (p->op) {
+        if (p->op->mutex) {
+            p->op->mutex->lock();
+        }
+        err = OldPool_GiveBuffer(p->op, &bu);
+        if (p->op->mutex) {
+            p->op->mutex->unlock();
+        }
+    } else {
+        err = BufPool_GiveBuffer(p->bp, &bu, AUTO_RETURNED);
+    }
+    if (err < 0) {
+        p->fail_cnt++;
+        return ((void*) 0);
+    }
+    if (p->check && p->given[BUFPOOL_INDEX(p->bp, bu)].exchange(1)) {
+        p->dup_cnt++;
+    }
+    return (bu);
+}
+
+static void Bench_Return(BenchPool* p, void* bu) {
+    if (!bu) {
+        return;
+    }
+    if (p->op) {
+        if (p->op->mutex) {
+            p->op->mutex->lock();
+        }
+        OldPool_ReturnBuffer(p->op, (unsigned long) bu);
+        if (p->op->mutex) {
+            p->op->mutex->unlock();
+        }
+    } else {
+        if (p->check) {
+            p->given[BUFPOOL_INDEX(p->bp, bu)].store(0);
+        }
+        BufPool_ReturnBuffer(p->bp, (unsigned long) bu);
+    }
+}
+
+/*******************************************************************************
+ Cases: each thread does pairs give + return pairs
+*******************************************************************************/
+static void Bench_Batch(BenchPool* p, long pairs, int batch) {
+    void* bu[64];
+    long n;
+    int i;
+
+    for (n = 0; n < pairs; n += batch) {
+        for (i = 0; i < batch; i++) {
+            bu[i] = Bench_Give(p);
+        }
+        for (i = 0; i < batch; i++) {
+            Bench_Return(p, bu[i]);
+        }
+    }
+    if (p->bp) {
+        BufPool_FlushCache(p->bp);
+    }
+}
+
+static void Bench_Handoff(BenchPool* p, long pairs) {
+    void* ring[BENCH_HANDOFF_SZ];
+    std::atomic<unsigned long> wr(0);
+    std::atomic<unsigned long> rd(0);
+
+    // Returns the buffers in the order they were given, on another thread
+    std::thread ret([&]() {
+        unsigned long r;
+
+        for (r = 0; r < (unsigned long) pairs; r++) {
+            while (wr.load(std::memory_order_acquire) == r) {
+                std::this_thread::yield();
+            }
+            Bench_Return(p, ring[r % BENCH_HANDOFF_SZ]);
+            rd.store(r + 1, std::memory_order_release);
+        }
+        if (p->bp) {
+            BufPool_FlushCache(p->bp);
+        }
+    });
+
+    unsigned long w;
+    for (w = 0; w < (unsigned long) pairs; w++) {
+        while ((w - rd.load(std::memory_order_acquire)) == BENCH_HANDOFF_SZ) {
+            std::this_thread::yield();
+        }
+        ring[w % BENCH_HANDOFF_SZ] = Bench_Give(p);
+        wr.store(w + 1, std::memory_order_release);
+    }
+    if (p->bp) {
+        BufPool_FlushCache(p->bp);
+    }
+    ret.join();
+}
+
+/*******************************************************************************
+ Bench_Run
+
+ Runs a case on new threads (a thread caches the buffers of the first pool it
+ uses only) and returns the time of a give + return pair in ns.
+ kind: 0 old pool, 1 old pool under mutex, 2 current pool without cache,
+ 3 current pool with cache. threads: 0 for the handoff case.
+*******************************************************************************/
+static double Bench_Run(int kind, int threads, int batch, long pairs, int check, int* bad) {
+    OldPool op;
+    BufPool bp;
+    std::mutex mutex;
+    BenchPool p;
+    std::vector<std::thread> thr;
+    int i;
+    int err;
+
+    p.op = (OldPool*) 0;
+    p.bp = (BufPool*) 0;
+    p.given = (std::atomic<unsigned char>*) 0;
+    p.dup_cnt = 0;
+    p.fail_cnt = 0;
+    p.check = check;
+    if (kind < 2) {
+        OldPool_Open(&op, (kind == 1) ? &mutex : (std::mutex*) 0);
+        p.op = &op;
+    } else {
+        BufPool_Init(&bp);
+        bp.buf_nb = BENCH_BUF_NB;
+        bp.buf_sz = BENCH_BUF_SZ;
+        bp.mag_sz = (kind == 3) ? POOL_MAG_SIZE : 0;
+        if ((err = BufPool_Open(&bp)) < 0) {
+            printf("Bench_Run: BufPool_Open failed %d\n", err);
+            *bad = 1;
+            return (0.0);
+        }
+        p.bp = &bp;
+        if (check) {
+            p.given = new std::atomic<unsigned char>[BENCH_BUF_NB]();
+        }
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    if (threads == 0) {
+        thr.emplace_back(Bench_Handoff, &p, pairs);
+    } else {
+        for (i = 0; i < threads; i++) {
+            thr.emplace_back(Bench_Batch, &p, pairs, batch);
+        }
+    }
+    for (auto& t : thr) {
+        t.join();
+    }
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    if (p.bp) {
+        if (check && (p.dup_cnt || p.fail_cnt || (BufPool_GetFreeCnt(&bp) != BENCH_BUF_NB))) {
+            printf("Bench_Run: %lu buffers given twice, %lu not given, %d buffers free out of %d\n",
+                   p.dup_cnt.load(), p.fail_cnt.load(), BufPool_GetFreeCnt(&bp), BENCH_BUF_NB);
+            *bad = 1;
+        }
+        BufPool_Close(&bp);
+        delete[] p.given;
+    } else {
+        OldPool_Close(&op);
+    }
+
+    return (s * 1e9 / (double) pairs);
+}
+
+/*******************************************************************************
+ Bench_Reopen
+
+ Opens, uses and closes the same pool several times on the calling thread and
+ tells if the buffers were all given back to the free queue, and if the
+ thread cached them again after each opening.
+*******************************************************************************/
+static void Bench_Reopen(int* bad) {
+    BufPool bp;
+    void* bu[64];
+    unsigned long long give;
+    unsigned long long hit;
+    unsigned long long refill;
+    unsigned long long flush;
+    int run;
+    int i;
+
+    BufPool_Init(&bp);
+    for (run = 0; run < 3; run++) {
+        bp.buf_nb = BENCH_BUF_NB;
+        bp.buf_sz = BENCH_BUF_SZ;
+        bp.mag_sz = POOL_MAG_SIZE;
+        if (BufPool_Open(&bp) < 0) {
+            printf("Bench_Reopen: BufPool_Open failed\n");
+            *bad = 1;
+            return;
+        }
+        for (i = 0; i < 64; i++) {
+            if (BufPool_GiveBuffer(&bp, &bu[i], AUTO_RETURNED) < 0) {
+                bu[i] = (void*) 0;
+            }
+        }
+        for (i = 0; i < 64; i++) {
+            if (bu[i]) {
+                BufPool_ReturnBuffer(&bp, (unsigned long) bu[i]);
+            }
+        }
+        BufPool_FlushCache(&bp);
+        BufPool_GetCacheStats(&bp, &give, &hit, &refill, &flush);
+        if ((give != 64) || (BufPool_GetFreeCnt(&bp) != BENCH_BUF_NB)) {
+            printf("Bench_Reopen: opening %d: %llu buffers given from a cache, %d buffers free out of %d\n",
+                   run, give, BufPool_GetFreeCnt(&bp), BENCH_BUF_NB);
+            *bad = 1;
+        }
+        BufPool_Close(&bp);
+    }
+}
+
+/*******************************************************************************
+ main
+*******************************************************************************/
+int main(int argc, char** argv) {
+    static const char* kind_names[] = {"old", "old + mutex", "lock-free, no cache", "lock-free, cache"};
+    static const struct {
+        const char* name;
+        int threads;
+        int batch;
+    } cases[] = {
+            {"single", 1, 1},
+            {"batch", 1, 64},
+            {"contended x2", 2, 16},
+            {"contended x4", 4, 16},
+            {"handoff", 0, 1},
+    };
+    int check = ((argc > 1) && (strcmp(argv[1], "--check") == 0));
+    long pairs = check ? BENCH_CHECK_PAIRS : BENCH_PAIRS;
+    int bad = 0;
+    int kind;
+    unsigned int c;
+    double ns;
+
+    printf("%d buffers of %d bytes, ns per give + return pair (per thread)\n", BENCH_BUF_NB, BENCH_BUF_SZ);
+    for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        for (kind = 0; kind < 4; kind++) {
+            // Without its mutex the old pool is only safe on a single thread. The check is only for the current pool
+            if (((kind == 0) && (cases[c].threads != 1)) || (check && (kind < 2))) {
+                continue;
+            }
+            ns = Bench_Run(kind, cases[c].threads, cases[c].batch, pairs, check, &bad);
+            printf("%-14s %-20s %8.1f\n", cases[c].name, kind_names[kind], ns);
+            fflush(stdout);
+        }
+    }
+
+    if (check) {
+        Bench_Reopen(&bad);
+        printf("%s\n", bad ? "FAILED" : "passed");
+    }
+    return (bad ? 1 : 0);
+}
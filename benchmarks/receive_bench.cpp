@@ -0,0 +1,479 @@
+/*******************************************************************************
+
+ File:        receive_bench.cpp
+
+ Description: Check and benchmark of the receive paths of the FEM sockets
+ over the loopback interface: one recvmsg() per datagram
+ (FemProxy_ReceiveFrame()), recvmmsg() batches (FemProxy_ReceiveBatch()) and
+ the io_uring multishot receive (FemUring_NextFrame()).
+
+ Each FEM socket is opened with FemProxy_Open() like in feminos-daq and is fed
+ by a sender thread on 127.0.0.1. A sender keeps at most BENCH_WINDOW
+ datagrams ahead of the last one received from it, fewer if they would not fit
+ in half of the socket receive buffer, like the credits of a FEM, so that the
+ kernel does not drop datagrams because the receiver is slower.
+ The receiver takes its buffers from the buffer pool and returns them at once
+ (the uring backend gives them back to its provided buffer ring), waits in
+ poll() when the sockets are empty and does not process the frames: only the
+ cost of getting the datagrams is measured. Besides the rate, the CPU time of
+ the receive thread per datagram is shown: it does not depend on the time the
+ senders take when they share the CPU cores with the receiver.
+
+ Usage: receive-bench [--check] [--fems n] [--size bytes] [--batch n]
+
+ Defaults: 4 FEMs, 1024 byte datagrams, batches of up to 64 datagrams. The
+ uring path is only measured when feminos-daq is built with liburing.
+ With --check, fewer datagrams are sent, one in BENCH_TRUNC_EVERY is larger
+ than the pool buffers, and the exit status tells if each datagram was
+ received once, in order and intact, or counted as dropped by the kernel, and
+ if each datagram too large was dropped and counted as truncated. Otherwise, the datagrams that were neither received nor counted
+ as dropped are shown as lost.
+
+
+ History:
+   Created to compare the receive backends
+
+*******************************************************************************/
+
+#include "bufpool.h"
+#include "femarray.h"
+#include "femproxy.h"
+#include "femuring.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <poll.h>
+#include <unistd.h>
+#include <thread>
+#include <vector>
+
+#define BENCH_DGRAMS 200000      // datagrams sent per FEM for the benchmark
+#define BENCH_CHECK_DGRAMS 20000 // datagrams sent per FEM for the check
+#define BENCH_WINDOW 128         // datagrams a sender may send ahead of the last one received from it
+#define BENCH_SKB_SIZE 768       // memory taken by the kernel for a datagram in the receive buffer, beyond its data
+#define BENCH_SEND_BATCH 16      // datagrams sent with one call to sendmmsg
+#define BENCH_POLL_MS 10         // poll() timeout of the receiver
+#define BENCH_STALL_MS 1000      // time after which a sender no longer waits for its window
+#define BENCH_TRUNC_EVERY 101    // check: one datagram in this many is larger than the pool buffers
+#define BENCH_TRUNC_EXTRA 64     // check: bytes of such a datagram beyond the size of the pool buffers
+
+int verbose = 0; // defined in main.cpp for feminos-daq, used by femproxy.cpp
+
+typedef struct _BenchFem {
+    std::atomic<long> sent; // datagrams sent
+    std::atomic<long> last; // sequence number of the last datagram received (-1: none)
+    long rcv_cnt;           // datagrams received
+    long bad_cnt;           // datagrams out of order, duplicated or corrupted
+    int port;               // local port of the FEM socket
+    int window;             // datagrams the sender may send ahead of the last one received
+} BenchFem;
+
+typedef struct _Bench {
+    FemArray fa; // FEM proxies, buffer pool and pattern used by FemUring_Open()
+    BufPool bp;
+    FemUring fu;
+    BenchFem fem[MAX_NUMBER_OF_FEMINOS];
+    int fem_nb;
+    int dgram_sz;
+    int batch;
+    long dgrams;
+    int check; // datagrams lost are an error
+    std::atomic<int> send_done; // number of senders that have finished
+} Bench;
+
+/*******************************************************************************
+ Bench_Send
+
+ Sends the datagrams of FEM i: its number and the sequence number, then a
+ pattern derived from them.
+*******************************************************************************/
+static void Bench_Send(Bench* b, int i) {
+    BenchFem* bf = &(b->fem[i]);
+    struct sockaddr_in dst;
+    struct mmsghdr msg[BENCH_SEND_BATCH];
+    struct iovec iov[BENCH_SEND_BATCH];
+    int stride = b->check ? (int) b->bp.buf_sz + BENCH_TRUNC_EXTRA : b->dgram_sz;
+    std::vector<unsigned char> data((size_t) BENCH_SEND_BATCH * stride);
+    unsigned int* w;
+    long seq;
+    int nb;
+    int k;
+    int j;
+    int s;
+
+    if ((s = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        printf("Bench_Send(%d): socket failed: error %d\n", i, errno);
+        b->send_done++;
+        return;
+    }
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    dst.sin_port = htons(bf->port);
+    if (connect(s, (struct sockaddr*) &dst, sizeof(dst)) != 0) {
+        printf("Bench_Send(%d): connect failed: error %d\n", i, errno);
+        close(s);
+        b->send_done++;
+        return;
+    }
+
+    seq = 0;
+    while (seq < b->dgrams) {
+        // Wait for room in the window, unless the receiver seems to have stopped
+        auto t0 = std::chrono::steady_clock::now();
+        while ((seq + BENCH_SEND_BATCH - (bf->last.load(std::memory_order_acquire) + 1)) > bf->window) {
+            if (std::chrono::steady_clock::now() - t0 > std::chrono::milliseconds(BENCH_STALL_MS)) {
+                break;
+            }
+            std::this_thread::yield();
+        }
+
+        nb = (b->dgrams - seq < BENCH_SEND_BATCH) ? (int) (b->dgrams - seq) : BENCH_SEND_BATCH;
+        for (k = 0; k < nb; k++) {
+            w = (unsigned int*) &(data[(size_t) k * stride]);
+            for (j = 0; j < b->dgram_sz / 4; j++) {
+                w[j] = ((unsigned int) i << 24) ^ (unsigned int) (seq + k) ^ ((unsigned int) j * 0x9E3779B1U);
+            }
+            w[0] = (unsigned int) i;
+            w[1] = (unsigned int) (seq + k);
+            iov[k].iov_base = w;
+            iov[k].iov_len = (b->check && (((seq + k) % BENCH_TRUNC_EVERY) == BENCH_TRUNC_EVERY / 2)) ? stride : b->dgram_sz;
+            memset(&(msg[k]), 0, sizeof(msg[k]));
+            msg[k].msg_hdr.msg_iov = &(iov[k]);
+            msg[k].msg_hdr.msg_iovlen = 1;
+        }
+        if ((nb = sendmmsg(s, msg, nb, 0)) < 0) {
+            if ((errno == EAGAIN) || (errno == ENOBUFS) || (errno == EINTR)) {
+                std::this_thread::yield();
+                continue;
+            }
+            printf("Bench_Send(%d): sendmmsg failed: error %d\n", i, errno);
+            break;
+        }
+        seq += nb;
+        bf->sent.store(seq, std::memory_order_release);
+    }
+
+    close(s);
+    b->send_done++;
+}
+
+/*******************************************************************************
+ Bench_Check
+
+ Checks a datagram received for FEM i and lets its sender go on.
+*******************************************************************************/
+static void Bench_Check(Bench* b, int i, const unsigned char* buf, int len) {
+    BenchFem* bf = &(b->fem[i]);
+    const unsigned int* w = (const unsigned int*) buf;
+    long seq;
+    int j;
+
+    bf->rcv_cnt++;
+    if ((len != b->dgram_sz) || (w[0] != (unsigned int) i)) {
+        bf->bad_cnt++;
+        return;
+    }
+    seq = (long) w[1];
+    for (j = 2; j < len / 4; j++) {
+        if (w[j] != (((unsigned int) i << 24) ^ (unsigned int) seq ^ ((unsigned int) j * 0x9E3779B1U))) {
+            bf->bad_cnt++;
+            return;
+        }
+    }
+    // Loopback keeps the datagrams of a socket in order
+    if (seq <= bf->last.load(std::memory_order_relaxed)) {
+        bf->bad_cnt++;
+        return;
+    }
+    bf->last.store(seq, std::memory_order_release);
+}
+
+/*******************************************************************************
+ Bench_ReceiveSocket
+
+ Reads the datagrams pending on the socket of FEM i, one per call or in
+ batches. Returns the number of datagrams received or a negative value on
+ error. calls counts the receive calls that got some datagrams.
+*******************************************************************************/
+static int Bench_ReceiveSocket(Bench* b, int i, int mode, unsigned long* calls) {
+    FemProxy* fp = &(b->fa.fp[i]);
+    int tot = 0;
+    int cnt;
+    int k;
+
+    while (1) {
+        if (mode == 0) {
+            if (!fp->buf_in && (BufPool_GiveBuffer(&(b->bp), (void**) &(fp->buf_in), AUTO_RETURNED) < 0)) {
+                printf("Bench_ReceiveSocket: BufPool_GiveBuffer failed\n");
+                return (-1);
+            }
+            if ((cnt = FemProxy_ReceiveFrame(fp, b->bp.buf_sz)) <= 0) {
+                return ((cnt < 0) ? cnt : tot);
+            }
+            Bench_Check(b, i, fp->buf_in, fp->buf_in_len);
+            BufPool_ReturnBuffer(&(b->bp), (unsigned long) fp->buf_in);
+            fp->buf_in = (unsigned char*) 0;
+        } else {
+            for (k = 0; k < b->batch; k++) {
+                if (!fp->buf_in_v[k] && (BufPool_GiveBuffer(&(b->bp), (void**) &(fp->buf_in_v[k]), AUTO_RETURNED) < 0)) {
+                    printf("Bench_ReceiveSocket: BufPool_GiveBuffer failed\n");
+                    return (-1);
+                }
+            }
+            if ((cnt = FemProxy_ReceiveBatch(fp, b->batch, b->bp.buf_sz)) <= 0) {
+                return ((cnt < 0) ? cnt : tot);
+            }
+            for (k = 0; k < cnt; k++) {
+                Bench_Check(b, i, fp->buf_in_v[k], (int) fp->rcv_msg[k].msg_len);
+                BufPool_ReturnBuffer(&(b->bp), (unsigned long) fp->buf_in_v[k]);
+                fp->buf_in_v[k] = (unsigned char*) 0;
+            }
+        }
+        (*calls)++;
+        tot += cnt;
+    }
+}
+
+/*******************************************************************************
+ Bench_ReceiveUring
+
+ Reads the completions pending on the ring and posts again the receives that
+ have ended. Returns the number of datagrams received or a negative value on
+ error. calls counts the passes that got some datagrams.
+*******************************************************************************/
+static int Bench_ReceiveUring(Bench* b, unsigned long* calls) {
+    unsigned char* buf;
+    unsigned short len;
+    unsigned int ovfl = 0;
+    unsigned long long ts;
+    int tot = 0;
+    int i;
+
+    while (FemUring_NextFrame(&(b->fu), &i, &buf, &len, &ovfl, &ts)) {
+        if (ovfl > b->fa.fp[i].rxq_ovfl) {
+            b->fa.fp[i].rxq_ovfl = ovfl;
+        }
+        Bench_Check(b, i, buf, len);
+        FemUring_ReleaseFrame(&(b->fu), buf);
+        tot++;
+    }
+    if (tot) {
+        (*calls)++;
+    }
+    if (FemUring_Submit(&(b->fu)) < 0) {
+        return (-1);
+    }
+    return (tot);
+}
+
+/*******************************************************************************
+ Bench_Run
+
+ Opens the FEM sockets, runs the senders and receives with mode 0 (recvmsg),
+ 1 (recvmmsg) or 2 (io_uring) until every datagram sent was received or
+ dropped. Prints the result and returns 0, 1 if the check failed or -1 if the
+ mode could not run.
+*******************************************************************************/
+static int Bench_Run(Bench* b, int mode, const char* name) {
+    static int loc_ip[4] = {127, 0, 0, 1};
+    static int rem_ip[4] = {127, 0, 0, 1};
+    struct pollfd pfd[MAX_NUMBER_OF_FEMINOS];
+    struct sockaddr_in sa;
+    socklen_t sa_len;
+    std::vector<std::thread> thr;
+    unsigned long calls = 0;
+    unsigned long long drops = 0;
+    long trunc = 0;
+    long trunc_exp = 0;
+    long rcv = 0;
+    long sent = 0;
+    long bad = 0;
+    int pfd_nb;
+    int idle;
+    int cnt;
+    int err = 0;
+    int i;
+
+    BufPool_Init(&(b->bp));
+    if (BufPool_Open(&(b->bp)) < 0) {
+        printf("Bench_Run: BufPool_Open failed\n");
+        return (-1);
+    }
+    b->fa.bp = (void*) &(b->bp);
+    b->fa.fem_proxy_set = 0;
+    for (i = 0; i < b->fem_nb; i++) {
+        FemProxy_Clear(&(b->fa.fp[i]));
+        if (FemProxy_Open(&(b->fa.fp[i]), loc_ip, rem_ip, i, REMOTE_DST_PORT) < 0) {
+            return (-1);
+        }
+        sa_len = sizeof(sa);
+        getsockname(b->fa.fp[i].client, (struct sockaddr*) &sa, &sa_len);
+        b->fem[i].port = ntohs(sa.sin_port);
+        b->fem[i].window = b->fa.fp[i].rcv_buf_sz / (2 * (b->dgram_sz + BENCH_SKB_SIZE));
+        if (b->fem[i].window > BENCH_WINDOW) {
+            b->fem[i].window = BENCH_WINDOW;
+        } else if (b->fem[i].window < BENCH_SEND_BATCH) {
+            b->fem[i].window = BENCH_SEND_BATCH;
+        }
+        b->fem[i].sent = 0;
+        b->fem[i].last = -1;
+        b->fem[i].rcv_cnt = 0;
+        b->fem[i].bad_cnt = 0;
+        b->fa.fem_proxy_set |= (1 << i);
+        pfd[i].fd = b->fa.fp[i].client;
+        pfd[i].events = POLLIN;
+    }
+    pfd_nb = b->fem_nb;
+    FemUring_Clear(&(b->fu));
+    if (mode == 2) {
+        if ((err = FemUring_Open(&(b->fu), &(b->fa))) >= 0) {
+            pfd[0].fd = b->fu.fd;
+            pfd_nb = 1;
+        }
+    }
+    b->send_done = 0;
+
+    if (err >= 0) {
+        struct timespec c0, c1;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c0);
+        auto t0 = std::chrono::steady_clock::now();
+        auto t1 = t0;
+        for (i = 0; i < b->fem_nb; i++) {
+            thr.emplace_back(Bench_Send, b, i);
+        }
+
+        // Receive until the senders are done and the sockets stay empty
+        idle = 0;
+        while ((b->send_done < b->fem_nb) || (idle < 2)) {
+            cnt = 0;
+            if (mode == 2) {
+                if ((cnt = Bench_ReceiveUring(b, &calls)) < 0) {
+                    err = 1;
+                    break;
+                }
+            } else {
+                for (i = 0; i < b->fem_nb; i++) {
+                    if ((err = Bench_ReceiveSocket(b, i, mode, &calls)) < 0) {
+                        break;
+                    }
+                    cnt += err;
+                }
+                if (err < 0) {
+                    err = 1;
+                    break;
+                }
+                err = 0;
+            }
+            if (cnt) {
+                t1 = std::chrono::steady_clock::now();
+                idle = 0;
+            } else if ((poll(pfd, pfd_nb, BENCH_POLL_MS) == 0) && (b->send_done == b->fem_nb)) {
+                idle++;
+            }
+        }
+        double s = std::chrono::duration<double>(t1 - t0).count();
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &c1);
+        double cpu_ns = (c1.tv_sec - c0.tv_sec) * 1e9 + (c1.tv_nsec - c0.tv_nsec);
+
+        for (auto& t : thr) {
+            t.join();
+        }
+        for (i = 0; i < b->fem_nb; i++) {
+            rcv += b->fem[i].rcv_cnt;
+            sent += b->fem[i].sent;
+            bad += b->fem[i].bad_cnt;
+            drops += b->fa.fp[i].rxq_ovfl;
+            trunc += (mode == 2) ? b->fu.trunc_fem[i] : b->fa.fp[i].trunc_cnt;
+        }
+        if (b->check) {
+            trunc_exp = b->fem_nb * ((b->dgrams + BENCH_TRUNC_EVERY / 2) / BENCH_TRUNC_EVERY);
+        }
+        printf("%-9s %8.3f Mdgram/s %8.1f MB/s %6.0f ns/dgram %5.1f dgram/call %llu dropped", name, rcv / s / 1e6,
+               rcv * (double) b->dgram_sz / s / 1e6, rcv ? cpu_ns / rcv : 0.0, calls ? (double) rcv / calls : 0.0, drops);
+        if (bad || (sent != b->dgrams * b->fem_nb) || (trunc != trunc_exp)) {
+            printf(" FAILED: %ld sent, %ld received, %ld bad, %ld truncated instead of %ld", sent, rcv, bad, trunc, trunc_exp);
+            err = 1;
+        } else if ((unsigned long long) (rcv + trunc) + drops != (unsigned long long) sent) {
+            // Drops after the last datagram received are not reported by the kernel
+            printf(" %lld lost", (long long) sent - rcv - trunc - (long long) drops);
+            err = b->check;
+        }
+        printf("\n");
+    }
+
+    FemUring_Close(&(b->fu));
+    for (i = 0; i < b->fem_nb; i++) {
+        if (b->fa.fp[i].buf_in) {
+            BufPool_ReturnBuffer(&(b->bp), (unsigned long) b->fa.fp[i].buf_in);
+        }
+        for (cnt = 0; cnt < MAX_RCV_BATCH; cnt++) {
+            if (b->fa.fp[i].buf_in_v[cnt]) {
+                BufPool_ReturnBuffer(&(b->bp), (unsigned long) b->fa.fp[i].buf_in_v[cnt]);
+            }
+        }
+        FemProxy_Close(&(b->fa.fp[i]));
+    }
+    BufPool_Close(&(b->bp));
+    return (err);
+}
+
+/*******************************************************************************
+ main
+*******************************************************************************/
+int main(int argc, char** argv) {
+    static const char* mode_names[] = {"recvmsg", "recvmmsg", "io_uring"};
+    static Bench b;
+    int check = 0;
+    int bad = 0;
+    int mode;
+    int err;
+    int i;
+
+    b.fem_nb = 4;
+    b.dgram_sz = 1024;
+    b.batch = MAX_RCV_BATCH;
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--check") == 0) {
+            check = 1;
+        } else if ((strcmp(argv[i], "--fems") == 0) && (i + 1 < argc)) {
+            b.fem_nb = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--size") == 0) && (i + 1 < argc)) {
+            b.dgram_sz = atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--batch") == 0) && (i + 1 < argc)) {
+            b.batch = atoi(argv[++i]);
+        } else {
+            printf("Usage: receive-bench [--check] [--fems n] [--size bytes] [--batch n]\n");
+            return (1);
+        }
+    }
+    if ((b.fem_nb < 1) || (b.fem_nb > MAX_NUMBER_OF_FEMINOS) || (b.dgram_sz < 8) || (b.dgram_sz > POOL_BUFFER_SIZE) ||
+        (b.batch < 1) || (b.batch > MAX_RCV_BATCH)) {
+        printf("receive-bench: 1 to %d FEMs, 8 to %d bytes per datagram, batches of 1 to %d datagrams\n",
+               MAX_NUMBER_OF_FEMINOS, POOL_BUFFER_SIZE, MAX_RCV_BATCH);
+        return (1);
+    }
+    b.dgrams = check ? BENCH_CHECK_DGRAMS : BENCH_DGRAMS;
+    b.check = check;
+
+    printf("%d FEMs, %ld datagrams of %d bytes each, recvmmsg batches of %d\n", b.fem_nb, b.dgrams, b.dgram_sz, b.batch);
+    for (mode = 0; mode < 3; mode++) {
+        err = Bench_Run(&b, mode, mode_names[mode]);
+        if (err < 0) {
+            printf("%-9s not available\n", mode_names[mode]);
+        } else if (err > 0) {
+            bad = 1;
+        }
+        fflush(stdout);
+    }
+
+    if (check) {
+        printf("%s\n", bad ? "FAILED" : "passed");
+    }
+    return (bad ? 1 : 0);
+}
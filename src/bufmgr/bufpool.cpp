@@ -15,151 +15,616 @@
 
   November 2010: added BufPool_GetBufferFlags()
 
+  Replaced the circular scan of the busy flags by a bounded multi-producer
+  multi-consumer queue of free buffer indices (one sequence number per slot,
+  positions advanced with compare and swap). BufPool_GiveBuffer() and
+  BufPool_ReturnBuffer() take constant time and may be called concurrently
+  from any thread.
+
+  Added BufPool_Open() and BufPool_Close(): the buffers, their flags and the
+  free queue are allocated at run time with the number and size of buffers
+  set after BufPool_Init(). The buffers come from Memory_Alloc_Large(), which
+  returns zeroed prefaulted memory, so they are no longer cleared one byte at
+  a time.
+
+  Added a cache of free buffers per thread in front of the free queue (see
+  bufpool.h), BufPool_FlushCache() and BufPool_GetCacheStats().
+
+  Added the low-water mark of the free queue, the count of allocation
+  failures and the histogram of the buffer hold time per source
+  (BufPool_HoldBegin(), BufPool_HoldEnd() and BufPool_GetHoldHist()).
+
+  Added a reference count per buffer (BufPool_AddRef() and BufPool_DropRef())
+  so that a buffer can be passed to the storage thread without being copied.
+
+  Each opening of a pool gets a new generation number, kept by every thread
+  next to its cache pointer: a thread no longer uses the cache freed by
+  BufPool_Close() once the pool is opened again.
+
 *******************************************************************************/
 
 #include "bufpool.h"
 #include "bufpool_err.h"
+#include "os_al.h"
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sched.h>
+
+// Cache of the calling thread, the pool it belongs to and the generation of the pool when it was created. A thread
+// only caches the buffers of the first pool it uses, again after that pool is closed and opened.
+static __thread BufPool* bufpool_cache_pool = (BufPool*) 0;
+static __thread BufPoolCache* bufpool_cache = (BufPoolCache*) 0;
+static __thread unsigned long bufpool_cache_gen = 0;
+
+// Last generation given to a pool by BufPool_Open()
+static unsigned long bufpool_gen = 0;
 
 /*******************************************************************************
  BufPool_Init
+
+ Sets the default number and size of buffers. The caller may change buf_nb,
+ buf_sz and numa_node before calling BufPool_Open().
 *******************************************************************************/
 void BufPool_Init(BufPool* bp) {
     int i;
     int j;
 
-    for (i = 0; i < POOL_NB_OF_BUFFER; i++) {
-        for (j = 0; j < POOL_BUFFER_SIZE; j++) {
-            bp->buf[i][j] = 0x00;
+    bp->buf = (unsigned char*) 0;
+    bp->buf_nb = POOL_NB_OF_BUFFER;
+    bp->buf_sz = POOL_BUFFER_SIZE;
+    bp->numa_node = -1;
+    bp->pages = MEMORY_PAGES_NORMAL;
+    bp->map_sz = 0;
+    bp->busy = (unsigned char*) 0;
+    bp->free_q = (BufPoolCell*) 0;
+    bp->q_mask = 0;
+    bp->mag_sz = POOL_MAG_SIZE;
+    bp->cache_nb = 0;
+    bp->gen = 0;
+    for (i = 0; i < POOL_MAX_CACHES; i++) {
+        bp->cache[i] = (BufPoolCache*) 0;
+    }
+    bp->free_enq = 0;
+    bp->free_deq = 0;
+    bp->free_low = 0;
+    bp->fail_cnt = 0;
+    bp->hold_ts = (unsigned long long*) 0;
+    bp->hold_src = (unsigned char*) 0;
+    bp->ref = (int*) 0;
+    for (i = 0; i < POOL_HOLD_SRC_NB; i++) {
+        for (j = 0; j < POOL_HOLD_BIN_NB; j++) {
+            bp->hold_hist[i][j] = 0;
+            bp->hold_hist_lst[i][j] = 0;
         }
-        bp->busy[i] = BUFFER_FREE;
-        // printf("0 BufPool_Init: buf(%d)=0x%x 0x%x\r\n", i, &(bp->buf[i][0]), &(bp->buf[i][POOL_BUFFER_SIZE-1]));
+        bp->hold_sum_us[i] = 0;
+        bp->hold_sum_lst[i] = 0;
+    }
+}
+
+/*******************************************************************************
+ BufPool_Open
+
+ Allocates the buffers and puts them all in the free queue.
+*******************************************************************************/
+int BufPool_Open(BufPool* bp) {
+    unsigned long i;
+    unsigned long q_size;
+
+    if ((bp->buf_nb < 2) || (bp->buf_nb > POOL_MAX_NB_OF_BUFFER) ||
+        (bp->buf_sz < POOL_MIN_BUFFER_SIZE) || (bp->buf_sz > POOL_MAX_BUFFER_SIZE)) {
+        printf("BufPool_Open: illegal pool of %u buffers of %u bytes\n", bp->buf_nb, bp->buf_sz);
+        return (ERR_BUFPOOL_ILLEGAL_SIZE);
+    }
+    bp->buf_sz = (bp->buf_sz + POOL_BUFFER_ALIGNMENT - 1) & ~(POOL_BUFFER_ALIGNMENT - 1);
+
+    // The free queue index wraps with a mask: round its size up to a power of 2
+    q_size = 1;
+    while (q_size < (2UL * bp->buf_nb)) {
+        q_size <<= 1;
+    }
+
+    bp->map_sz = (unsigned long) bp->buf_nb * bp->buf_sz;
+    if ((bp->buf = (unsigned char*) Memory_Alloc_Large(bp->map_sz, bp->numa_node, &(bp->pages))) == (unsigned char*) 0) {
+        printf("BufPool_Open: could not allocate %lu bytes\n", bp->map_sz);
+        return (ERR_BUFPOOL_ALLOC_FAILED);
+    }
+    bp->busy = (unsigned char*) calloc(bp->buf_nb, sizeof(unsigned char));
+    bp->free_q = (BufPoolCell*) malloc(q_size * sizeof(BufPoolCell));
+    bp->hold_ts = (unsigned long long*) calloc(bp->buf_nb, sizeof(unsigned long long));
+    bp->hold_src = (unsigned char*) calloc(bp->buf_nb, sizeof(unsigned char));
+    bp->ref = (int*) calloc(bp->buf_nb, sizeof(int));
+    if ((bp->busy == (unsigned char*) 0) || (bp->free_q == (BufPoolCell*) 0) ||
+        (bp->hold_ts == (unsigned long long*) 0) || (bp->hold_src == (unsigned char*) 0) || (bp->ref == (int*) 0)) {
+        printf("BufPool_Open: could not allocate the free queue\n");
+        BufPool_Close(bp);
+        return (ERR_BUFPOOL_ALLOC_FAILED);
+    }
+    bp->q_mask = q_size - 1;
+
+    for (i = 0; i < q_size; i++) {
+        if (i < bp->buf_nb) {
+            // All buffers are free: slot i holds buffer i, ready to be taken at position i
+            bp->free_q[i].ix = (unsigned int) i;
+            bp->free_q[i].seq = i + 1;
+        } else {
+            // The rest of the queue is empty, ready to be filled at position i
+            bp->free_q[i].ix = 0;
+            bp->free_q[i].seq = i;
+        }
+    }
+    bp->free_enq = bp->buf_nb;
+    bp->free_deq = 0;
+    bp->free_low = bp->buf_nb;
+    bp->gen = __atomic_add_fetch(&bufpool_gen, 1, __ATOMIC_RELAXED);
+
+    // A cache holds up to two magazines: all the caches together must not hold more than half of the pool, or the
+    // threads that only return buffers could strand what the receive threads need
+    if (bp->mag_sz > POOL_MAX_MAG_SIZE) {
+        bp->mag_sz = POOL_MAX_MAG_SIZE;
+    }
+    if (bp->mag_sz > (bp->buf_nb / (4 * POOL_MAX_CACHES))) {
+        bp->mag_sz = bp->buf_nb / (4 * POOL_MAX_CACHES);
+    }
+    if (bp->mag_sz < 2) {
+        bp->mag_sz = 0;
+    }
+
+    return (0);
+}
+
+/*******************************************************************************
+ BufPool_Close
+*******************************************************************************/
+void BufPool_Close(BufPool* bp) {
+    int i;
+    BufPoolCache* c;
+
+    for (i = 0; (i < bp->cache_nb) && (i < POOL_MAX_CACHES); i++) {
+        if ((c = bp->cache[i]) != (BufPoolCache*) 0) {
+            if (c->give_cnt || c->flush_cnt) {
+                printf("BufPool_Close: cache %d: %llu buffers given, %.1f%% from the cache, %llu refills, %llu flushes\n",
+                       i, c->give_cnt, c->give_cnt ? (100.0 * (double) c->hit_cnt / (double) c->give_cnt) : 0.0, c->refill_cnt, c->flush_cnt);
+            }
+            free(c);
+            bp->cache[i] = (BufPoolCache*) 0;
+        }
+    }
+    bp->cache_nb = 0;
+
+    if (bp->buf) {
+        Memory_Free_Large(bp->buf, bp->map_sz);
+        bp->buf = (unsigned char*) 0;
+    }
+    if (bp->busy) {
+        free(bp->busy);
+        bp->busy = (unsigned char*) 0;
+    }
+    if (bp->free_q) {
+        free(bp->free_q);
+        bp->free_q = (BufPoolCell*) 0;
+    }
+    if (bp->hold_ts) {
+        free(bp->hold_ts);
+        bp->hold_ts = (unsigned long long*) 0;
+    }
+    if (bp->hold_src) {
+        free(bp->hold_src);
+        bp->hold_src = (unsigned char*) 0;
+    }
+    if (bp->ref) {
+        free(bp->ref);
+        bp->ref = (int*) 0;
     }
-    bp->cur_buf_ix = 0;
-    bp->free_cnt = POOL_NB_OF_BUFFER;
-    // printf("0 BufPool_Init: bufmin=0x%x  bufmax=0x%x\r\n", (unsigned int) &(bp->buf[0][0]), (unsigned int) &(bp->buf[POOL_NB_OF_BUFFER-1][0]));
+}
+
+/*******************************************************************************
+ BufPool_Pop
+
+ Takes the index of a free buffer from the free queue. Returns 0 or -1 if the
+ queue is empty. A slot that is not filled yet while the queue is not empty is
+ being filled by a thread that returns a buffer: wait for it rather than
+ report the pool empty.
+*******************************************************************************/
+static int BufPool_Pop(BufPool* bp, unsigned int* ix) {
+    BufPoolCell* cell;
+    unsigned long pos;
+    unsigned long seq;
+    long dif;
+    long left;
+    long low;
+    unsigned int spin = 0;
+
+    pos = __atomic_load_n(&(bp->free_deq), __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &(bp->free_q[pos & bp->q_mask]);
+        seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+        dif = (long) seq - (long) (pos + 1);
+        if (dif == 0) {
+            // The slot holds an index: try to claim it (pos is reloaded on failure)
+            if (__atomic_compare_exchange_n(&(bp->free_deq), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // Empty, unless a buffer is being put in that slot
+            if (__atomic_load_n(&(bp->free_enq), __ATOMIC_RELAXED) == pos) {
+                return (-1);
+            }
+            if ((++spin & 0x3F) == 0) {
+                sched_yield();
+            }
+            pos = __atomic_load_n(&(bp->free_deq), __ATOMIC_RELAXED);
+        } else {
+            // Another thread took that slot
+            pos = __atomic_load_n(&(bp->free_deq), __ATOMIC_RELAXED);
+        }
+    }
+
+    *ix = cell->ix;
+    // Hand the slot over to the producer of the next round
+    __atomic_store_n(&(cell->seq), pos + bp->q_mask + 1, __ATOMIC_RELEASE);
+
+    // Keep the lowest number of buffers left in the queue (low is reloaded on failure)
+    left = (long) __atomic_load_n(&(bp->free_enq), __ATOMIC_RELAXED) - (long) (pos + 1);
+    low = __atomic_load_n(&(bp->free_low), __ATOMIC_RELAXED);
+    while ((left < low) && (!__atomic_compare_exchange_n(&(bp->free_low), &low, left, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))) {
+    }
+    return (0);
+}
+
+/*******************************************************************************
+ BufPool_Push
+
+ Puts the index of a buffer that became free in the free queue. There are
+ never more free buffers than slots, so a slot that is not empty yet is still
+ being released by a thread that took a buffer: wait for it.
+*******************************************************************************/
+static void BufPool_Push(BufPool* bp, unsigned int ix) {
+    BufPoolCell* cell;
+    unsigned long pos;
+    unsigned long seq;
+    long dif;
+    unsigned int spin = 0;
+
+    pos = __atomic_load_n(&(bp->free_enq), __ATOMIC_RELAXED);
+    for (;;) {
+        cell = &(bp->free_q[pos & bp->q_mask]);
+        seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+        dif = (long) seq - (long) pos;
+        if (dif == 0) {
+            // The slot is empty: try to claim it (pos is reloaded on failure)
+            if (__atomic_compare_exchange_n(&(bp->free_enq), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (dif < 0) {
+            // The slot is still being released
+            if ((++spin & 0x3F) == 0) {
+                sched_yield();
+            }
+            pos = __atomic_load_n(&(bp->free_enq), __ATOMIC_RELAXED);
+        } else {
+            // Another thread filled that slot
+            pos = __atomic_load_n(&(bp->free_enq), __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->ix = ix;
+    // Make the index visible to the consumers
+    __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ BufPool_GetCache
+
+ Returns the cache of the calling thread, created at its first call after the
+ pool is opened, or NULL if the thread does not cache the buffers of this
+ pool.
+*******************************************************************************/
+static BufPoolCache* BufPool_GetCache(BufPool* bp) {
+    int n;
+    BufPoolCache* c;
+
+    if ((bufpool_cache_pool == bp) && (bufpool_cache_gen == bp->gen)) {
+        return (bufpool_cache);
+    }
+    // A thread does not cache another pool. If this pool was opened again, the old cache was freed by BufPool_Close()
+    if ((bp->mag_sz == 0) || ((bufpool_cache_pool != (BufPool*) 0) && (bufpool_cache_pool != bp))) {
+        return ((BufPoolCache*) 0);
+    }
+
+    bufpool_cache_pool = bp;
+    bufpool_cache_gen = bp->gen;
+    bufpool_cache = (BufPoolCache*) 0;
+    n = __atomic_fetch_add(&(bp->cache_nb), 1, __ATOMIC_RELAXED);
+    if (n >= POOL_MAX_CACHES) {
+        // Too many threads: this one uses the free queue directly
+        return ((BufPoolCache*) 0);
+    }
+    if ((c = (BufPoolCache*) calloc(1, sizeof(BufPoolCache))) == (BufPoolCache*) 0) {
+        return ((BufPoolCache*) 0);
+    }
+    bufpool_cache = c;
+    __atomic_store_n(&(bp->cache[n]), c, __ATOMIC_RELEASE);
+    return (c);
 }
 
 /*******************************************************************************
  BufPool_GiveBuffer
 *******************************************************************************/
 int BufPool_GiveBuffer(BufPool* bp, void** bu, unsigned char flags) {
-    int i;
+    unsigned int ix;
+    int n;
+    BufPoolCache* c = BufPool_GetCache(bp);
 
-    // There should be at least one free buffer in the array
-    if (bp->free_cnt) {
-        // Scan the array
-        for (i = 0; i < POOL_NB_OF_BUFFER; i++) {
-            // the current buffer should be the one which is free
-            if (bp->busy[bp->cur_buf_ix] == BUFFER_FREE) {
-                // if the count is consistent
-                if (bp->free_cnt > 1) {
-                    *bu = (void*) (&bp->buf[bp->cur_buf_ix][0]);
-                    bp->busy[bp->cur_buf_ix] = BUFFER_BUSY | flags;
-                    bp->cur_buf_ix = (bp->cur_buf_ix + 1) % POOL_NB_OF_BUFFER;
-                    bp->free_cnt--;
-                    /*
-                    printf("0 BufPool_GiveBuffer: buf=0x%x free_cnt=%d\n", (unsigned int) *bu, bp->free_cnt);
-                    */
-                    return (0);
-                }
-                // something went wrong with the free buffer count
-                else {
-                    *bu = (void*) 0;
-                    // printf("BufPool_GiveBuffer: no buffer! free_cnt=%d cur_buf_ix=%d\r\n", bp->free_cnt, bp->cur_buf_ix);
-                    return (ERR_BUFPOOL_BUFFER_FREE_COUNT_UNDERRANGE);
-                }
-            } else
-            // Move to the next buffer in the array
-            {
-                bp->cur_buf_ix = (bp->cur_buf_ix + 1) % POOL_NB_OF_BUFFER;
+    if (c) {
+        if (c->cnt > 0) {
+            c->hit_cnt++;
+        } else {
+            // Refill the cache with up to one magazine
+            for (n = 0; (n < (int) bp->mag_sz) && (BufPool_Pop(bp, &(c->ix[n])) == 0); n++) {
+            }
+            if (n > 0) {
+                __atomic_store_n(&(c->cnt), n, __ATOMIC_RELAXED);
+                c->refill_cnt++;
             }
         }
-        // there was presumably at least one free buffer but we could not find it
-        *bu = (void*) 0;
-        return (ERR_BUFPOOL_FREE_BUFFER_NOT_FOUND);
-    } else
-    // No free buffer
-    {
+    }
+
+    if (c && (c->cnt > 0)) {
+        ix = c->ix[c->cnt - 1];
+        __atomic_store_n(&(c->cnt), c->cnt - 1, __ATOMIC_RELAXED);
+        c->give_cnt++;
+    } else if (c || (BufPool_Pop(bp, &ix) < 0)) {
+        // No free buffer
+        __atomic_fetch_add(&(bp->fail_cnt), 1, __ATOMIC_RELAXED);
         *bu = (void*) 0;
-        // printf("BufPool_GiveBuffer: no buffer! free_cnt=%d cur_buf_ix=%d\r\n", bp->free_cnt, bp->cur_buf_ix);
+        // printf("BufPool_GiveBuffer: no buffer!\r\n");
         return (ERR_BUFPOOL_NO_FREE_BUFFER);
     }
+
+    __atomic_store_n(&(bp->busy[ix]), (unsigned char) (BUFFER_BUSY | flags), __ATOMIC_RELAXED);
+    *bu = (void*) BUFPOOL_ADDR(bp, ix);
+    /*
+    printf("0 BufPool_GiveBuffer: buf=0x%x\n", (unsigned int) *bu);
+    */
+    return (0);
 }
 
 /*******************************************************************************
  BufPool_ReturnBuffer
+
+ The address may point anywhere in the buffer.
 *******************************************************************************/
 void BufPool_ReturnBuffer(void* bv, unsigned long bu) {
     unsigned long ix;
-    unsigned long ba;
+    unsigned char prv;
+    int n;
+    BufPoolCache* c;
     BufPool* bp = (BufPool*) bv;
 
     // Check that the address of the buffer is reasonable
-    if ((bu > (unsigned long) &(bp->buf[POOL_NB_OF_BUFFER - 1][POOL_BUFFER_SIZE - 1])) ||
-        (bu < (unsigned long) &(bp->buf[0][0]))) {
+    if (!BUFPOOL_OWNS(bp, bu)) {
         /*
-        printf("BufPool_ReturnBuffer: invalid buffer 0x%x (range: 0x%x 0x%x)\r\n",
+        printf("BufPool_ReturnBuffer: invalid buffer 0x%lx (range: 0x%lx 0x%lx)\r\n",
             bu,
-            (unsigned int) &(bp->buf[0][0]),
-            (unsigned int) &(bp->buf[POOL_NB_OF_BUFFER-1][POOL_BUFFER_SIZE-1]));
+            (unsigned long) bp->buf,
+            (unsigned long) BUFPOOL_ADDR(bp, bp->buf_nb));
         */
+        return;
     }
 
-    // Calculate buffer offset from first address
-    ba = (bu - ((unsigned long) &(bp->buf[0][0])));
+    // Derive buffer index from its address
+    ix = BUFPOOL_INDEX(bp, bu);
+    BufPool_HoldEnd(bp, (void*) bu);
 
-    if (ba % POOL_BUFFER_SIZE) {
-        /*
-        printf("BufPool_ReturnBuffer: invalid buffer offset %d (buffer 0x%x range: 0x%x 0x%x)\r\n",
-            ba,
-            bu,
-            (unsigned int) &(bp->buf[0][0]),
-            (unsigned int) &(bp->buf[POOL_NB_OF_BUFFER-1][POOL_BUFFER_SIZE-1]));
-        */
-    }
+    // Only buffers marked busy can be returned. A buffer is owned by a single thread until it is returned, so
+    // the flag does not need an atomic exchange.
+    prv = __atomic_load_n(&(bp->busy[ix]), __ATOMIC_RELAXED);
+    if ((prv & BUFFER_BUSY) == BUFFER_BUSY) {
+        __atomic_store_n(&(bp->busy[ix]), (unsigned char) BUFFER_FREE, __ATOMIC_RELAXED);
+        if ((c = BufPool_GetCache(bp)) == (BufPoolCache*) 0) {
+            BufPool_Push(bp, (unsigned int) ix);
+            return;
+        }
 
-    // Derive buffer index from its address
-    ix = ba / POOL_BUFFER_SIZE;
-
-    // Only buffers marked busy can be returned
-    if ((bp->busy[ix] & BUFFER_BUSY) == BUFFER_BUSY) {
-        bp->busy[ix] = BUFFER_FREE;
-        // Make sure the count of free buffer is in range
-        if (bp->free_cnt < POOL_NB_OF_BUFFER) {
-            bp->free_cnt++;
-            /*
-            printf("0 BufPool_ReturnBuffer: buf=0x%x ix=%d free_cnt=%d\r\n",
-                    (unsigned int) bu,
-                    ix,
-                    bp->free_cnt);
-            */
-        } else {
-            /*
-            printf("BufPool_ReturnBuffer: free buffer overrange %d (buffer 0x%x range: 0x%x 0x%x)\r\n",
-                bp->free_cnt,
-                (unsigned int) bu,
-                (unsigned int) &(bp->buf[0][0]),
-                (unsigned int) &(bp->buf[POOL_NB_OF_BUFFER-1][POOL_BUFFER_SIZE-1]));
-            */
+        // When the cache is full, give its oldest magazine back to the free queue
+        if (c->cnt == (int) (2 * bp->mag_sz)) {
+            for (n = 0; n < (int) bp->mag_sz; n++) {
+                BufPool_Push(bp, c->ix[n]);
+            }
+            memmove(&(c->ix[0]), &(c->ix[bp->mag_sz]), bp->mag_sz * sizeof(c->ix[0]));
+            __atomic_store_n(&(c->cnt), (int) bp->mag_sz, __ATOMIC_RELAXED);
+            c->flush_cnt++;
         }
+        c->ix[c->cnt] = (unsigned int) ix;
+        __atomic_store_n(&(c->cnt), c->cnt + 1, __ATOMIC_RELAXED);
     } else {
         /*
-        printf("BufPool_ReturnBuffer: buffer not busy buf=0x%x ix=%d free_cnt=%d cur_buf_ix=%d flags=0x%x\r\n",
+        printf("BufPool_ReturnBuffer: buffer not busy buf=0x%x ix=%d flags=0x%x\r\n",
             bu,
             ix,
-            bp->free_cnt,
-            bp->cur_buf_ix,
-            bp->busy[ix]);
+            prv);
         */
     }
 }
 
 /*******************************************************************************
  BufPool_GetFreeCnt
+
+ Number of buffers in the free queue and in the caches of the threads. May be
+ slightly off while other threads give or return buffers.
 *******************************************************************************/
 int BufPool_GetFreeCnt(BufPool* bp) {
-    return (bp->free_cnt);
+    long cnt;
+    int i;
+    BufPoolCache* c;
+
+    cnt = (long) (__atomic_load_n(&(bp->free_enq), __ATOMIC_RELAXED) - __atomic_load_n(&(bp->free_deq), __ATOMIC_RELAXED));
+    for (i = 0; (i < __atomic_load_n(&(bp->cache_nb), __ATOMIC_RELAXED)) && (i < POOL_MAX_CACHES); i++) {
+        if ((c = __atomic_load_n(&(bp->cache[i]), __ATOMIC_ACQUIRE)) != (BufPoolCache*) 0) {
+            cnt += __atomic_load_n(&(c->cnt), __ATOMIC_RELAXED);
+        }
+    }
+    if (cnt < 0) {
+        cnt = 0;
+    } else if (cnt > (long) bp->buf_nb) {
+        cnt = (long) bp->buf_nb;
+    }
+    return ((int) cnt);
+}
+
+/*******************************************************************************
+ BufPool_FlushCache
+
+ Gives all the buffers of the cache of the calling thread back to the free
+ queue. Called by threads that stop using the pool or only use it from time to
+ time.
+*******************************************************************************/
+void BufPool_FlushCache(BufPool* bp) {
+    int n;
+    BufPoolCache* c;
+
+    if ((bufpool_cache_pool != bp) || (bufpool_cache_gen != bp->gen) || ((c = bufpool_cache) == (BufPoolCache*) 0) ||
+        (c->cnt == 0)) {
+        return;
+    }
+    for (n = 0; n < c->cnt; n++) {
+        BufPool_Push(bp, c->ix[n]);
+    }
+    __atomic_store_n(&(c->cnt), 0, __ATOMIC_RELAXED);
+    c->flush_cnt++;
+}
+
+/*******************************************************************************
+ BufPool_GetCacheStats
+
+ Totals over the caches of all threads: buffers given, buffers given from a
+ cache, refills and flushes of the caches.
+*******************************************************************************/
+void BufPool_GetCacheStats(BufPool* bp, unsigned long long* give, unsigned long long* hit, unsigned long long* refill, unsigned long long* flush) {
+    int i;
+    BufPoolCache* c;
+
+    *give = 0;
+    *hit = 0;
+    *refill = 0;
+    *flush = 0;
+    for (i = 0; (i < __atomic_load_n(&(bp->cache_nb), __ATOMIC_RELAXED)) && (i < POOL_MAX_CACHES); i++) {
+        if ((c = __atomic_load_n(&(bp->cache[i]), __ATOMIC_ACQUIRE)) != (BufPoolCache*) 0) {
+            *give += c->give_cnt;
+            *hit += c->hit_cnt;
+            *refill += c->refill_cnt;
+            *flush += c->flush_cnt;
+        }
+    }
+}
+
+/*******************************************************************************
+ BufPool_GetLowWater
+
+ Lowest number of buffers left in the free queue since the previous call.
+ Buffers kept in the caches of the threads are not counted.
+*******************************************************************************/
+int BufPool_GetLowWater(BufPool* bp) {
+    long cur;
+    long low;
+
+    cur = (long) (__atomic_load_n(&(bp->free_enq), __ATOMIC_RELAXED) - __atomic_load_n(&(bp->free_deq), __ATOMIC_RELAXED));
+    low = __atomic_exchange_n(&(bp->free_low), cur, __ATOMIC_RELAXED);
+    if (cur < low) {
+        low = cur;
+    }
+    if (low < 0) {
+        low = 0;
+    }
+    return ((int) low);
+}
+
+/*******************************************************************************
+ BufPool_GetFailCnt
+
+ Number of buffers requested when none was free since the pool was opened.
+*******************************************************************************/
+unsigned long long BufPool_GetFailCnt(BufPool* bp) {
+    return (__atomic_load_n(&(bp->fail_cnt), __ATOMIC_RELAXED));
+}
+
+/*******************************************************************************
+ BufPool_HoldBegin
+
+ Records that a buffer holds a frame of source src which arrived at time ts
+ (ns, same clock as Time_GetNs(), 0: now). The address may point anywhere in
+ the buffer; addresses outside of the pool are ignored.
+*******************************************************************************/
+void BufPool_HoldBegin(BufPool* bp, void* bu, int src, unsigned long long ts) {
+    unsigned long ix;
+
+    if ((!BUFPOOL_OWNS(bp, bu)) || (src < 0) || (src >= POOL_HOLD_SRC_NB)) {
+        return;
+    }
+    ix = BUFPOOL_INDEX(bp, bu);
+    bp->hold_src[ix] = (unsigned char) src;
+    bp->hold_ts[ix] = ts ? ts : Time_GetNs();
+}
+
+/*******************************************************************************
+ BufPool_HoldEnd
+
+ Adds the time a buffer was held since BufPool_HoldBegin() to the histogram
+ of its source. Called when the buffer is recycled, by BufPool_ReturnBuffer()
+ or by the owner of a buffer lent by the pool.
+*******************************************************************************/
+void BufPool_HoldEnd(BufPool* bp, void* bu) {
+    unsigned long ix;
+    unsigned long long now;
+    unsigned long long us;
+    int src;
+    int bin;
+
+    if (!BUFPOOL_OWNS(bp, bu)) {
+        return;
+    }
+    ix = BUFPOOL_INDEX(bp, bu);
+    if (bp->hold_ts[ix] == 0) {
+        return;
+    }
+
+    now = Time_GetNs();
+    us = (now > bp->hold_ts[ix]) ? ((now - bp->hold_ts[ix]) / 1000) : 0;
+    bp->hold_ts[ix] = 0;
+    src = bp->hold_src[ix];
+
+    bin = (us < 2) ? 0 : (63 - __builtin_clzll(us));
+    if (bin >= POOL_HOLD_BIN_NB) {
+        bin = POOL_HOLD_BIN_NB - 1;
+    }
+    __atomic_fetch_add(&(bp->hold_hist[src][bin]), 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(bp->hold_sum_us[src]), us, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ BufPool_GetHoldHist
+
+ Gives the histogram of the hold time of the buffers of source src recycled
+ since the previous call, and their total hold time in microseconds. Returns
+ the number of buffers. Must be called from a single thread.
+*******************************************************************************/
+unsigned long long BufPool_GetHoldHist(BufPool* bp, int src, unsigned long long* hist, unsigned long long* sum_us) {
+    unsigned long long tot;
+    unsigned long long cur;
+    int i;
+
+    tot = 0;
+    for (i = 0; i < POOL_HOLD_BIN_NB; i++) {
+        cur = __atomic_load_n(&(bp->hold_hist[src][i]), __ATOMIC_RELAXED);
+        hist[i] = cur - bp->hold_hist_lst[src][i];
+        bp->hold_hist_lst[src][i] = cur;
+        tot += hist[i];
+    }
+    cur = __atomic_load_n(&(bp->hold_sum_us[src]), __ATOMIC_RELAXED);
+    *sum_us = cur - bp->hold_sum_lst[src];
+    bp->hold_sum_lst[src] = cur;
+    return (tot);
 }
 
 /*******************************************************************************
@@ -167,15 +632,49 @@ int BufPool_GetFreeCnt(BufPool* bp) {
 *******************************************************************************/
 unsigned char BufPool_GetBufferFlags(BufPool* bp, void* bu) {
     unsigned long ix;
-    unsigned long ba;
-
-    // Calculate buffer offset from first address
-    ba = (((unsigned long) bu) - ((unsigned long) &(bp->buf[0][0])));
 
     // Derive buffer index from its address
-    ix = ba / POOL_BUFFER_SIZE;
+    ix = BUFPOOL_INDEX(bp, bu);
     /*
     printf("BufPool_GetBufferFlags: buf=0x%x ix=%d flags=0x%x\r\n", bu, ix, bp->busy[ix]);
     */
     return (bp->busy[ix]);
 }
+
+/*******************************************************************************
+ BufPool_AddRef
+
+ Adds a consumer to a buffer that is already used. The address may point
+ anywhere in the buffer; addresses outside of the pool are ignored.
+*******************************************************************************/
+void BufPool_AddRef(BufPool* bp, void* bu) {
+    if (!BUFPOOL_OWNS(bp, bu)) {
+        return;
+    }
+    __atomic_fetch_add(&(bp->ref[BUFPOOL_INDEX(bp, bu)]), 1, __ATOMIC_RELAXED);
+}
+
+/*******************************************************************************
+ BufPool_DropRef
+
+ Called by a consumer of a buffer when it no longer uses it. Returns the
+ number of consumers that still use the buffer: when it is 0 the caller was
+ the last one and recycles the buffer. May be called from any thread.
+*******************************************************************************/
+int BufPool_DropRef(BufPool* bp, void* bu) {
+    unsigned long ix;
+    int prv;
+
+    if (!BUFPOOL_OWNS(bp, bu)) {
+        return (0);
+    }
+    ix = BUFPOOL_INDEX(bp, bu);
+
+    // The count is of the consumers beyond the first: it goes below 0 only for the last one, which restores it
+    prv = __atomic_fetch_sub(&(bp->ref[ix]), 1, __ATOMIC_ACQ_REL);
+    if (prv > 0) {
+        return (prv);
+    }
+    __atomic_store_n(&(bp->ref[ix]), 0, __ATOMIC_RELAXED);
+    return (0);
+}
@@ -17,10 +17,51 @@
   returned to the buffer manager by the user application or by the driver
   to which this buffer will be passed.
 
+  The free buffers are kept in a bounded lock-free queue of buffer indices
+  so that buffers can be given and returned in constant time from any thread
+  without an external mutex.
+
+  The number and the size of the buffers are set at run time. The buffers
+  are allocated in BufPool_Open() in one region backed by huge pages when
+  possible, optionally bound to a NUMA node, and prefaulted.
+
+  Each thread that gives or returns buffers gets a small cache of free
+  buffer indices (a magazine) in front of the shared free queue. Buffers are
+  taken from and put in the cache of the calling thread; the cache is
+  refilled from the free queue when it is empty and half of it is flushed to
+  the free queue when it is full, so the shared queue positions are only
+  touched once every mag_sz operations.
+
+  Which thread gives and returns which buffers:
+  - a receive thread takes the buffers its sockets receive into, and returns
+    those that carried a command reply or were not used;
+  - the event builder returns the buffers of data frames once they are
+    written to the output, unless the storage thread holds them too;
+  - the storage thread returns the buffers it was handed once it has decoded
+    their frame;
+  - the command thread returns the buffers dropped by EventBuilder_Flush(),
+    and the uring backend takes and returns the buffers it lends when it is
+    opened and closed.
+  Threads that only occasionally use the pool flush their cache with
+  BufPool_FlushCache() so that no buffer stays stranded in it.
+  A thread that used a pool before it was closed gets a new cache when the
+  pool is opened again.
+
+  Added occupancy instrumentation: the lowest number of buffers left in the
+  free queue, the count of buffers that could not be given, and a histogram
+  per source (FEM) of the time a buffer is held from the arrival of its
+  frame (BufPool_HoldBegin()) until it is recycled.
+
+  A buffer can be shared by several consumers: each one beyond the first
+  takes a reference with BufPool_AddRef() and every consumer calls
+  BufPool_DropRef() when it is done. Only the last one to drop its reference
+  gets 0 and recycles the buffer.
+
 *******************************************************************************/
 #ifndef BUFPOOL_H
 #define BUFPOOL_H
 
+// Default number and size of the buffers
 #ifdef JUMBO_POOL
 #define POOL_NB_OF_BUFFER 512
 #define POOL_BUFFER_SIZE 8192
@@ -28,7 +69,16 @@
 #define POOL_NB_OF_BUFFER 32
 #define POOL_BUFFER_SIZE 2048
 #endif
+#define POOL_MAX_NB_OF_BUFFER 65536 // buffer indices are 16-bit in the io_uring provided buffer ring
+#define POOL_MIN_BUFFER_SIZE 2048
+#define POOL_MAX_BUFFER_SIZE 65536
 #define POOL_BUFFER_ALIGNMENT 32
+#define POOL_CACHE_LINE 64
+#define POOL_MAX_CACHES 16   // maximum number of threads with a buffer cache
+#define POOL_MAG_SIZE 16     // default number of buffers moved at once between a cache and the free queue
+#define POOL_MAX_MAG_SIZE 64 // maximum number of buffers moved at once between a cache and the free queue
+#define POOL_HOLD_SRC_NB 32  // number of sources (FEMs) the hold time is histogrammed for
+#define POOL_HOLD_BIN_NB 24  // hold time histogram: bin b counts [2^b, 2^(b+1)) us, bin 0 from 0, the last one up to infinity
 
 // Buffer attribute flags
 #define BUFFER_FREE 0
@@ -36,23 +86,79 @@
 #define AUTO_RETURNED 0
 #define USER_RETURNED 2
 
+// Slot of the free queue: seq tells whether the slot holds a buffer index for the consumer or is empty for the producer
+typedef struct _BufPoolCell {
+    unsigned long seq;
+    unsigned int ix;
+} BufPoolCell;
+
+// Cache of free buffers of one thread: up to 2 * mag_sz buffer indices, used as a stack
+typedef struct _BufPoolCache {
+    unsigned int ix[2 * POOL_MAX_MAG_SIZE];
+    int cnt;                       // number of buffers in the cache
+    unsigned long long give_cnt;   // buffers given to this thread
+    unsigned long long hit_cnt;    // buffers given from the cache without accessing the free queue
+    unsigned long long refill_cnt; // refills of the cache from the free queue
+    unsigned long long flush_cnt;  // flushes of half of the cache to the free queue
+    unsigned char pad[POOL_CACHE_LINE];
+} BufPoolCache;
+
 typedef struct _BufPool {
-#ifdef WIN32
-    unsigned char buf[POOL_NB_OF_BUFFER][POOL_BUFFER_SIZE];
-#elif defined LINUX
-    unsigned char buf[POOL_NB_OF_BUFFER][POOL_BUFFER_SIZE];
-#else
-    unsigned char buf[POOL_NB_OF_BUFFER][POOL_BUFFER_SIZE] __attribute__((aligned(POOL_BUFFER_ALIGNMENT)));
-#endif
-    unsigned char busy[POOL_NB_OF_BUFFER];
-    unsigned int cur_buf_ix;
-    unsigned int free_cnt;
+    unsigned char* buf;   // buf_nb buffers of buf_sz bytes
+    unsigned int buf_nb;  // number of buffers
+    unsigned int buf_sz;  // size of a buffer (multiple of POOL_BUFFER_ALIGNMENT)
+    int numa_node;        // NUMA node the buffers are bound to (-1: none)
+    int pages;            // kind of pages backing the buffers (MEMORY_PAGES_...)
+    unsigned long map_sz; // size of the region holding the buffers
+
+    unsigned char* busy;   // flags of each buffer
+    BufPoolCell* free_q;   // queue of the indices of the free buffers
+    unsigned long q_mask;  // slots of the free queue - 1: at least twice the buffers so that it is never full
+
+    unsigned int mag_sz;                   // buffers moved at once between a cache and the free queue (0: no cache)
+    int cache_nb;                          // number of caches created
+    BufPoolCache* cache[POOL_MAX_CACHES];  // cache of each thread that used the pool
+    unsigned long gen;                     // generation of the pool, new at each BufPool_Open()
+
+    // Queue positions on separate cache lines: they are updated by different threads
+    unsigned char pad0[POOL_CACHE_LINE];
+    unsigned long free_enq; // position where the next returned buffer is put
+    unsigned char pad1[POOL_CACHE_LINE - sizeof(unsigned long)];
+    unsigned long free_deq; // position where the next buffer given is taken
+    unsigned char pad2[POOL_CACHE_LINE - sizeof(unsigned long)];
+
+    // Occupancy, updated when the free queue is accessed or when a buffer is recycled
+    long free_low;                  // lowest number of buffers left in the free queue since the last BufPool_GetLowWater()
+    unsigned long long fail_cnt;    // buffers requested when none was free
+    unsigned long long* hold_ts;    // arrival time (ns) of the frame in each buffer (0: not tracked)
+    unsigned char* hold_src;        // source of the frame in each buffer
+    int* ref;                       // number of consumers of each buffer beyond the first
+    unsigned long long hold_hist[POOL_HOLD_SRC_NB][POOL_HOLD_BIN_NB];     // histogram of the hold time per source
+    unsigned long long hold_sum_us[POOL_HOLD_SRC_NB];                     // total hold time per source (us)
+    unsigned long long hold_hist_lst[POOL_HOLD_SRC_NB][POOL_HOLD_BIN_NB]; // histogram at the time of the last report
+    unsigned long long hold_sum_lst[POOL_HOLD_SRC_NB];                    // total hold time at the time of the last report
 } BufPool;
 
+// Address of a buffer, index of the buffer containing an address and test that an address is in a buffer
+#define BUFPOOL_ADDR(bp, ix) ((bp)->buf + (unsigned long) (ix) * (bp)->buf_sz)
+#define BUFPOOL_INDEX(bp, adr) ((unsigned long) ((unsigned char*) (adr) - (bp)->buf) / (bp)->buf_sz)
+#define BUFPOOL_OWNS(bp, adr) (((unsigned char*) (adr) >= (bp)->buf) && ((unsigned char*) (adr) < ((bp)->buf + (unsigned long) (bp)->buf_nb * (bp)->buf_sz)))
+
 void BufPool_Init(BufPool* bp);
+int BufPool_Open(BufPool* bp);
+void BufPool_Close(BufPool* bp);
 int BufPool_GiveBuffer(BufPool* bp, void** bu, unsigned char flags);
 void BufPool_ReturnBuffer(void* bv, unsigned long bu);
 int BufPool_GetFreeCnt(BufPool* bp);
+void BufPool_FlushCache(BufPool* bp);
+void BufPool_GetCacheStats(BufPool* bp, unsigned long long* give, unsigned long long* hit, unsigned long long* refill, unsigned long long* flush);
+int BufPool_GetLowWater(BufPool* bp);
+unsigned long long BufPool_GetFailCnt(BufPool* bp);
+void BufPool_HoldBegin(BufPool* bp, void* bu, int src, unsigned long long ts);
+void BufPool_HoldEnd(BufPool* bp, void* bu);
+unsigned long long BufPool_GetHoldHist(BufPool* bp, int src, unsigned long long* hist, unsigned long long* sum_us);
 unsigned char BufPool_GetBufferFlags(BufPool* bp, void* bu);
+void BufPool_AddRef(BufPool* bp, void* bu);
+int BufPool_DropRef(BufPool* bp, void* bu);
 
 #endif
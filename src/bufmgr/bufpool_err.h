@@ -25,5 +25,7 @@
 #define ERR_BUFPOOL_BUFFER_FREE_COUNT_OVERRANGE -404
 #define ERR_BUFPOOL_INVALID_BUFFER_ADDRESS -405
 #define ERR_BUFPOOL_MISALIGNED_BUFFER_ADDRESS -406
+#define ERR_BUFPOOL_ALLOC_FAILED -407
+#define ERR_BUFPOOL_ILLEGAL_SIZE -408
 
 #endif
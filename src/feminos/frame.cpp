@@ -24,14 +24,26 @@
    full events at the output of the event builder which can be up to 7.5 MB.
    The size has therefore to be coded on a 32-bit integer.
 
+   Added Frame_ExtractAdcRun(): the ADC samples of a channel are consecutive
+   words, so the whole run is found and masked 8 or 16 words at a time with
+   SSE2 or AVX2 (chosen at run time) instead of word by word. It is used by
+   Frame_ToSharedMemory() when samples are not printed.
+
 *******************************************************************************/
 
 #include "frame.h"
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_ADC_RUN_X86
+#endif
+
 using namespace std;
 
 /*******************************************************************************
@@ -152,6 +164,134 @@ int Frame_GetEventTyNbTs(void* fr,
         return (-1);
     }
 }
+/*******************************************************************************
+ Frame_ExtractAdcRunScalar
+
+ Reference implementation of Frame_ExtractAdcRun(), one word at a time.
+*******************************************************************************/
+static int Frame_ExtractAdcRunScalar(const unsigned short* fr, const unsigned short* end, unsigned short* adc, int max) {
+    int n;
+
+    for (n = 0; (n < max) && (fr + n < end) && ((fr[n] & PFX_12_BIT_CONTENT_MASK) == PFX_ADC_SAMPLE); n++) {
+        adc[n] = GET_ADC_DATA(fr[n]);
+    }
+    return (n);
+}
+
+#ifdef FRAME_ADC_RUN_X86
+/*******************************************************************************
+ Frame_ExtractAdcRunSse2
+
+ 8 words at a time: the words whose 4 MSB's are the ADC sample prefix give
+ two 0xFF bytes each in the compare mask, the first other word ends the run.
+*******************************************************************************/
+static int Frame_ExtractAdcRunSse2(const unsigned short* fr, const unsigned short* end, unsigned short* adc, int max) {
+    const __m128i pfx_mask = _mm_set1_epi16((short) PFX_12_BIT_CONTENT_MASK);
+    const __m128i pfx_adc = _mm_set1_epi16((short) PFX_ADC_SAMPLE);
+    const __m128i data_mask = _mm_set1_epi16(0x0FFF);
+    __m128i w;
+    unsigned int m;
+    int n;
+
+    n = 0;
+    while ((n + 8 <= max) && (fr + n + 8 <= end)) {
+        w = _mm_loadu_si128((const __m128i*) (fr + n));
+        m = (unsigned int) _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(w, pfx_mask), pfx_adc));
+        if (m != 0xFFFF) {
+            // The run ends in these 8 words: finish it one word at a time
+            return (n + Frame_ExtractAdcRunScalar(fr + n, end, adc + n, __builtin_ctz(~m) / 2));
+        }
+        _mm_storeu_si128((__m128i*) (adc + n), _mm_and_si128(w, data_mask));
+        n += 8;
+    }
+    return (n + Frame_ExtractAdcRunScalar(fr + n, end, adc + n, max - n));
+}
+
+/*******************************************************************************
+ Frame_ExtractAdcRunAvx2
+
+ Same as Frame_ExtractAdcRunSse2() 16 words at a time.
+*******************************************************************************/
+__attribute__((target("avx2"))) static int Frame_ExtractAdcRunAvx2(const unsigned short* fr, const unsigned short* end, unsigned short* adc, int max) {
+    const __m256i pfx_mask = _mm256_set1_epi16((short) PFX_12_BIT_CONTENT_MASK);
+    const __m256i pfx_adc = _mm256_set1_epi16((short) PFX_ADC_SAMPLE);
+    const __m256i data_mask = _mm256_set1_epi16(0x0FFF);
+    __m256i w;
+    unsigned int m;
+    int n;
+
+    n = 0;
+    while ((n + 16 <= max) && (fr + n + 16 <= end)) {
+        w = _mm256_loadu_si256((const __m256i*) (fr + n));
+        m = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi16(_mm256_and_si256(w, pfx_mask), pfx_adc));
+        if (m != 0xFFFFFFFF) {
+            return (n + Frame_ExtractAdcRunScalar(fr + n, end, adc + n, __builtin_ctz(~m) / 2));
+        }
+        _mm256_storeu_si256((__m256i*) (adc + n), _mm256_and_si256(w, data_mask));
+        n += 16;
+    }
+    return (n + Frame_ExtractAdcRunSse2(fr + n, end, adc + n, max - n));
+}
+#endif
+
+/*******************************************************************************
+ Frame_GetAdcRun
+
+ Returns the implementation of Frame_ExtractAdcRun() called "scalar", "sse2"
+ or "avx2", or 0 if it is not available on this CPU.
+*******************************************************************************/
+FrameAdcRunFn Frame_GetAdcRun(const char* name) {
+    if (strcmp(name, "scalar") == 0) {
+        return (Frame_ExtractAdcRunScalar);
+    }
+#ifdef FRAME_ADC_RUN_X86
+    __builtin_cpu_init();
+    if (strcmp(name, "sse2") == 0) {
+        return (Frame_ExtractAdcRunSse2);
+    }
+    if ((strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")) {
+        return (Frame_ExtractAdcRunAvx2);
+    }
+#endif
+    return ((FrameAdcRunFn) 0);
+}
+
+/*******************************************************************************
+ Frame_SelectAdcRun
+
+ Picks the implementation of Frame_ExtractAdcRun() for the CPU. Setting the
+ environment variable FRAME_ADC_RUN to "scalar", "sse2" or "avx2" overrides
+ the choice (to compare them).
+*******************************************************************************/
+static FrameAdcRunFn Frame_SelectAdcRun() {
+    const char* sel = getenv("FRAME_ADC_RUN");
+    FrameAdcRunFn fn;
+
+    if (sel && ((fn = Frame_GetAdcRun(sel)) != (FrameAdcRunFn) 0)) {
+        return (fn);
+    }
+    if ((fn = Frame_GetAdcRun("avx2")) != (FrameAdcRunFn) 0) {
+        return (fn);
+    }
+    if ((fn = Frame_GetAdcRun("sse2")) != (FrameAdcRunFn) 0) {
+        return (fn);
+    }
+    return (Frame_ExtractAdcRunScalar);
+}
+
+/*******************************************************************************
+ Frame_ExtractAdcRun
+
+ fr points to the first word of a run of ADC samples. Copies the 12-bit
+ values of up to max consecutive ADC sample words to adc and returns their
+ number. No word is read at or beyond end.
+*******************************************************************************/
+int Frame_ExtractAdcRun(const unsigned short* fr, const unsigned short* end, unsigned short* adc, int max) {
+    static const FrameAdcRunFn fn = Frame_SelectAdcRun();
+
+    return (fn(fr, end, adc, max));
+}
+
 /*******************************************************************************
  Frame_ToSharedMemory
 *******************************************************************************/
@@ -224,7 +364,16 @@ void Frame_ToSharedMemory(void* fp, void* fr, int fr_sz, unsigned int vflg, daqI
             sz_rd += 2;
         }
         // Is it a prefix for 12-bit content?
-        else if ((*p & PFX_12_BIT_CONTENT_MASK) == PFX_ADC_SAMPLE) {
+        else if (((*p & PFX_12_BIT_CONTENT_MASK) == PFX_ADC_SAMPLE) && (dInfo->dataReady == 1) &&
+                 (bufferPosition < dInfo->bufferSize) && !((vflg & FRAME_PRINT_ALL) || (vflg & FRAME_PRINT_CHAN_DATA))) {
+            // Copy the whole run of samples at once
+            j = Frame_ExtractAdcRun(p, (unsigned short*) fr + fr_sz / 2, &Buffer[bufferPosition], dInfo->bufferSize - bufferPosition);
+            bufferPosition += j;
+            i += j;
+            p += j;
+            sz_rd += 2 * j;
+            si += j;
+        } else if ((*p & PFX_12_BIT_CONTENT_MASK) == PFX_ADC_SAMPLE) {
             r0 = GET_ADC_DATA(*p);
 
             if (bufferPosition >= dInfo->bufferSize) {
@@ -17,6 +17,9 @@
 
    September 2013: defined prefix PFX_SOBE_SIZE
 
+   Added Frame_ExtractAdcRun() to decode a run of ADC samples at once, and
+   Frame_GetAdcRun() to get each of its implementations (tests, benchmarks)
+
 *******************************************************************************/
 #ifndef FRAME_H
 #define FRAME_H
@@ -212,5 +215,9 @@ int Frame_GetEventTyNbTs(void* fr,
                          unsigned short* ev_tsl,
                          unsigned short* ev_tsm,
                          unsigned short* ev_tsh);
+int Frame_ExtractAdcRun(const unsigned short* fr, const unsigned short* end, unsigned short* adc, int max);
+
+typedef int (*FrameAdcRunFn)(const unsigned short*, const unsigned short*, unsigned short*, int);
+FrameAdcRunFn Frame_GetAdcRun(const char* name);
 
 #endif
@@ -19,6 +19,8 @@
 #include "cmdfetcher.h"
 #include "evbuilder.h"
 #include "femarray.h"
+#include "femring.h"
+#include "femuring.h"
 #include "frame.h"
 #include "os_al.h"
 #include "platform_spec.h"
@@ -54,6 +56,8 @@ int cur_fem;
 
 CmdFetcher cmdfetcher;
 FemArray femarray;
+FemRing femring;
+FemUring femuring;
 BufPool bufpool;
 EventBuilder eventbuilder;
 
@@ -124,6 +128,8 @@ void CleanSharedMemory(int s) {
 int main(int argc, char** argv) {
     CmdFetcher_Init(&cmdfetcher);
     FemArray_Clear(&femarray);
+    FemRing_Clear(&femring);
+    FemUring_Clear(&femuring);
     EventBuilder_Clear(&eventbuilder);
 
     std::string server_ip;
@@ -134,11 +140,23 @@ int main(int argc, char** argv) {
     std::string output_directory;
     bool version_flag = false;
     bool disable_aqs = false;
+    bool fixed_length_signals = false;
     std::string compression_option = "default";
     double stop_run_after_seconds = 0;
     unsigned int stop_run_after_entries = 0;
     bool allow_losing_events = false;
     bool skip_run_info = false;
+    std::vector<int> receive_cpus;
+    std::string receive_backend = "socket";
+    bool rcvbuf_auto = false;
+    bool single_socket = false;
+    bool busy_poll = false;
+    bool adaptive_credits = false;
+    unsigned int pool_buffers = POOL_NB_OF_BUFFER;
+    unsigned int pool_buffer_size = POOL_BUFFER_SIZE;
+    int pool_numa_node = -1;
+    unsigned int pool_cache = POOL_MAG_SIZE;
+    unsigned int decode_threads = 0;
 
     CLI::App app{"feminos-daq"};
 
@@ -182,7 +200,62 @@ int main(int argc, char** argv) {
             ->group("File Options")
             ->check(CLI::IsMember(feminos_daq_storage::StorageManager::GetCompressionOptions()));
     app.add_flag("--disable-aqs", disable_aqs, "Do not store data in aqs format. NOTE: aqs files may be created anyways but they will not have data")->group("File Options");
+    app.add_flag("--fixed-length-signals", fixed_length_signals, "Store every signal with 512 data points (zero padded) and no 'signal_lengths' branch, for readers of the older output format")
+            ->group("File Options");
     app.add_flag("--skip-run-info", skip_run_info, "Skip asking for run information and use default values (same as pressing enter)")->group("General");
+    app.add_option("--receive-batch", femarray.rcv_batch, "Maximum number of datagrams read from a FEM socket with a single system call (1: one datagram per call)")
+            ->group("Performance Options")
+            ->check(CLI::Range(1, MAX_RCV_BATCH));
+    app.add_option("--receive-backend", receive_backend, "How frames are received: 'socket' (one UDP socket per FEM), 'packet' (memory mapped AF_PACKET ring, requires CAP_NET_RAW and jumbo frames) or 'uring' (io_uring multishot receive, requires liburing and Linux 6.0)")
+            ->group("Performance Options")
+            ->check(CLI::IsMember({"socket", "packet", "uring"}));
+    app.add_option("--receive-threads", femarray.rcv_thread_nb, "Number of threads the FEM sockets are distributed to for reception")
+            ->group("Performance Options")
+            ->check(CLI::Range(1, MAX_RCV_THREADS));
+    app.add_option("--receive-cpus", receive_cpus, "Comma separated list of the CPU cores the receive threads are pinned to (one per thread, in order)")
+            ->group("Performance Options")
+            ->delimiter(',')
+            ->check(CLI::NonNegativeNumber);
+    app.add_flag("--single-socket", single_socket, "Receive the datagrams of all FEMs on a single UDP socket and dispatch them by source address (socket receive backend only)")
+            ->group("Performance Options");
+    app.add_flag("--rcvbuf-auto", rcvbuf_auto, "Double the receive buffer of a FEM socket each time the kernel drops datagrams on it (up to 64 MB, beyond net.core.rmem_max requires CAP_NET_ADMIN)")
+            ->group("Performance Options");
+    app.add_flag("--busy-poll", busy_poll, "Low latency mode: the receive thread and the event builder spin instead of sleeping (each uses a full CPU core)")
+            ->group("Performance Options");
+    app.add_option("--busy-poll-usec", femarray.busy_poll_usec, "With --busy-poll, time in microseconds the kernel busy polls the network device when a FEM socket is read (SO_BUSY_POLL, 0: not set)")
+            ->group("Performance Options")
+            ->check(CLI::Range(0, 1000000));
+    app.add_option("--credit-timeout", femarray.cred_timeout_ms, "Time in milliseconds without data from a FEM that has pending credits after which the credits are presumed lost and granted again (0: never)")
+            ->group("Performance Options")
+            ->check(CLI::Range(0, 3600000));
+    app.add_option("--event-timeout", eventbuilder.ev_timeout_ms, "Time in milliseconds without data for the event being built after which it is closed without the FEMs whose end of event is missing (0: never)")
+            ->group("Performance Options")
+            ->check(CLI::Range(0, 3600000));
+    app.add_option("--event-window", eventbuilder.ev_window, "Number of events the event builder assembles at the same time, so that a FEM may send the next events before the others finish the current one (1: one event at a time)")
+            ->group("Performance Options")
+            ->check(CLI::Range(1, EB_MAX_WINDOW));
+    app.add_option("--event-time-window", eventbuilder.ts_win, "In time stamp event builder mode (0x10), fragments of different FEMs whose time stamps differ by at most this number of ticks make one event")
+            ->group("Performance Options");
+    app.add_option("--event-time-wait", eventbuilder.ts_wait_ms, "In time stamp event builder mode (0x10), time in milliseconds an event waits for the FEMs that have sent nothing before it is built without them")
+            ->group("Performance Options")
+            ->check(CLI::Range(0, 60000));
+    app.add_flag("--adaptive-credits", adaptive_credits, "Size the credit window of each FEM from the measured request round trip time and slow it down when the event builder or the storage queue falls behind")
+            ->group("Performance Options");
+    app.add_option("--pool-buffers", pool_buffers, "Number of buffers in the receive buffer pool")
+            ->group("Performance Options")
+            ->check(CLI::Range(2, POOL_MAX_NB_OF_BUFFER));
+    app.add_option("--pool-buffer-size", pool_buffer_size, "Size in bytes of a buffer of the receive buffer pool (must hold the largest datagram sent by a FEM; the uring backend adds room for the header it receives before each datagram)")
+            ->group("Performance Options")
+            ->check(CLI::Range(POOL_MIN_BUFFER_SIZE, POOL_MAX_BUFFER_SIZE));
+    app.add_option("--pool-numa-node", pool_numa_node, "NUMA node the receive buffer pool is allocated on, normally the node of the network interface (/sys/class/net/<interface>/device/numa_node, -1: no binding)")
+            ->group("Performance Options")
+            ->check(CLI::Range(-1, 1023));
+    app.add_option("--pool-cache", pool_cache, "Number of buffers moved at once between the buffer cache of a thread and the shared buffer pool (0: no cache)")
+            ->group("Performance Options")
+            ->check(CLI::Range(0, POOL_MAX_MAG_SIZE));
+    app.add_option("--decode-threads", decode_threads, "Number of threads decoding the built events for the ROOT output in parallel, written in event order by the storage thread (0: decoded by the storage thread)")
+            ->group("Performance Options")
+            ->check(CLI::Range(0u, feminos_daq_storage::StorageManager::max_decode_threads));
 
     CLI11_PARSE(app, argc, argv);
 
@@ -197,6 +270,19 @@ int main(int argc, char** argv) {
     }
 
     femarray.verbose = verbose;
+    if (receive_backend == "packet") {
+        femarray.rcv_backend = RCV_BACKEND_PACKET;
+    } else if (receive_backend == "uring") {
+        femarray.rcv_backend = RCV_BACKEND_URING;
+    }
+    femarray.rcvbuf_auto = rcvbuf_auto ? 1 : 0;
+    femarray.single_sock = single_socket ? 1 : 0;
+    femarray.busy_poll = busy_poll ? 1 : 0;
+    femarray.cred_adapt = adaptive_credits ? 1 : 0;
+    eventbuilder.busy_poll = busy_poll ? 1 : 0;
+    for (size_t k = 0; k < receive_cpus.size() && k < MAX_RCV_THREADS; k++) {
+        femarray.rcv_thr[k].cpu = receive_cpus[k];
+    }
     cmdfetcher.verbose = verbose;
 
     auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
@@ -205,10 +291,12 @@ int main(int argc, char** argv) {
     storage_manager.SetOutputDirectory(output_directory);
     storage_manager.compression_option = compression_option;
     storage_manager.disable_aqs = disable_aqs;
+    storage_manager.event.fixed_length = fixed_length_signals;
     storage_manager.stop_run_after_seconds = stop_run_after_seconds;
     storage_manager.stop_run_after_entries = stop_run_after_entries;
     storage_manager.allow_losing_events = allow_losing_events;
     storage_manager.skip_run_info = skip_run_info;
+    storage_manager.decode_threads = decode_threads;
 
     stringIpToArray(server_ip, femarray.rem_ip_beg);
     stringIpToArray(local_ip, femarray.loc_ip);
@@ -266,8 +354,32 @@ int main(int argc, char** argv) {
 
     // Initialize Buffer Pool
     BufPool_Init(&bufpool);
+    bufpool.buf_nb = pool_buffers;
+    bufpool.buf_sz = pool_buffer_size;
+    if (femarray.rcv_backend == RCV_BACKEND_URING) {
+        // The uring backend receives a header and control messages before each datagram in the same buffer
+        bufpool.buf_sz += FEMURING_HDR_SIZE;
+        if (bufpool.buf_sz > POOL_MAX_BUFFER_SIZE) {
+            bufpool.buf_sz = POOL_MAX_BUFFER_SIZE;
+            printf("Warning: the uring receive backend only accepts datagrams of up to %u bytes with buffers of %u bytes\n",
+                   (unsigned int) (POOL_MAX_BUFFER_SIZE - FEMURING_HDR_SIZE), POOL_MAX_BUFFER_SIZE);
+        }
+    }
+    bufpool.numa_node = pool_numa_node;
+    bufpool.mag_sz = pool_cache;
+    if ((err = BufPool_Open(&bufpool)) < 0) {
+        printf("BufPool_Open failed: %d\n", err);
+        goto cleanup;
+    }
+    if (verbose) {
+        printf("Buffer pool: %u buffers of %u bytes (%s)\n", bufpool.buf_nb, bufpool.buf_sz,
+               (bufpool.pages == MEMORY_PAGES_HUGETLB) ? "huge pages" : ((bufpool.pages == MEMORY_PAGES_THP) ? "transparent huge pages" : "normal pages"));
+    }
 
-    // Open the array of FEM
+    // Open the array of FEM (the uring backend borrows buffers from the pool when it is opened)
+    femarray.bp = (void*) &bufpool;
+    femarray.ring = (void*) &femring;
+    femarray.uring = (void*) &femuring;
     if ((err = FemArray_Open(&femarray)) < 0) {
         printf("FemArray_Open failed: %d\n", err);
         goto cleanup;
@@ -289,12 +401,31 @@ int main(int argc, char** argv) {
     // Pass a pointer to the fem array to the event builder
     eventbuilder.fa = (void*) &femarray;
 
-    // Create FEM Array thread
-    femarray.thread.routine = reinterpret_cast<void (*)()>(FemArray_ReceiveLoop);
-    femarray.thread.param = (void*) &femarray;
+    // Let the storage manager stop the receive loop when it ends the run
+    feminos_daq_storage::StorageManager::Instance().stop_acquisition = []() {
+        femarray.state = 0;
+        FemArray_Wakeup(&femarray);
+    };
+
+    // Let the storage thread decode frames in their receive buffer and give the buffers back. A quarter of the pool
+    // at most is held this way: beyond that frames are copied so that the receive threads never run out of buffers
+    feminos_daq_storage::StorageManager::Instance().release_buffer = [](void* buf) {
+        FemArray_ReleaseBuffer(&femarray, buf);
+    };
+    feminos_daq_storage::StorageManager::Instance().flush_released = []() {
+        BufPool_FlushCache(&bufpool);
+    };
+    feminos_daq_storage::StorageManager::Instance().can_hold_buffer = [](const void* buf) {
+        return FemArray_CanHoldBuffer(&femarray, buf) != 0;
+    };
+    feminos_daq_storage::StorageManager::Instance().max_frames_held = bufpool.buf_nb / 4;
+    // The held frames are a small part of the storage queue, the rest is left for the copies and end of event markers
+    feminos_daq_storage::StorageManager::Instance().queue_capacity = 8 * (size_t) bufpool.buf_nb;
+
+    // Create FEM Array receive threads
     femarray.state = 1;
-    if ((err = Thread_Create(&femarray.thread)) < 0) {
-        printf("Thread_Create failed %d\n", err);
+    if ((err = FemArray_StartReceive(&femarray)) < 0) {
+        printf("FemArray_StartReceive failed %d\n", err);
         goto cleanup;
     }
 
@@ -310,14 +441,8 @@ int main(int argc, char** argv) {
     // Run the main loop of the command interpreter
     CmdFetcher_Main(&cmdfetcher);
 
-    /* wait until FEM array thread stops */
-    if (femarray.thread.thread_id >= 0) {
-        if (Thread_Join(&femarray.thread) < 0) {
-            printf("femarray: Thread_Join failed.\n");
-        } else {
-            printf("femarray: Thread_Join done.\n");
-        }
-    }
+    /* wait until FEM array threads stop */
+    FemArray_JoinReceive(&femarray);
 
     /* wait until event builder thread stops */
     if (eventbuilder.thread.thread_id >= 0) {
@@ -332,6 +457,13 @@ cleanup:
 
     socket_cleanup();
 
+    // The storage thread may still be decoding frames in buffers of the pool
+    if (feminos_daq_storage::StorageManager::Instance().WaitFramesReleased(std::chrono::seconds(5))) {
+        BufPool_Close(&bufpool);
+    } else {
+        printf("Warning: the storage thread still holds receive buffers, the buffer pool is not freed\n");
+    }
+
     if (sharedBuffer) {
         CleanSharedMemory(0);
     }
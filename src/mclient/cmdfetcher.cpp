@@ -72,7 +72,7 @@ void removeSpaces(char* str) {
 }
 
 /* Event Builder mode interpretation  */
-static char EventBuilder_Mode2str[16][40] = {
+static char EventBuilder_Mode2str[32][40] = {
         "transparent",                            // 0
         "active",                                 // 1
         "transparent",                            // 2
@@ -88,7 +88,23 @@ static char EventBuilder_Mode2str[16][40] = {
         "transparent",                            // 12
         "active with ts +-1 verify",              // 13
         "transparent",                            // 14
-        "active with event nb and ts +-1 verify"  // 15
+        "active with event nb and ts +-1 verify", // 15
+        "active by time stamp window",            // 16
+        "active by time stamp window",            // 17
+        "active by time stamp window",            // 18
+        "active by time stamp window",            // 19
+        "active by time stamp window",            // 20
+        "active by time stamp window",            // 21
+        "active by time stamp window",            // 22
+        "active by time stamp window",            // 23
+        "active by time stamp window",            // 24
+        "active by time stamp window",            // 25
+        "active by time stamp window",            // 26
+        "active by time stamp window",            // 27
+        "active by time stamp window",            // 28
+        "active by time stamp window",            // 29
+        "active by time stamp window",            // 30
+        "active by time stamp window"             // 31
 };
 
 /*******************************************************************************
@@ -566,8 +582,19 @@ int CmdFetcher_Main(CmdFetcher* cf) {
                         }
                         printf("FEM(%d) Credits = %d %s Request_Threshold = %d %s\n", j, fa->fp[j].req_credit, tmp_str,
                                fa->req_threshold, tmp_str);
+                        if (fa->fp[j].regrant_cnt) {
+                            printf("FEM(%d) Credits_Regranted = %u time(s)\n", j, fa->fp[j].regrant_cnt);
+                        }
+                        if (fa->fp[j].rcv_err_cnt) {
+                            printf("FEM(%d) Receive_Errors = %u (ICMP or interrupted, retried)\n", j, fa->fp[j].rcv_err_cnt);
+                        }
+                        if (fa->cred_adapt) {
+                            printf("FEM(%d) Window = %d %s Round_Trip = %.1f us\n", j, fa->fp[j].cred_win, tmp_str,
+                                   fa->fp[j].rtt_ns / 1000.0);
+                        }
                     } else if (param[0] == 1) {
                         fa->fp[j].req_credit = param[1];
+                        fa->fp[j].cred_win = param[1];
                         fa->req_threshold = param[2];
                     }
                     fa->fp[j].req_seq_nb = 0;
@@ -679,7 +706,7 @@ int CmdFetcher_Main(CmdFetcher* cf) {
         // Event Builder mode
         else if (strncmp(cmd, "event_builder", 13) == 0) {
             if (sscanf(cmd, "event_builder %i\n", &param[0]) == 1) {
-                if ((param[0] >= 0) && (param[0] < 16)) {
+                if ((param[0] >= 0) && (param[0] < 32)) {
                     eb->eb_mode = param[0];
                 }
             }
@@ -785,12 +812,15 @@ int CmdFetcher_Main(CmdFetcher* cf) {
 
     // Stop FEM array network receiver thread
     fa->state = 0;
+    if ((err = FemArray_Wakeup(fa)) < 0) {
+        printf("CmdFetcher_Main: FemArray_Wakeup failed %d\n", err);
+    }
 
     // Stop the event builder
     eb->state = 0;
     // Wakeup the event builder
-    if ((err = Semaphore_Signal(eb->sem_wakeup)) < 0) {
-        printf("CmdFetcher_Main: Semaphore_Signal failed %d\n", err);
+    if ((err = EventBuilder_Wakeup(eb)) < 0) {
+        printf("CmdFetcher_Main: EventBuilder_Wakeup failed %d\n", err);
         return (err);
     }
 
@@ -21,6 +21,45 @@ buffer left from a previous run when starting a new one.
    Added EventBuilder_CheckBuffer() to verify event number
 and timestamps depending on event builder mode
 
+   Buffers are given back with FemArray_ReleaseBuffer() because
+they may be frames of the packet ring instead of buffers of the pool
+
+   Added busy poll mode: the event builder spins on a flag set by
+the receive threads instead of waiting on its semaphore. The arrival
+time of each buffer is kept in the input queues and the latency from
+the arrival of the last frame of an event to the end of the built
+event is histogrammed (see EventBuilder_GetLatency())
+
+   The buffer cache of the event builder thread (see bufpool.h) is
+flushed when it stops, and that of the caller of EventBuilder_Flush()
+when the queues are flushed
+
+   The input and output queues are lock-free single-producer
+single-consumer rings (see EbRing in evbuilder.h): the receive threads
+post buffers without taking q_mutex, so they are never held up while the
+event builder processes and writes events
+
+   In active mode, an event that makes no progress for ev_timeout_ms is
+closed without the sources still pending. Their remaining frames of that
+event are dropped until they start a new one, so that a lost end of event
+frame no longer stalls event building for the rest of the run
+
+   In active mode, up to ev_window events are built at the same time
+(see EventBuilder_FindEvent()). The frames of an event that is not the
+oldest one are copied and their buffers recycled at once, so that a FEM
+ahead of the others gets credits back instead of waiting for the
+slowest one. Events are still written out in order
+
+   Added the time stamp mode (eb_mode & 0x10) for self-triggered FEMs:
+events are made of the fragments whose time stamps fall in a coincidence
+window, taken in time order across the input queues
+
+   Frames are passed to the storage thread in their receive buffer
+instead of being copied (see EventBuilder_ProcessBuffer()). The buffer is
+held until the storage thread has decoded the frame; frames staged for a
+later event, or passed when the storage thread already holds too many
+buffers, are still copied
+
 *******************************************************************************/
 
 #include "evbuilder.h"
@@ -29,6 +68,7 @@ and timestamps depending on event builder mode
 #include "frame.h"
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <fcntl.h>
 #include <filesystem>
@@ -119,6 +159,137 @@ void SemaphoreGreen(int id) {
     semop(id, &op, 1);
 }
 
+/*******************************************************************************
+ EbRing_Clear
+*******************************************************************************/
+static void EbRing_Clear(EbRing* r) {
+    r->wr = 0;
+    r->rd_lst = 0;
+    r->rd = 0;
+    r->wr_lst = 0;
+}
+
+/*******************************************************************************
+ EbRing_CanWrite
+
+ Producer side: returns 1 if an entry can be written at position wr, 0 if the
+ ring of size entries is full.
+*******************************************************************************/
+static int EbRing_CanWrite(EbRing* r, unsigned long size) {
+    if ((r->wr - r->rd_lst) >= size) {
+        r->rd_lst = __atomic_load_n(&(r->rd), __ATOMIC_ACQUIRE);
+        if ((r->wr - r->rd_lst) >= size) {
+            return (0);
+        }
+    }
+    return (1);
+}
+
+/*******************************************************************************
+ EbRing_Push
+
+ Producer side: publishes the entry written at position wr.
+*******************************************************************************/
+static void EbRing_Push(EbRing* r) {
+    __atomic_store_n(&(r->wr), r->wr + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ EbRing_CanRead
+
+ Consumer side: returns 1 if an entry can be read at position rd, 0 if the
+ ring is empty.
+*******************************************************************************/
+static int EbRing_CanRead(EbRing* r) {
+    if (r->rd == r->wr_lst) {
+        r->wr_lst = __atomic_load_n(&(r->wr), __ATOMIC_ACQUIRE);
+        if (r->rd == r->wr_lst) {
+            return (0);
+        }
+    }
+    return (1);
+}
+
+/*******************************************************************************
+ EbRing_Pop
+
+ Consumer side: frees the entry read at position rd.
+*******************************************************************************/
+static void EbRing_Pop(EbRing* r) {
+    __atomic_store_n(&(r->rd), r->rd + 1, __ATOMIC_RELEASE);
+}
+
+/*******************************************************************************
+ EbEvent_Reset
+
+ Empties an event. The memory allocated for its staged frames is kept.
+*******************************************************************************/
+static void EbEvent_Reset(EbEvent* ev) {
+    ev->exp_set = 0;
+    ev->src_set = 0;
+    ev->eoe_set = 0;
+    ev->lost_set = 0;
+    ev->has_ref = 0;
+    ev->ev_ty = 0;
+    ev->ev_nb = 0;
+    ev->ev_tsl = 0;
+    ev->ev_tsm = 0;
+    ev->ev_tsh = 0;
+    ev->arrival = 0;
+    ev->stage_sz = 0;
+}
+
+/*******************************************************************************
+ EbEvent_Stage
+
+ Appends a copy of a buffer to the frames of an event.
+*******************************************************************************/
+static int EbEvent_Stage(EbEvent* ev, void* bu) {
+    unsigned int sz;
+    unsigned int max;
+    unsigned char* stage;
+
+    // Buffer size including the size field, rounded to keep the next one aligned
+    sz = (*((unsigned short*) bu) + 7) & ~7U;
+
+    if ((ev->stage_sz + sz) > ev->stage_max) {
+        max = (ev->stage_max > 0) ? ev->stage_max : (64 * 1024);
+        while ((ev->stage_sz + sz) > max) {
+            max *= 2;
+        }
+        if ((stage = (unsigned char*) realloc(ev->stage, max)) == (unsigned char*) nullptr) {
+            printf("EbEvent_Stage: could not allocate %u bytes\n", max);
+            return (-1);
+        }
+        ev->stage = stage;
+        ev->stage_max = max;
+    }
+
+    memcpy(ev->stage + ev->stage_sz, bu, *((unsigned short*) bu));
+    ev->stage_sz += sz;
+    return (0);
+}
+
+/*******************************************************************************
+ EventBuilder_ResetWindow
+
+ Forgets all the events under re-assembly.
+*******************************************************************************/
+static void EventBuilder_ResetWindow(EventBuilder* eb) {
+    int i;
+
+    for (i = 0; i < EB_MAX_WINDOW; i++) {
+        EbEvent_Reset(&(eb->ev[i]));
+    }
+    eb->ev_head = 0;
+    eb->ev_tail = 0;
+    for (i = 0; i < MAX_NB_OF_SOURCES; i++) {
+        eb->src_seq[i] = 0;
+    }
+    eb->src_open = 0;
+    eb->had_sobe = 0;
+}
+
 /*******************************************************************************
  EventBuilder_Clear
 *******************************************************************************/
@@ -130,22 +301,22 @@ void EventBuilder_Clear(EventBuilder* eb) {
 
     // Clear input Queues
     for (i = 0; i < MAX_NB_OF_SOURCES; i++) {
+        EbRing_Clear(&(eb->q_i[i]));
         for (j = 0; j < MAX_QUEUE_SIZE; j++) {
             eb->q_buf_i[i][j] = (void*) nullptr;
+            eb->q_ts_i[i][j] = 0;
         }
-        eb->q_buf_i_rd[i] = 0;
-        eb->q_buf_i_wr[i] = 0;
-        eb->q_buf_i_sz[i] = 0;
     }
 
+    eb->busy_poll = 0;
+    eb->wake_flag = 0;
+
     // Clear output Queue
-    for (i = 0; i < MAX_QUEUE_SIZE; i++) {
+    EbRing_Clear(&(eb->q_o));
+    for (i = 0; i < MAX_OUT_QUEUE_SIZE; i++) {
         eb->q_buf_o[i] = (void*) nullptr;
         eb->q_src_o[i] = 0;
     }
-    eb->q_buf_o_rd = 0;
-    eb->q_buf_o_wr = 0;
-    eb->q_buf_o_sz = 0;
 
     eb->vflags = 0;
 
@@ -160,15 +331,37 @@ void EventBuilder_Clear(EventBuilder* eb) {
     sprintf(&(eb->file_path[0]), "");
 
     eb->eb_mode = 0;
-    eb->pnd_src = 0;
     eb->had_sobe = 0;
 
-    eb->src_had_soe = 0;
-    eb->cur_ev_ty = 0;
-    eb->cur_ev_nb = 0;
-    eb->cur_ev_tsl = 0;
-    eb->cur_ev_tsm = 0;
-    eb->cur_ev_tsh = 0;
+    eb->ev_window = 1;
+    for (i = 0; i < EB_MAX_WINDOW; i++) {
+        eb->ev[i].stage = (unsigned char*) nullptr;
+        eb->ev[i].stage_max = 0;
+    }
+    EventBuilder_ResetWindow(eb);
+    eb->stage_cnt = 0;
+
+    eb->ts_win = EB_TS_WINDOW;
+    eb->ts_wait_ms = EB_TS_WAIT_MS;
+    eb->ts_wait_ns = 0;
+
+    eb->ev_timeout_ms = EB_EVENT_TIMEOUT_MS;
+    eb->ev_last_ns = 0;
+    eb->resync_has_nb = 0;
+    eb->resync_ev_nb = 0;
+    eb->missing_src = 0;
+    eb->timeout_cnt = 0;
+    for (i = 0; i < MAX_NB_OF_SOURCES; i++) {
+        eb->src_timeout_cnt[i] = 0;
+        eb->src_timeout_lst[i] = 0;
+    }
+    eb->resync_drop_cnt = 0;
+
+    eb->ev_arrival = 0;
+    for (i = 0; i < EB_LAT_BIN_NB; i++) {
+        eb->lat_hist[i] = 0;
+        eb->lat_hist_lst[i] = 0;
+    }
 
     sprintf(&(eb->run_str[0]), "R???");
     eb->subrun_ix = 0;
@@ -206,6 +399,7 @@ int EventBuilder_Open(EventBuilder* eb) {
 *******************************************************************************/
 void EventBuilder_Close(EventBuilder* eb) {
     int err = 0;
+    int i;
 
     // Delete semaphore
     if (eb->sem_wakeup) {
@@ -227,6 +421,13 @@ void EventBuilder_Close(EventBuilder* eb) {
                     err);
         }
     }
+
+    // Free the frames staged for the events under re-assembly
+    for (i = 0; i < EB_MAX_WINDOW; i++) {
+        free(eb->ev[i].stage);
+        eb->ev[i].stage = (unsigned char*) nullptr;
+        eb->ev[i].stage_max = 0;
+    }
 }
 
 /*******************************************************************************
@@ -249,29 +450,29 @@ int EventBuilder_Flush(EventBuilder* eb) {
 
     // Flush input Queues
     for (src = 0; src < MAX_NB_OF_SOURCES; src++) {
-        while (eb->q_buf_i_rd[src] != eb->q_buf_i_wr[src]) {
+        while (EbRing_CanRead(&(eb->q_i[src]))) {
             // Get the buffer for the input queue of the
             // current source
-            buf = eb->q_buf_i[src][eb->q_buf_i_rd[src]];
+            buf = eb->q_buf_i[src][eb->q_i[src].rd & (MAX_QUEUE_SIZE - 1)];
             // printf("EventBuilder_Flush: dropping buffer
-            // 0x%x Source:%d i_rd=%d i_wr=%d i_sz=%d\n",
-            // buf, src, eb->q_buf_i_rd[src],
-            // eb->q_buf_i_wr[src], eb->q_buf_i_sz[src]);
-            eb->q_buf_i_rd[src] =
-                    (eb->q_buf_i_rd[src] + 1) % MAX_QUEUE_SIZE;
-            eb->q_buf_i_sz[src] = eb->q_buf_i_sz[src] - 1;
+            // 0x%x Source:%d i_rd=%lu\n",
+            // buf, src, eb->q_i[src].rd);
+            EbRing_Pop(&(eb->q_i[src]));
 
             // Return the buffer to the pool
-            BufPool_ReturnBuffer(fa->bp,
-                                 (unsigned long) buf);
+            FemArray_ReleaseBuffer(fa, buf);
         }
     }
 
-    eb->had_sobe = 0;
-    eb->pnd_src = 0;
-    // Next event does not have any Start of Event received
-    // yet
-    eb->src_had_soe = 0;
+    // This may run in the command thread which does not use the pool otherwise
+    BufPool_FlushCache((BufPool*) fa->bp);
+
+    // Forget the events under re-assembly
+    EventBuilder_ResetWindow(eb);
+    eb->ts_wait_ns = 0;
+    eb->ev_arrival = 0;
+    eb->ev_last_ns = 0;
+    eb->resync_has_nb = 0;
 
     // Release mutex to send over the network
     if ((err = Mutex_Unlock(eb->q_mutex)) < 0) {
@@ -287,8 +488,8 @@ int EventBuilder_Flush(EventBuilder* eb) {
 /*******************************************************************************
  EventBuilder_CheckBuffer
 *******************************************************************************/
-int EventBuilder_CheckBuffer(EventBuilder* eb, int src,
-                             void* bu) {
+int EventBuilder_CheckBuffer(EventBuilder* eb, EbEvent* ev,
+                             int src, void* bu) {
     void* fr;
     unsigned short ev_ty;
     unsigned int ev_nb;
@@ -301,40 +502,45 @@ int EventBuilder_CheckBuffer(EventBuilder* eb, int src,
     int err = 0;
 
     // See if we want to check event numbers and/or timestamps
-    if (eb->eb_mode & 0xE) {
+    // (they differ by design in time stamp mode)
+    if ((eb->eb_mode & 0xE) && !(eb->eb_mode & 0x10)) {
         // Check if this buffer if the first one for this
         // event for this source
-        if (!((eb->src_had_soe) & (1 << src))) {
+        if (!((ev->src_set) & (1 << src))) {
             // Skip size in buffer, start of frame and size
-            fr = (void*) ((unsigned int) bu + 6);
+            fr = (void*) ((unsigned char*) bu + 6);
 
             // Get the event type, number and timestamp
+            // The frame with the Start of Event may have
+            // been lost: nothing to check then
             if ((err = Frame_GetEventTyNbTs(
                          fr, &ev_ty, &ev_nb, &ev_tsl, &ev_tsm,
                          &ev_tsh)) < 0) {
                 printf(
                         "EventBuilder_CheckBuffer: "
-                        "Frame_GetEventTyNbTs failed %d\n",
-                        err);
-                return (err);
+                        "Src %02d no Start of Event\n",
+                        src);
+                ev->src_set |= (1 << src);
+                return (0);
             }
 
             // Is this the first source for this event?
-            if (eb->src_had_soe == 0) {
+            if (!ev->has_ref) {
                 // Take the event type, number and timestamp
                 // as a reference
-                eb->cur_ev_ty = ev_ty;
-                eb->cur_ev_nb = ev_nb;
-                eb->cur_ev_tsh = ev_tsh;
-                eb->cur_ev_tsm = ev_tsm;
-                eb->cur_ev_tsl = ev_tsl;
+                ev->ev_ty = ev_ty;
+                ev->ev_nb = ev_nb;
+                ev->ev_tsh = ev_tsh;
+                ev->ev_tsm = ev_tsm;
+                ev->ev_tsl = ev_tsl;
+                ev->has_ref = 1;
             } else {
                 match = 1;
 
                 // See if we want to check event numbers
                 if (eb->eb_mode & 0x2) {
-                    if ((eb->cur_ev_ty != ev_ty) ||
-                        (eb->cur_ev_nb != ev_nb)) {
+                    if ((ev->ev_ty != ev_ty) ||
+                        (ev->ev_nb != ev_nb)) {
                         match = 0;
                     }
                 }
@@ -342,9 +548,9 @@ int EventBuilder_CheckBuffer(EventBuilder* eb, int src,
                 // See if we want to check timestamps
                 // exactly
                 if (eb->eb_mode & 0x4) {
-                    if ((eb->cur_ev_tsh != ev_tsh) ||
-                        (eb->cur_ev_tsm != ev_tsm) ||
-                        (eb->cur_ev_tsl != ev_tsl)) {
+                    if ((ev->ev_tsh != ev_tsh) ||
+                        (ev->ev_tsm != ev_tsm) ||
+                        (ev->ev_tsl != ev_tsl)) {
                         match = 0;
                     }
                 }
@@ -358,11 +564,11 @@ int EventBuilder_CheckBuffer(EventBuilder* eb, int src,
                             (((unsigned int) ev_tsm) << 16) |
                             ((unsigned int) ev_tsl);
                     eb_ev_tsml =
-                            (((unsigned int) eb->cur_ev_tsm)
+                            (((unsigned int) ev->ev_tsm)
                              << 16) |
-                            ((unsigned int) eb->cur_ev_tsl);
+                            ((unsigned int) ev->ev_tsl);
 
-                    if ((eb->cur_ev_tsh != ev_tsh) &&
+                    if ((ev->ev_tsh != ev_tsh) &&
                         (ev_tsml != 0x00000000) &&
                         (ev_tsml != 0xFFFFFFFF)) {
                         match = 0;
@@ -389,21 +595,29 @@ int EventBuilder_CheckBuffer(EventBuilder* eb, int src,
                             "Expected: Event_Type 0x%x  "
                             "Event_Count 0x%08x  Time 0x%04x "
                             "0x%04x 0x%04x\n",
-                            eb->cur_ev_ty, eb->cur_ev_nb,
-                            eb->cur_ev_tsh, eb->cur_ev_tsm,
-                            eb->cur_ev_tsl);
+                            ev->ev_ty, ev->ev_nb,
+                            ev->ev_tsh, ev->ev_tsm,
+                            ev->ev_tsl);
                 }
             }
 
             // Remember we got the Start of Event from that
             // source
-            eb->src_had_soe |= (1 << src);
+            ev->src_set |= (1 << src);
         }
     }
     return (err);
 }
 
-int EventBuilder_ProcessBuffer(EventBuilder* eb, void* bu) {
+/*******************************************************************************
+ EventBuilder_ProcessBuffer
+
+ Prints, saves and passes a frame to the storage thread. When rcv is set, the
+ buffer is a receive buffer and the storage thread may get it in place: it
+ then holds the buffer until the frame is decoded. Otherwise (the buffer is
+ reused as soon as this returns) the storage thread gets a copy of the frame.
+*******************************************************************************/
+int EventBuilder_ProcessBuffer(EventBuilder* eb, void* bu, int rcv) {
     int err = 0;
     unsigned short* bu_s;
     unsigned short sz;
@@ -468,14 +682,13 @@ int EventBuilder_ProcessBuffer(EventBuilder* eb, void* bu) {
     auto& storage_manager = feminos_daq_storage::StorageManager::Instance();
 
     if (storage_manager.IsInitialized()) {
-        // ReadFrame((void*) bu_s, (int) sz, storage_manager.event);
-
-        // Insert frame
-        std::vector<unsigned short> data;
-        data.reserve(sz); // Reserve space to avoid reallocations
-        std::copy(bu_s, bu_s + sz, std::back_inserter(data));
-
-        storage_manager.AddFrame(data);
+        // sz is in bytes, the frame is made of 16-bit words
+        if (rcv && storage_manager.CanHoldFrame(bu)) {
+            FemArray_HoldBuffer((FemArray*) eb->fa, bu);
+            storage_manager.AddFrame(bu_s, sz / 2, bu);
+        } else {
+            storage_manager.AddFrame(bu_s, sz / 2, nullptr);
+        }
     }
 
     return (err);
@@ -549,6 +762,466 @@ int EventBuilder_EmitEventBoundary(EventBuilder* eb,
     return (err);
 }
 
+/*******************************************************************************
+ EventBuilder_Spin
+
+ Busy poll replacement of the wait on the semaphore: returns when the receive
+ threads have posted new buffers, when the event builder is stopped, or after
+ EB_SPIN_TIMEOUT_NS so that credits are still requested and checked
+ periodically (after ts_wait_ms if it is waiting for fragments in time stamp
+ mode).
+*******************************************************************************/
+static void EventBuilder_Spin(EventBuilder* eb) {
+    unsigned long long t0;
+    unsigned long long tmo;
+    unsigned int n;
+
+    t0 = Time_GetMonotonicNs();
+    tmo = eb->ts_wait_ns ? (eb->ts_wait_ms * 1000000ULL) : EB_SPIN_TIMEOUT_NS;
+    n = 0;
+    while (eb->state && (__sync_val_compare_and_swap(&(eb->wake_flag), 1, 0) == 0)) {
+        n++;
+        if (((n & 0x3FF) == 0) && ((Time_GetMonotonicNs() - t0) > tmo)) {
+            break;
+        }
+    }
+}
+
+/*******************************************************************************
+ EventBuilder_AddLatency
+
+ Fills the latency histogram when an event has been built.
+*******************************************************************************/
+static void EventBuilder_AddLatency(EventBuilder* eb) {
+    unsigned long long now;
+    unsigned long long us;
+
+    if (eb->ev_arrival == 0) {
+        return;
+    }
+    now = Time_GetNs();
+    if (now >= eb->ev_arrival) {
+        us = (now - eb->ev_arrival) / 1000;
+        if (us >= EB_LAT_BIN_NB) {
+            us = EB_LAT_BIN_NB - 1;
+        }
+        eb->lat_hist[us]++;
+    }
+    eb->ev_arrival = 0;
+}
+
+/*******************************************************************************
+ EventBuilder_PutBufferToRecycle
+
+ Appends a buffer the event builder is done with to the output queue.
+*******************************************************************************/
+static int EventBuilder_PutBufferToRecycle(EventBuilder* eb, void* buf, int src) {
+    unsigned long ix;
+
+    if (!EbRing_CanWrite(&(eb->q_o), MAX_OUT_QUEUE_SIZE)) {
+        printf("EventBuilder_Loop: q_buf_o full\n");
+        return (-1);
+    }
+    ix = eb->q_o.wr & (MAX_OUT_QUEUE_SIZE - 1);
+    eb->q_buf_o[ix] = buf;
+    eb->q_src_o[ix] = src;
+    EbRing_Push(&(eb->q_o));
+    // printf("EventBuilder_Loop: added buffer 0x%x src=%d o_wr=%lu\n", buf, src, eb->q_o.wr);
+    return (0);
+}
+
+/*******************************************************************************
+ EventBuilder_StartEvent
+
+ Starts writing out the oldest event under re-assembly: emits its Start Of
+ Built Event followed by the frames staged for it.
+*******************************************************************************/
+static int EventBuilder_StartEvent(EventBuilder* eb) {
+    EbEvent* ev;
+    unsigned int pos;
+    int err;
+
+    ev = &(eb->ev[eb->ev_head & (EB_MAX_WINDOW - 1)]);
+
+    // Emit start of built event
+    if ((err = EventBuilder_EmitEventBoundary(eb, 0)) < 0) {
+        return (err);
+    }
+    eb->had_sobe = 1;
+    eb->ev_last_ns = Time_GetMonotonicNs();
+
+    for (pos = 0; pos < ev->stage_sz; pos += (*((unsigned short*) (ev->stage + pos)) + 7) & ~7U) {
+        if ((err = EventBuilder_ProcessBuffer(eb, ev->stage + pos, 0)) < 0) {
+            return (err);
+        }
+    }
+    ev->stage_sz = 0;
+
+    return (0);
+}
+
+/*******************************************************************************
+ EventBuilder_CloseEvent
+
+ Ends the oldest built event and starts writing out the next one if it has
+ frames already. missing is the pattern of the sources that did not complete
+ it (0 unless it is closed after a timeout or a source lost its End Of
+ Event); it is stored with the event.
+*******************************************************************************/
+static int EventBuilder_CloseEvent(EventBuilder* eb, unsigned int missing) {
+    EbEvent* ev;
+    int err;
+
+    ev = &(eb->ev[eb->ev_head & (EB_MAX_WINDOW - 1)]);
+
+    // Emit end of built event
+    if ((err = EventBuilder_EmitEventBoundary(eb, 1)) < 0) {
+        return (err);
+    }
+    eb->had_sobe = 0;
+
+    // The latency of an incomplete event is that of the timeout, it is not histogrammed
+    if (missing) {
+        eb->ev_arrival = 0;
+    } else {
+        eb->ev_arrival = ev->arrival;
+        EventBuilder_AddLatency(eb);
+    }
+
+    auto& storage_manager = feminos_daq_storage::StorageManager::Instance();
+
+    if (storage_manager.IsInitialized()) {
+
+        // Signal the end of a built event, with the missing sources if any
+        storage_manager.AddEndOfEvent(missing);
+
+        if (storage_manager.GetNumberOfEntries() == 0) {
+            storage_manager.millisSinceEpochForSpeedCalculation = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+    }
+
+    EbEvent_Reset(ev);
+    eb->ev_head++;
+
+    // The next event may already have frames from the sources that were ahead
+    if (eb->ev_head != eb->ev_tail) {
+        return (EventBuilder_StartEvent(eb));
+    }
+    return (0);
+}
+
+/*******************************************************************************
+ EventBuilder_EventTimedOut
+
+ Tells if the oldest event under re-assembly has made no progress for
+ ev_timeout_ms. Time does not count while no data is requested from the FEMs
+ (DAQ phase over) because the event cannot progress then.
+*******************************************************************************/
+static int EventBuilder_EventTimedOut(EventBuilder* eb, FemArray* fa) {
+    unsigned long long now;
+
+    if ((eb->ev_timeout_ms == 0) || (eb->had_sobe == 0) || (eb->ev_head == eb->ev_tail)) {
+        return (0);
+    }
+
+    now = Time_GetMonotonicNs();
+    if ((fa->daq_infinite == 0) && (fa->daq_size_left <= 0)) {
+        eb->ev_last_ns = now;
+        return (0);
+    }
+    return ((now - eb->ev_last_ns) >= (eb->ev_timeout_ms * 1000000ULL));
+}
+
+/*******************************************************************************
+ EventBuilder_CloseTimedOutEvent
+
+ Closes the oldest event under re-assembly without the sources still pending
+ and counts the timeout for each of them. What these sources send later for
+ that event is dropped (see EventBuilder_FindEvent()).
+*******************************************************************************/
+static int EventBuilder_CloseTimedOutEvent(EventBuilder* eb) {
+    EbEvent* ev;
+    unsigned int missing;
+    int src;
+
+    ev = &(eb->ev[eb->ev_head & (EB_MAX_WINDOW - 1)]);
+
+    missing = ev->exp_set & ~ev->eoe_set;
+    for (src = 0; src < MAX_NB_OF_SOURCES; src++) {
+        if (missing & (1 << src)) {
+            eb->src_timeout_cnt[src]++;
+        }
+    }
+    eb->timeout_cnt++;
+    eb->missing_src = missing;
+    eb->resync_has_nb = ev->has_ref && (eb->eb_mode & 0x2);
+    eb->resync_ev_nb = ev->ev_nb;
+
+    return (EventBuilder_CloseEvent(eb, missing));
+}
+
+/*******************************************************************************
+ EventBuilder_FindEvent
+
+ Finds the event under re-assembly a buffer of a source belongs to, opening a
+ new one if needed. Returns 1 and its sequence number, 0 if that event is
+ beyond the window (the buffer must wait), or -1 if the buffer is a late part
+ of an event closed after a timeout and must be dropped.
+
+ When event numbers are checked, the buffers that start an event go to the
+ event with the same number. Otherwise each source is assumed to send the
+ events in order. A buffer starting an event while the source is in the middle
+ of another one means that the End Of Event of that one was lost: the source
+ is marked done and missing in that event at once, so that it does not wait
+ for the event timeout.
+*******************************************************************************/
+static int EventBuilder_FindEvent(EventBuilder* eb, int src, void* bu, unsigned int* seq) {
+    unsigned short ev_ty;
+    unsigned int ev_nb;
+    unsigned short ev_tsl;
+    unsigned short ev_tsm;
+    unsigned short ev_tsh;
+    unsigned int mask;
+    unsigned int s;
+    int soe;
+    EbEvent* ev;
+
+    mask = 1 << src;
+
+    // In time stamp mode, only the sources of the oldest event are read (see EventBuilder_FormTimeGroup())
+    if (eb->eb_mode & 0x10) {
+        if ((eb->ev_head != eb->ev_tail) &&
+            (eb->ev[eb->ev_head & (EB_MAX_WINDOW - 1)].exp_set & ~eb->ev[eb->ev_head & (EB_MAX_WINDOW - 1)].eoe_set & mask)) {
+            *seq = eb->ev_head;
+            return (1);
+        }
+        return (0);
+    }
+
+    // Skip size in buffer, start of frame and size
+    soe = (Frame_GetEventTyNbTs((unsigned char*) bu + 6, &ev_ty, &ev_nb, &ev_tsl, &ev_tsm, &ev_tsh) == 0);
+
+    // Rest of the current event of the source
+    if ((eb->src_open & mask) && (!soe)) {
+        if ((int) (eb->src_seq[src] - eb->ev_head) < 0) {
+            // That event was closed after a timeout
+            if (Frame_IsDFrame_EndOfEvent(bu)) {
+                eb->src_open &= ~mask;
+                eb->src_seq[src] = eb->ev_head;
+            }
+            return (-1);
+        }
+        *seq = eb->src_seq[src];
+        return (1);
+    }
+
+    // The End Of Event of the current event of the source was lost
+    if ((eb->src_open & mask) && soe) {
+        if ((int) (eb->src_seq[src] - eb->ev_head) >= 0) {
+            ev = &(eb->ev[eb->src_seq[src] & (EB_MAX_WINDOW - 1)]);
+            ev->eoe_set |= mask;
+            ev->lost_set |= mask;
+            eb->src_timeout_cnt[src]++;
+        }
+        eb->src_open &= ~mask;
+        eb->src_seq[src]++;
+    }
+
+    if (soe && (eb->eb_mode & 0x2)) {
+        // Late start of the event closed after the last timeout
+        if (eb->resync_has_nb && (ev_nb == eb->resync_ev_nb)) {
+            if (Frame_IsDFrame_EndOfEvent(bu)) {
+                eb->src_open &= ~mask;
+                eb->src_seq[src] = eb->ev_head;
+            } else {
+                eb->src_open |= mask;
+                eb->src_seq[src] = eb->ev_head - 1;
+            }
+            return (-1);
+        }
+
+        for (s = eb->ev_head; s != eb->ev_tail; s++) {
+            if (eb->ev[s & (EB_MAX_WINDOW - 1)].has_ref && (eb->ev[s & (EB_MAX_WINDOW - 1)].ev_nb == ev_nb)) {
+                *seq = s;
+                return (1);
+            }
+        }
+    } else {
+        s = eb->src_seq[src];
+        if ((int) (s - eb->ev_head) < 0) {
+            s = eb->ev_head;
+        }
+        if (s != eb->ev_tail) {
+            *seq = s;
+            return (1);
+        }
+    }
+
+    // Open a new event if the window allows it
+    if ((eb->ev_tail - eb->ev_head) >= (unsigned int) eb->ev_window) {
+        return (0);
+    }
+    EbEvent_Reset(&(eb->ev[eb->ev_tail & (EB_MAX_WINDOW - 1)]));
+    eb->ev[eb->ev_tail & (EB_MAX_WINDOW - 1)].exp_set = ((FemArray*) eb->fa)->fem_proxy_set;
+    *seq = eb->ev_tail;
+    eb->ev_tail++;
+    return (1);
+}
+
+/*******************************************************************************
+ EventBuilder_FormTimeGroup
+
+ In time stamp mode, opens the next event with the fragments at the head of
+ the input queues whose time stamp is within ts_win of the earliest one. Each
+ source sends its fragments in time order, so the earliest fragment is known
+ once every source has one waiting; the sources that have none are waited for
+ until the earliest fragment waiting has been received for ts_wait_ms (the
+ wait starts when the builder first sees it if its arrival time is not known),
+ so that a source that does not fire does not delay every event by ts_wait_ms.
+ Frames at the head of a queue that do not start a fragment are
+ what is left of a fragment closed after a timeout and are dropped. Returns 1
+ if an event was opened.
+*******************************************************************************/
+static int EventBuilder_FormTimeGroup(EventBuilder* eb, FemArray* fa) {
+    unsigned long long ts[MAX_NB_OF_SOURCES];
+    unsigned long long t0;
+    unsigned long long arr0;
+    unsigned long long now;
+    unsigned long long wall;
+    unsigned short ev_ty;
+    unsigned int ev_nb;
+    unsigned short ev_tsl;
+    unsigned short ev_tsm;
+    unsigned short ev_tsh;
+    unsigned int have;
+    unsigned int members;
+    EbEvent* ev;
+    void* buf;
+    unsigned long ix;
+    int src;
+    int err;
+
+    have = 0;
+    t0 = ~0ULL;
+    arr0 = ~0ULL;
+    for (src = 0; src < MAX_NB_OF_SOURCES; src++) {
+        while (EbRing_CanRead(&(eb->q_i[src]))) {
+            ix = eb->q_i[src].rd & (MAX_QUEUE_SIZE - 1);
+            buf = eb->q_buf_i[src][ix];
+
+            // Skip size in buffer, start of frame and size
+            if (Frame_GetEventTyNbTs((unsigned char*) buf + 6, &ev_ty, &ev_nb, &ev_tsl, &ev_tsm, &ev_tsh) == 0) {
+                ts[src] = (((unsigned long long) ev_tsh) << 32) | (((unsigned long long) ev_tsm) << 16) | ((unsigned long long) ev_tsl);
+                if (ts[src] < t0) {
+                    t0 = ts[src];
+                }
+                if (eb->q_ts_i[src][ix] && (eb->q_ts_i[src][ix] < arr0)) {
+                    arr0 = eb->q_ts_i[src][ix];
+                }
+                have |= (1 << src);
+                break;
+            }
+
+            EbRing_Pop(&(eb->q_i[src]));
+            eb->resync_drop_cnt++;
+            if ((err = EventBuilder_PutBufferToRecycle(eb, buf, src)) < 0) {
+                return (err);
+            }
+        }
+    }
+
+    if (have == 0) {
+        eb->ts_wait_ns = 0;
+        return (0);
+    }
+
+    // A source that has nothing yet could still send an earlier fragment: wait
+    // for it from the arrival of the earliest fragment waiting, not from now
+    if ((have & fa->fem_proxy_set) != fa->fem_proxy_set) {
+        now = Time_GetMonotonicNs();
+        if (eb->ts_wait_ns == 0) {
+            eb->ts_wait_ns = now;
+        }
+        wall = Time_GetNs();
+        if ((arr0 != ~0ULL) && (wall >= arr0)) {
+            if ((wall - arr0) < (eb->ts_wait_ms * 1000000ULL)) {
+                return (0);
+            }
+        } else if ((now - eb->ts_wait_ns) < (eb->ts_wait_ms * 1000000ULL)) {
+            return (0);
+        }
+    }
+    eb->ts_wait_ns = 0;
+
+    members = 0;
+    for (src = 0; src < MAX_NB_OF_SOURCES; src++) {
+        if ((have & (1 << src)) && ((ts[src] - t0) <= eb->ts_win)) {
+            members |= (1 << src);
+        }
+    }
+
+    ev = &(eb->ev[eb->ev_tail & (EB_MAX_WINDOW - 1)]);
+    EbEvent_Reset(ev);
+    ev->exp_set = members;
+    eb->ev_tail++;
+
+    return (1);
+}
+
+/*******************************************************************************
+ EventBuilder_AddToEvent
+
+ Adds a buffer of a source to an event under re-assembly. The buffers of the
+ oldest event are written out directly, those of the later ones are copied
+ until it is their turn. Returns 1 if the oldest event made progress.
+*******************************************************************************/
+static int EventBuilder_AddToEvent(EventBuilder* eb, unsigned int seq, int src, void* buf, unsigned long long ts) {
+    EbEvent* ev;
+    unsigned int mask;
+    int err;
+
+    ev = &(eb->ev[seq & (EB_MAX_WINDOW - 1)]);
+    mask = 1 << src;
+
+    // Check the content of this buffer
+    if ((err = EventBuilder_CheckBuffer(eb, ev, src, buf)) < 0) {
+        printf("EventBuilder_AddToEvent: EventBuilder_CheckBuffer failed %d\n", err);
+        return (err);
+    }
+    ev->src_set |= mask;
+    if (ts > ev->arrival) {
+        ev->arrival = ts;
+    }
+
+    if (seq == eb->ev_head) {
+        if ((eb->had_sobe == 0) && ((err = EventBuilder_StartEvent(eb)) < 0)) {
+            printf("EventBuilder_AddToEvent: EventBuilder_StartEvent failed %d\n", err);
+            return (err);
+        }
+        if ((err = EventBuilder_ProcessBuffer(eb, buf, 1)) < 0) {
+            printf("EventBuilder_AddToEvent: EventBuilder_ProcessBuffer failed %d\n", err);
+            return (err);
+        }
+    } else {
+        if ((err = EbEvent_Stage(ev, buf)) < 0) {
+            return (err);
+        }
+        eb->stage_cnt++;
+    }
+
+    // If this has an end of event, the next buffers of this source belong to the next event
+    if (Frame_IsDFrame_EndOfEvent(buf)) {
+        ev->eoe_set |= mask;
+        eb->src_open &= ~mask;
+        eb->src_seq[src] = seq + 1;
+    } else {
+        eb->src_open |= mask;
+        eb->src_seq[src] = seq;
+    }
+
+    return (seq == eb->ev_head);
+}
+
 /*******************************************************************************
  EventBuilder_Loop
 *******************************************************************************/
@@ -560,22 +1233,33 @@ int EventBuilder_Loop(EventBuilder* eb) {
     int fem_src;
     unsigned short* sz;
     int len;
-    char cmd[40];
+    FemDaqCmd daq_cmd;
     int had_buf;
     int src;
-    unsigned int mask;
-    int done2;
+    int found;
+    unsigned int seq;
+    EbEvent* ev;
+    int ev_prog;
+    int ev_done;
+    unsigned long ix;
+    unsigned long long ts;
 
     // printf("EventBuilder_Loop: started.\n");
 
     fa = (FemArray*) eb->fa;
 
     // Event Builder Loop
+    ev_done = 0;
     while (eb->state) {
         // Wait for new buffer to be posted to event builder
         // if ((err = Semaphore_Wait_Timeout(eb->sem_wakeup,
         // 4000000)) < 0)
-        if ((err = Semaphore_Wait(eb->sem_wakeup)) < 0) {
+        if (ev_done) {
+            // Events were just completed: buffers of the next
+            // events may have been left in the queues
+        } else if (eb->busy_poll) {
+            EventBuilder_Spin(eb);
+        } else if ((err = Semaphore_Wait(eb->sem_wakeup)) < 0) {
             if (err == -2) {
                 // printf("EventBuilder_Loop:
                 // Semaphore_Wait_Timeout: timeout
@@ -598,75 +1282,47 @@ int EventBuilder_Loop(EventBuilder* eb) {
             return (err);
         }
 
-        // If we are building a new event, we expect one
-        // event from each active FEM
-        if ((eb->pnd_src == 0) && (eb->eb_mode & 0x1)) {
-            eb->pnd_src = fa->fem_proxy_set;
+        // In time stamp mode, find the sources of the next
+        // event when the previous one is done
+        if ((eb->eb_mode & 0x10) && (eb->ev_head == eb->ev_tail)) {
+            if ((err = EventBuilder_FormTimeGroup(eb, fa)) < 0) {
+                return (err);
+            }
         }
 
         // Process the buffers found in the input queues
         had_buf = 0;
-        mask = 0x00000001;
+        ev_prog = 0;
         for (src = 0; src < MAX_NB_OF_SOURCES; src++) {
-            if ((eb->eb_mode == 0x0) ||
-                ((eb->eb_mode & 0x1) &&
-                 (eb->pnd_src & mask))) {
-                done2 = 0;
-                while ((eb->q_buf_i_rd[src] !=
-                        eb->q_buf_i_wr[src]) &&
-                       (!done2)) {
-                    // When event builder is active, check
-                    // if we have the Start Of Built Event
-                    if ((eb->eb_mode & 0x1) &&
-                        (eb->had_sobe == 0)) {
-                        // Emit start of built event
-                        if ((err =
-                                     EventBuilder_EmitEventBoundary(
-                                             eb, 0)) < 0) {
-                            printf(
-                                    "EventBuilder_Loop: "
-                                    "EventBuilder_"
-                                    "EmitEventBoundary failed "
-                                    "%d\n",
-                                    err);
-                            return (err);
-                        } else {
-                            eb->had_sobe = 1;
-                            // printf("EventBuilder_Loop:
-                            // start building new event\n");
-                        }
-                    }
-
-                    // Get the buffer for the input queue of
-                    // the current source
-                    buf = eb->q_buf_i[src]
-                                     [eb->q_buf_i_rd[src]];
-                    // printf("EventBuilder_Loop: processing
-                    // buffer 0x%x Source:%d i_rd=%d i_wr=%d
-                    // i_sz=%d\n", buf, src,
-                    // eb->q_buf_i_rd[src],
-                    // eb->q_buf_i_wr[src],
-                    // eb->q_buf_i_sz[src]);
-                    eb->q_buf_i_rd[src] =
-                            (eb->q_buf_i_rd[src] + 1) %
-                            MAX_QUEUE_SIZE;
-                    eb->q_buf_i_sz[src] =
-                            eb->q_buf_i_sz[src] - 1;
-
-                    // Check the content of this buffer
-                    if ((err = EventBuilder_CheckBuffer(
-                                 eb, src, buf)) < 0) {
-                        printf(
-                                "EventBuilder_Loop: "
-                                "EventBuilder_CheckBuffer "
-                                "failed %d\n",
-                                err);
-                        return (err);
+            while (EbRing_CanRead(&(eb->q_i[src]))) {
+                // Get the buffer for the input queue of
+                // the current source
+                ix = eb->q_i[src].rd & (MAX_QUEUE_SIZE - 1);
+                buf = eb->q_buf_i[src][ix];
+                ts = eb->q_ts_i[src][ix];
+                found = 1;
+                seq = 0;
+
+                // When event builder is active, find the
+                // event this buffer belongs to. If it is
+                // too far ahead of the oldest event, leave
+                // the buffer and the next ones of this
+                // source in the queue
+                if (eb->eb_mode & 0x11) {
+                    if ((found = EventBuilder_FindEvent(
+                                 eb, src, buf, &seq)) == 0) {
+                        break;
                     }
+                }
+                // printf("EventBuilder_Loop: processing
+                // buffer 0x%x Source:%d i_rd=%lu\n",
+                // buf, src, eb->q_i[src].rd);
+                EbRing_Pop(&(eb->q_i[src]));
 
+                if (!(eb->eb_mode & 0x11)) {
                     // Process the current buffer
                     if ((err = EventBuilder_ProcessBuffer(
-                                 eb, buf)) < 0) {
+                                 eb, buf, 1)) < 0) {
                         printf(
                                 "EventBuilder_Loop: "
                                 "EventBuilder_ProcessBuffer "
@@ -674,81 +1330,56 @@ int EventBuilder_Loop(EventBuilder* eb) {
                                 err);
                         return (err);
                     }
+                } else if (found < 0) {
+                    // Drop what is left of an event closed
+                    // after a timeout without this source
+                    eb->resync_drop_cnt++;
+                } else if ((err = EventBuilder_AddToEvent(
+                                    eb, seq, src, buf, ts)) < 0) {
+                    return (err);
+                } else if (err > 0) {
+                    ev_prog = 1;
+                }
 
-                    // If this has and end of event, we do
-                    // not wait more data from this FEM for
-                    // this event
-                    if (Frame_IsDFrame_EndOfEvent(buf)) {
-                        eb->pnd_src &= ~mask;
-                        // printf("EventBuilder_Loop: FEM %d
-                        // had EOE pnd_src=0x%x\n", src,
-                        // eb->pnd_src);
-                        done2 = 1;
-                    } else {
-                    }
-
-                    // Append this buffer to the ouptut
-                    // queue of the event builder
-                    if (((eb->q_buf_o_wr + 1) %
-                         MAX_QUEUE_SIZE) ==
-                        eb->q_buf_o_rd) {
-                        printf(
-                                "EventBuilder_Loop: q_buf_o "
-                                "full\n");
-                        err = -1;
-                        return (err);
-                    } else {
-                        eb->q_buf_o[eb->q_buf_o_wr] = buf;
-                        eb->q_src_o[eb->q_buf_o_wr] = src;
-                        eb->q_buf_o_wr =
-                                (eb->q_buf_o_wr + 1) %
-                                MAX_QUEUE_SIZE;
-                        eb->q_buf_o_sz = eb->q_buf_o_sz + 1;
-                        // printf("EventBuilder_Loop: added
-                        // buffer 0x%x src=%d o_rd=%d
-                        // o_wr=%d o_sz=%d\n", buf, src,
-                        // eb->q_buf_o_rd, eb->q_buf_o_wr,
-                        // eb->q_buf_o_sz);
-                    }
-                    had_buf = 1;
+                // Append this buffer to the ouptut
+                // queue of the event builder
+                if ((err = EventBuilder_PutBufferToRecycle(
+                             eb, buf, src)) < 0) {
+                    return (err);
                 }
+                had_buf = 1;
             }
-            mask <<= 1;
         }
 
-        // If the event builder is active, check for event
-        // assembly done
-        if (eb->eb_mode & 0x1) {
-            if (eb->pnd_src == 0) {
-                // Emit end of built event
-                if ((err = EventBuilder_EmitEventBoundary(
-                             eb, 1)) < 0) {
+        // If the event builder is active, write out the
+        // events completed in order
+        ev_done = 0;
+        if (eb->eb_mode & 0x11) {
+            if (ev_prog) {
+                eb->ev_last_ns = Time_GetMonotonicNs();
+            }
+            while (eb->ev_head != eb->ev_tail) {
+                ev = &(eb->ev[eb->ev_head & (EB_MAX_WINDOW - 1)]);
+                if ((ev->eoe_set & ev->exp_set) ==
+                    ev->exp_set) {
+                    err = EventBuilder_CloseEvent(eb, ev->lost_set & ev->exp_set);
+                } else if (EventBuilder_EventTimedOut(eb, fa)) {
+                    // Do not wait any longer for the sources
+                    // which lost the end of this event
+                    err = EventBuilder_CloseTimedOutEvent(eb);
+                } else {
+                    // printf("EventBuilder_Loop: pending source pattern 0x%x\n", ev->exp_set & ~ev->eoe_set);
+                    break;
+                }
+                if (err < 0) {
                     printf(
                             "EventBuilder_Loop: "
-                            "EventBuilder_EmitEventBoundary "
+                            "EventBuilder_CloseEvent "
                             "failed %d\n",
                             err);
                     return (err);
-                } else {
-                    eb->had_sobe = 0;
-
-                    auto& storage_manager = feminos_daq_storage::StorageManager::Instance();
-
-                    if (storage_manager.IsInitialized()) {
-
-                        // Send a special frame signaling the end of a built event
-                        storage_manager.AddFrame({0});
-
-                        if (storage_manager.GetNumberOfEntries() == 0) {
-                            storage_manager.millisSinceEpochForSpeedCalculation = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
-                        }
-                    }
                 }
-
-                // Next event does not have any Start of Event received yet
-                eb->src_had_soe = 0;
-            } else {
-                // printf("EventBuilder_Loop: pending source pattern 0x%x\n", eb->pnd_src);
+                ev_done = 1;
             }
         }
 
@@ -814,8 +1445,7 @@ int EventBuilder_Loop(EventBuilder* eb) {
                         fa->daq_size_left);
                 */
                 // Return the buffer to the pool
-                BufPool_ReturnBuffer(fa->bp,
-                                     (unsigned long) buf);
+                FemArray_ReleaseBuffer(fa, buf);
             } else {
                 done = 1;
             }
@@ -834,9 +1464,10 @@ int EventBuilder_Loop(EventBuilder* eb) {
         // if (was_event_data)
         {
             // Try to post some requests to avoid starving
-            sprintf(cmd, "DAQ -2\n");
-            if ((err = FemArray_SendDaq(
-                         fa, 0, 31, fa->fem_proxy_set, cmd)) <
+            daq_cmd.action = FEMDAQ_REPLENISH;
+            daq_cmd.size = 0;
+            if ((err = FemArray_Daq(
+                         fa, 0, 31, fa->fem_proxy_set, &daq_cmd)) <
                 0) {
                 return (err);
             }
@@ -852,6 +1483,8 @@ int EventBuilder_Loop(EventBuilder* eb) {
         }
     }
 
+    BufPool_FlushCache((BufPool*) fa->bp);
+
     printf("EventBuilder_Loop: completed.\n");
 
     return (err);
@@ -859,28 +1492,30 @@ int EventBuilder_Loop(EventBuilder* eb) {
 
 /*******************************************************************************
  EventBuilder_PutBufferToProcess
+
+ Called by the receive thread of FEM src only, without lock.
 *******************************************************************************/
 int EventBuilder_PutBufferToProcess(EventBuilder* eb,
-                                    void* bufi, int src) {
+                                    void* bufi, int src,
+                                    unsigned long long ts) {
     int err = 0;
+    unsigned long ix;
 
     // Check that this input queue is not full
-    if (((eb->q_buf_i_wr[src] + 1) % MAX_QUEUE_SIZE) ==
-        eb->q_buf_i_rd[src]) {
+    if (!EbRing_CanWrite(&(eb->q_i[src]), MAX_QUEUE_SIZE)) {
         printf(
                 "EventBuilder_PutBufferToProcess: Queue %d is "
                 "full!\n",
                 src);
         err = -1;
     } else {
-        eb->q_buf_i[src][eb->q_buf_i_wr[src]] = bufi;
-        eb->q_buf_i_wr[src] =
-                (eb->q_buf_i_wr[src] + 1) % MAX_QUEUE_SIZE;
-        eb->q_buf_i_sz[src] = eb->q_buf_i_sz[src] + 1;
+        ix = eb->q_i[src].wr & (MAX_QUEUE_SIZE - 1);
+        eb->q_buf_i[src][ix] = bufi;
+        eb->q_ts_i[src][ix] = ts;
+        EbRing_Push(&(eb->q_i[src]));
         // printf("EventBuilder_PutBufferToProcess: added
-        // buffer 0x%x Queue %d i_rd=%d i_wr=%d i_sz=%d\n",
-        // bufi, src, eb->q_buf_i_rd[src],
-        // eb->q_buf_i_wr[src], eb->q_buf_i_sz[src]);
+        // buffer 0x%x Queue %d i_wr=%lu\n",
+        // bufi, src, eb->q_i[src].wr);
         err = 0;
     }
     return (err);
@@ -891,22 +1526,38 @@ int EventBuilder_PutBufferToProcess(EventBuilder* eb,
 *******************************************************************************/
 int EventBuilder_GetBufferToRecycle(EventBuilder* eb,
                                     void** bufo, int* src) {
-    if (eb->q_buf_o_rd == eb->q_buf_o_wr) {
+    unsigned long ix;
+
+    if (!EbRing_CanRead(&(eb->q_o))) {
         *bufo = (void*) nullptr;
         *src = -1;
         return (0);
     } else {
-        *bufo = eb->q_buf_o[eb->q_buf_o_rd];
-        *src = eb->q_src_o[eb->q_buf_o_rd];
-        eb->q_buf_o_rd =
-                (eb->q_buf_o_rd + 1) % MAX_QUEUE_SIZE;
-        eb->q_buf_o_sz = eb->q_buf_o_sz - 1;
+        ix = eb->q_o.rd & (MAX_OUT_QUEUE_SIZE - 1);
+        *bufo = eb->q_buf_o[ix];
+        *src = eb->q_src_o[ix];
+        EbRing_Pop(&(eb->q_o));
         // printf("EventBuilder_GetBufferToRecycle: recycle
         // buffer 0x%x from Source %d\n", *bufo, *src);
         return (0);
     }
 }
 
+/*******************************************************************************
+ EventBuilder_GetQueueFill
+
+ Number of buffers waiting in the input queue of a source. May be called from
+ any thread.
+*******************************************************************************/
+int EventBuilder_GetQueueFill(EventBuilder* eb, int src) {
+    unsigned long wr;
+    unsigned long rd;
+
+    rd = __atomic_load_n(&(eb->q_i[src].rd), __ATOMIC_ACQUIRE);
+    wr = __atomic_load_n(&(eb->q_i[src].wr), __ATOMIC_ACQUIRE);
+    return ((wr > rd) ? (int) (wr - rd) : 0);
+}
+
 /*******************************************************************************
  EventBuilder_FileAction
 *******************************************************************************/
@@ -1192,3 +1843,62 @@ int EventBuilder_FileAction(EventBuilder* eb,
 
     return (err);
 }
+
+/*******************************************************************************
+ EventBuilder_Wakeup
+
+ Wakes up the event builder: raises its flag in busy poll mode, or signals
+ its semaphore otherwise.
+*******************************************************************************/
+int EventBuilder_Wakeup(EventBuilder* eb) {
+    int err = 0;
+
+    if (eb->busy_poll) {
+        __sync_lock_test_and_set(&(eb->wake_flag), 1);
+    } else if ((err = Semaphore_Signal(eb->sem_wakeup)) < 0) {
+        printf("EventBuilder_Wakeup: Semaphore_Signal failed %d\n", err);
+    }
+    return (err);
+}
+
+/*******************************************************************************
+ EventBuilder_GetLatency
+
+ Gives the median and the 99th percentile, in microseconds, of the latency
+ from the arrival of the last frame of an event to the end of the built event,
+ for the events built since the previous call. Returns the number of events
+ these values are computed from. Can be called from any thread.
+*******************************************************************************/
+unsigned int EventBuilder_GetLatency(EventBuilder* eb, double* p50, double* p99) {
+    unsigned int d[EB_LAT_BIN_NB];
+    unsigned int tot;
+    unsigned int sum;
+    int i;
+
+    tot = 0;
+    for (i = 0; i < EB_LAT_BIN_NB; i++) {
+        d[i] = eb->lat_hist[i] - eb->lat_hist_lst[i];
+        eb->lat_hist_lst[i] += d[i];
+        tot += d[i];
+    }
+
+    *p50 = 0.0;
+    *p99 = 0.0;
+    if (tot == 0) {
+        return (0);
+    }
+
+    // Take the upper edge of the bin where each percentile is reached
+    sum = 0;
+    for (i = 0; i < EB_LAT_BIN_NB; i++) {
+        sum += d[i];
+        if ((*p50 == 0.0) && ((2ULL * sum) >= tot)) {
+            *p50 = (double) (i + 1);
+        }
+        if ((100ULL * sum) >= (99ULL * tot)) {
+            *p99 = (double) (i + 1);
+            break;
+        }
+    }
+    return (tot);
+}
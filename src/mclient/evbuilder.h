@@ -11,6 +11,26 @@
  History:
    January 2012 : created
 
+   The input queues and the output queue are single-producer single-consumer
+   rings that need no lock: each input queue is filled by the receive thread
+   of its FEM and read by the event builder, the output queue is filled and
+   read by the event builder. q_mutex now only serializes the readers of the
+   input queues (the event builder loop and EventBuilder_Flush()).
+
+   In active mode an event that makes no progress for ev_timeout_ms is
+   closed without the sources still pending, which are then resynchronised
+   on their next event (see EventBuilder_CloseTimedOutEvent()).
+
+   In active mode up to ev_window events are built concurrently (see
+   EbEvent) so that a FEM that is faster than the others is not held up
+   until they complete the oldest event. Built events are still written
+   in order.
+
+   In time stamp mode (eb_mode & 0x10) the sources are not expected to
+   send every event: the fragments whose time stamps are within ts_win of
+   the earliest one waiting make an event, and a fragment without partner
+   makes a single source event (see EventBuilder_FormTimeGroup()).
+
 *******************************************************************************/
 
 #ifndef EVENTBUILDER_H
@@ -26,7 +46,46 @@
 *******************************************************************************/
 
 #define MAX_NB_OF_SOURCES 32
-#define MAX_QUEUE_SIZE 256
+#define MAX_QUEUE_SIZE 1024 // entries of each input queue (power of 2)
+#define MAX_OUT_QUEUE_SIZE (MAX_NB_OF_SOURCES * MAX_QUEUE_SIZE)
+#define EB_CACHE_LINE 64
+
+#define EB_LAT_BIN_NB 4096               // event latency histogram: 1 us bins, the last one counts larger latencies
+#define EB_SPIN_TIMEOUT_NS 100000000ULL // in busy poll mode, go through the loop at least this often
+#define EB_EVENT_TIMEOUT_MS 1000         // default time without progress after which an event is closed incomplete
+#define EB_MAX_WINDOW 16                 // maximum number of events built concurrently (power of 2)
+#define EB_TS_WINDOW 10                  // default coincidence window of the time stamp mode (time stamp ticks)
+#define EB_TS_WAIT_MS 10                 // default time the time stamp mode waits for the FEMs that have sent nothing
+
+// Single-producer single-consumer ring of buffers. The positions only increase and each one is written by one side;
+// each side keeps a copy of the position of the other side to read it only when the ring looks full or empty.
+typedef struct _EbRing {
+    unsigned long wr;     // position of the next entry written (producer)
+    unsigned long rd_lst; // read position last seen by the producer
+    unsigned char pad0[EB_CACHE_LINE - 2 * sizeof(unsigned long)];
+    unsigned long rd;     // position of the next entry read (consumer)
+    unsigned long wr_lst; // write position last seen by the consumer
+    unsigned char pad1[EB_CACHE_LINE - 2 * sizeof(unsigned long)];
+} EbRing;
+
+// Event under re-assembly. The frames received for it while an older event is still being built are copied
+// to stage, and written out in order when it becomes the oldest event.
+typedef struct _EbEvent {
+    unsigned int exp_set;       // sources expected to send data for this event
+    unsigned int src_set;       // sources that sent data for this event
+    unsigned int eoe_set;       // sources that sent their End Of Event for this event
+    unsigned int lost_set;      // sources that started their next event before the End Of Event of this one (lost)
+    int has_ref;                // the type, number and time stamp below were taken from the first source
+    unsigned short ev_ty;       // event type
+    unsigned int ev_nb;         // event number
+    unsigned short ev_tsl;      // time stamp low
+    unsigned short ev_tsm;      // time stamp medium
+    unsigned short ev_tsh;      // time stamp high
+    unsigned long long arrival; // latest arrival time of its frames
+    unsigned char* stage;       // copies of the frames (each one starting with its size like a buffer of the pool)
+    unsigned int stage_sz;      // bytes used in stage
+    unsigned int stage_max;     // bytes allocated for stage
+} EbEvent;
 
 typedef struct _EventBuilder {
     int id;
@@ -34,18 +93,18 @@ typedef struct _EventBuilder {
     int state;
 
     void* sem_wakeup; // Semaphore to wake-up event builder
-    void* q_mutex;    // Mutex for protecting access to event builder queues
+    void* q_mutex;    // Mutex serializing the readers of the input queues
+
+    int busy_poll;          // 1: spin on wake_flag instead of waiting on sem_wakeup
+    volatile int wake_flag; // set to 1 when new buffers are posted in busy poll mode
 
-    void* q_buf_i[MAX_NB_OF_SOURCES][MAX_QUEUE_SIZE]; // Array of Queues of buffer to process by event builder
-    int q_buf_i_rd[MAX_NB_OF_SOURCES];                // read pointer
-    int q_buf_i_wr[MAX_NB_OF_SOURCES];                // write pointer
-    int q_buf_i_sz[MAX_NB_OF_SOURCES];                // queue size
+    EbRing q_i[MAX_NB_OF_SOURCES];                                // positions of the input queues
+    void* q_buf_i[MAX_NB_OF_SOURCES][MAX_QUEUE_SIZE];             // Array of Queues of buffer to process by event builder
+    unsigned long long q_ts_i[MAX_NB_OF_SOURCES][MAX_QUEUE_SIZE]; // arrival time (ns) of each buffer of the input queues (0: unknown)
 
-    void* q_buf_o[MAX_NB_OF_SOURCES * MAX_QUEUE_SIZE]; // Single queue of buffer released by event builder
-    int q_src_o[MAX_NB_OF_SOURCES * MAX_QUEUE_SIZE];   // Source of each buffer in the queue
-    int q_buf_o_rd;                                    // read pointer
-    int q_buf_o_wr;                                    // write pointer
-    int q_buf_o_sz;                                    // queue size
+    EbRing q_o;                         // positions of the output queue
+    void* q_buf_o[MAX_OUT_QUEUE_SIZE];  // Single queue of buffer released by event builder
+    int q_src_o[MAX_OUT_QUEUE_SIZE];    // Source of each buffer in the queue
 
     unsigned int vflags; // verboseness flags for event data printout
 
@@ -58,16 +117,34 @@ typedef struct _EventBuilder {
     unsigned int file_max_size; // maximum number of bytes per file
     unsigned int byte_wr;       // number of bytes written to file
 
-    int eb_mode;          // event builder mode transparent or active
-    int had_sobe;         // current event had Start Of Built Event emitted
-    unsigned int pnd_src; // pending source pattern for completion of the current event
-
-    unsigned int src_had_soe;  // indicates the set of sources that had Start Of Event found for this event
-    unsigned short cur_ev_ty;  // event type of event under re-assembly
-    unsigned int cur_ev_nb;    // event number of event under re-assembly
-    unsigned short cur_ev_tsl; // time stamp low of event under re-assembly
-    unsigned short cur_ev_tsm; // time stamp medium of event under re-assembly
-    unsigned short cur_ev_tsh; // time stamp high of event under re-assembly
+    int eb_mode;  // event builder mode transparent or active
+    int had_sobe; // oldest event under re-assembly had Start Of Built Event emitted
+
+    int ev_window;                           // number of events built concurrently (1: one at a time)
+    EbEvent ev[EB_MAX_WINDOW];               // events under re-assembly, indexed by sequence number modulo EB_MAX_WINDOW
+    unsigned int ev_head;                    // sequence number of the oldest event under re-assembly
+    unsigned int ev_tail;                    // sequence number of the next event to open
+    unsigned int src_seq[MAX_NB_OF_SOURCES]; // sequence number of the event each source sends or will send next
+    unsigned int src_open;                   // sources in the middle of an event (End Of Event not received yet)
+    unsigned long long stage_cnt;            // frames copied because they were ahead of the oldest event
+
+    unsigned long long ts_win;     // time stamp mode: coincidence window (time stamp ticks)
+    unsigned int ts_wait_ms;       // time stamp mode: time waited for the sources that have no fragment yet
+    unsigned long long ts_wait_ns; // time (monotonic) the wait for these sources started (0: not waiting)
+
+    unsigned int ev_timeout_ms;                      // close the oldest event when none of its frames came for this time (0: never)
+    unsigned long long ev_last_ns;                   // time (monotonic) of the last progress of the oldest event
+    int resync_has_nb;                               // resync_ev_nb is valid
+    unsigned int resync_ev_nb;                       // event number of the last timed out event (if event numbers are checked)
+    unsigned int missing_src;                        // sources missing from the last event closed after a timeout
+    unsigned int timeout_cnt;                        // number of events closed after a timeout
+    unsigned int src_timeout_cnt[MAX_NB_OF_SOURCES]; // number of events closed after a timeout or a lost End Of Event each source was missing from
+    unsigned int src_timeout_lst[MAX_NB_OF_SOURCES]; // same count at the time of the last status report
+    unsigned long long resync_drop_cnt;              // frames of timed out events dropped
+
+    unsigned long long ev_arrival;            // latest arrival time of the frames of the event under re-assembly
+    unsigned int lat_hist[EB_LAT_BIN_NB];     // histogram of the latency from frame arrival to built event
+    unsigned int lat_hist_lst[EB_LAT_BIN_NB]; // histogram at the time of the last latency report
 
     char run_str[300]; // run identifier string
     int subrun_ix;     // index of current sub-run
@@ -87,8 +164,11 @@ int EventBuilder_Open(EventBuilder* eb);
 void EventBuilder_Close(EventBuilder* eb);
 int EventBuilder_Flush(EventBuilder* eb);
 int EventBuilder_Loop(EventBuilder* eb);
-int EventBuilder_PutBufferToProcess(EventBuilder* eb, void* bufi, int src);
+int EventBuilder_PutBufferToProcess(EventBuilder* eb, void* bufi, int src, unsigned long long ts);
 int EventBuilder_GetBufferToRecycle(EventBuilder* eb, void** bufo, int* src);
+int EventBuilder_GetQueueFill(EventBuilder* eb, int src);
 int EventBuilder_FileAction(EventBuilder* eb, EBFileActions action, int format);
+int EventBuilder_Wakeup(EventBuilder* eb);
+unsigned int EventBuilder_GetLatency(EventBuilder* eb, double* p50, double* p99);
 
 #endif
@@ -31,11 +31,88 @@
    in the expected incremental order because the last daq request had ask to
    restart it.
 
+   Added batched receive mode: up to rcv_batch datagrams are read from each
+   ready socket with a single recvmmsg() call and all the data frames collected
+   are handed to the event builder in one go.
+
+   Replaced select() in the receive loop by an edge-triggered epoll set. Each
+   ready socket is drained until no datagram is left. An eventfd registered in
+   the same set lets other threads wake up the receive loop immediately (e.g.
+   to stop the run) instead of waiting for the 5 second timeout.
+
+   The FEM sockets can be shared between several receive threads, each with
+   its own epoll set and eventfd, and optionally pinned to a CPU core. The
+   network mutex is no longer held during the receive system calls, only to
+   get buffers from the pool and to process the frames received.
+
+   Added the packet receive backend (see femring.cpp): frames are read in
+   place from a memory mapped AF_PACKET ring by a single receive thread.
+   Buffers are now given back with FemArray_ReleaseBuffer() which returns
+   them to the ring or to the buffer pool depending on where they are.
+
+   The number of datagrams dropped by the kernel (socket receive queue or
+   packet ring overflow) is reported with the DAQ status. With rcvbuf_auto set,
+   the receive buffer of a socket that dropped datagrams is doubled, up to
+   SOCK_REV_SIZE_MAX.
+
+   Added the uring receive backend (see femuring.cpp): a multishot recvmsg
+   posted once on each FEM socket fills buffers lent by the buffer pool to a
+   provided buffer ring, and the completions are read by a single receive
+   thread without a system call per datagram.
+
+   Added the single socket mode: the FEMs share the socket of the first one and
+   each datagram received is dispatched to the proxy of the FEM it comes from
+   according to its source address.
+
+   Added busy poll mode for receive threads running on dedicated cores: the
+   sockets (or the ring) are read on every pass without waiting in epoll, and
+   the event builder is woken up through a flag instead of its semaphore. The
+   arrival time of each frame is passed to the event builder, and the median
+   and 99th percentile of the event building latency are reported with the DAQ
+   status. A receive call that gets no datagram no longer takes the network
+   mutex.
+
+   Added an adaptive credit window: the amount of credit given to each FEM
+   follows the data it delivers per request round trip and shrinks when the
+   event builder or the storage queue falls behind. The window of each FEM is
+   exported with the DAQ status.
+
+   The data requests of one pass of FemArray_Daq() are formatted in
+   preformatted commands and sent together with sendmmsg() once all FEMs have
+   been looked at, with one call per socket. The rate of requests and the
+   average number of requests per call are reported with the DAQ status.
+
+   Added FemArray_Daq(), a typed interface to start, stop, size or pursue the
+   acquisition and to print the DAQ status. FemArray_SendDaq() only parses the
+   ASCII DAQ commands of the command fetcher and calls it.
+
+   Added recovery of lost credits: when a FEM has credits pending and sent no
+   data for cred_timeout_ms, the data request or its replies are presumed lost
+   and the pending credits are granted again. This is done once until the FEM
+   sends data again, so that an idle FEM is not given credits repeatedly. The
+   number of re-grants is reported with the DAQ status.
+
+   The buffer pool is now lock-free: the receive buffers are taken from it
+   without the network mutex.
+
+   Added FemArray_HoldBuffer(): a buffer passed to the storage thread in place
+   is held until both the event builder and the storage thread have released
+   it with FemArray_ReleaseBuffer(). Frames of the packet ring are not held
+   (see FemArray_CanHoldBuffer()).
+
+   The kernel drops, the receive buffer enlargement and the metrics of the
+   credits, incomplete events and buffer pool are checked by FemArray_Monitor()
+   on the passes of the event builder instead of with the DAQ status only, so
+   that they are also done in infinite DAQ. The DAQ status only prints what
+   happened since the previous one.
+
 *******************************************************************************/
 
 #include "femarray.h"
 #include "bufpool.h"
 #include "evbuilder.h"
+#include "femring.h"
+#include "femuring.h"
 #include "frame.h"
 #include "os_al.h"
 
@@ -80,13 +157,53 @@ void FemArray_Clear(FemArray* fa) {
     fa->is_first_fr = 0;
     fa->req_threshold = CREDIT_THRESHOLD_FOR_REQ;
     fa->cred_unit = 'B'; // Default credit unit is Bytes
+    fa->cred_adapt = 0;
+    fa->cred_timeout_ms = CREDIT_TIMEOUT_MS;
     fa->drop_a_credit = 0;
     fa->delay_a_credit = 0;
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        memcpy(&(fa->snd_cmd[i][0]), "daq 0x000000 B 0x00\n", 21);
+        fa->snd_fem[i] = -1;
+    }
+    fa->snd_nb = 0;
+    fa->snd_call_cnt = 0;
+    fa->snd_req_cnt = 0;
+    fa->snd_call_lst = 0;
+    fa->snd_req_lst = 0;
+    fa->rcv_batch = 1;
+    fa->rcv_call_cnt = 0;
+    fa->rcv_dgram_cnt = 0;
+    fa->rcv_call_lst = 0;
+    fa->rcv_dgram_lst = 0;
+    fa->pool_give_lst = 0;
+    fa->pool_hit_lst = 0;
+    fa->pool_fail_lst = 0;
+    fa->pool_low = -1;
+    fa->ring_drop_lst = 0;
+    fa->mon_ts_lst = 0;
+    fa->rcvbuf_auto = 0;
+    fa->single_sock = 0;
+    fa->sock_fem = -1;
+    fa->busy_poll = 0;
+    fa->busy_poll_usec = 0;
+    fa->rcv_backend = RCV_BACKEND_SOCKET;
+    fa->rcv_thread_nb = 1;
+    for (i = 0; i < MAX_RCV_THREADS; i++) {
+        fa->rcv_thr[i].id = i;
+        fa->rcv_thr[i].thread.thread_id = -1;
+        fa->rcv_thr[i].fa = (void*) fa;
+        fa->rcv_thr[i].fem_set = 0;
+        fa->rcv_thr[i].cpu = -1;
+        fa->rcv_thr[i].epfd = -1;
+        fa->rcv_thr[i].wake_fd = -1;
+    }
     for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
         FemProxy_Clear(&(fa->fp[i]));
     }
 
     fa->bp = (void*) nullptr;
+    fa->ring = (void*) nullptr;
+    fa->uring = (void*) nullptr;
     fa->eb = (void*) nullptr;
 
     fa->pedthr = (FILE*) nullptr;
@@ -101,27 +218,164 @@ int FemArray_Open(FemArray* fa) {
     int done;
     unsigned int mask;
     int err;
+    int nsock;
+    int k;
+    FemRcvThread* rt;
+    struct epoll_event ev;
+
+    // The other backends read all FEMs from one place already
+    if (fa->single_sock && (fa->rcv_backend != RCV_BACKEND_SOCKET)) {
+        printf("FemArray_Open: Warning: single socket mode is only used with the socket receive backend\n");
+        fa->single_sock = 0;
+    }
 
-    // Open socket for each FEM present
+    // Open socket for each FEM present, or only for the first one in single socket mode
     err = 0;
     mask = 0x1;
     done = 0;
+    nsock = 0;
+    fa->sock_fem = -1;
     for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
         if (fa->fem_proxy_set & mask) {
-            if ((err = FemProxy_Open(&fa->fp[i], &(fa->loc_ip[0]), &(fa->rem_ip_beg[0]), i, fa->rem_port)) < 0) {
-                printf("FemProxy_Open failed for FEM %d error %d\n", i, err);
-                return (err);
+            if (fa->sock_fem >= 0) {
+                if ((err = FemProxy_OpenShared(&fa->fp[i], &fa->fp[fa->sock_fem], &(fa->rem_ip_beg[0]), i, fa->rem_port)) < 0) {
+                    printf("FemProxy_OpenShared failed for FEM %d error %d\n", i, err);
+                    return (err);
+                }
+            } else {
+                if ((err = FemProxy_Open(&fa->fp[i], &(fa->loc_ip[0]), &(fa->rem_ip_beg[0]), i, fa->rem_port)) < 0) {
+                    printf("FemProxy_Open failed for FEM %d error %d\n", i, err);
+                    return (err);
+                }
+                nsock++;
+                if (fa->single_sock) {
+                    fa->sock_fem = i;
+                }
             }
         }
         mask <<= 1;
     }
 
+    // Let the kernel busy poll the network device when the sockets are read
+    if (fa->busy_poll && (fa->busy_poll_usec > 0) && (fa->rcv_backend != RCV_BACKEND_PACKET)) {
+        mask = 0x1;
+        for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+            if ((fa->fem_proxy_set & mask) && !fa->fp[i].sock_shared) {
+                FemProxy_SetBusyPoll(&fa->fp[i], fa->busy_poll_usec);
+            }
+            mask <<= 1;
+        }
+    }
+
+    // In batched mode each FEM holds rcv_batch buffers: leave at least half of the pool for the event builder
+    if (fa->rcv_batch < 1) {
+        fa->rcv_batch = 1;
+    } else if (fa->rcv_batch > MAX_RCV_BATCH) {
+        fa->rcv_batch = MAX_RCV_BATCH;
+    }
+    if ((nsock > 0) && ((nsock * fa->rcv_batch) > (int) (((BufPool*) fa->bp)->buf_nb / 2))) {
+        fa->rcv_batch = (((BufPool*) fa->bp)->buf_nb / 2) / nsock;
+        if (fa->rcv_batch < 1) {
+            fa->rcv_batch = 1;
+        }
+        printf("FemArray_Open: Warning: receive batch reduced to %d datagrams to fit in the buffer pool\n", fa->rcv_batch);
+    }
+
     // Create a mutex for exclusive access to shared ressources
     if ((err = Mutex_Create(&fa->snd_mutex)) < 0) {
         printf("FemProxy_Open: Mutex_Create failed %d\n", err);
         return (err);
     }
 
+    // Distribute the FEMs to the receive threads
+    if (fa->rcv_thread_nb < 1) {
+        fa->rcv_thread_nb = 1;
+    } else if (fa->rcv_thread_nb > MAX_RCV_THREADS) {
+        fa->rcv_thread_nb = MAX_RCV_THREADS;
+    }
+    if ((nsock > 0) && (fa->rcv_thread_nb > nsock)) {
+        fa->rcv_thread_nb = nsock;
+    }
+    if ((fa->rcv_backend != RCV_BACKEND_SOCKET) && (fa->rcv_thread_nb > 1)) {
+        printf("FemArray_Open: Warning: the packet and uring receive backends use a single receive thread\n");
+        fa->rcv_thread_nb = 1;
+    }
+    mask = 0x1;
+    k = 0;
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        if (fa->fem_proxy_set & mask) {
+            fa->rcv_thr[k].fem_set |= mask;
+            k = (k + 1) % fa->rcv_thread_nb;
+        }
+        mask <<= 1;
+    }
+
+    for (k = 0; k < fa->rcv_thread_nb; k++) {
+        rt = &(fa->rcv_thr[k]);
+
+        // Create the epoll set of the receive thread
+        if ((rt->epfd = epoll_create1(0)) < 0) {
+            printf("FemArray_Open: epoll_create1 failed: error %d\n", errno);
+            return (-1);
+        }
+
+        // Create the eventfd used to wake up the receive thread
+        if ((rt->wake_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            printf("FemArray_Open: eventfd failed: error %d\n", errno);
+            return (-1);
+        }
+        ev.events = EPOLLIN;
+        ev.data.u32 = MAX_NUMBER_OF_FEMINOS;
+        if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, rt->wake_fd, &ev) < 0) {
+            printf("FemArray_Open: epoll_ctl failed for eventfd: error %d\n", errno);
+            return (-1);
+        }
+
+        // With the packet backend the ring is watched instead of the sockets
+        if (fa->rcv_backend == RCV_BACKEND_PACKET) {
+            if ((err = FemRing_Open((FemRing*) fa->ring, fa)) < 0) {
+                printf("FemArray_Open: FemRing_Open failed %d\n", err);
+                return (err);
+            }
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.u32 = MAX_NUMBER_OF_FEMINOS + 1;
+            if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, ((FemRing*) fa->ring)->sock, &ev) < 0) {
+                printf("FemArray_Open: epoll_ctl failed for packet ring: error %d\n", errno);
+                return (-1);
+            }
+            continue;
+        }
+
+        // With the uring backend the completion queue is watched instead of the sockets
+        if (fa->rcv_backend == RCV_BACKEND_URING) {
+            if ((err = FemUring_Open((FemUring*) fa->uring, fa)) < 0) {
+                printf("FemArray_Open: FemUring_Open failed %d\n", err);
+                return (err);
+            }
+            ev.events = EPOLLIN | EPOLLET;
+            ev.data.u32 = MAX_NUMBER_OF_FEMINOS + 1;
+            if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, ((FemUring*) fa->uring)->fd, &ev) < 0) {
+                printf("FemArray_Open: epoll_ctl failed for uring: error %d\n", errno);
+                return (-1);
+            }
+            continue;
+        }
+
+        // Register the socket of each FEM in edge-triggered mode: the receive loop drains it completely on each event
+        mask = 0x1;
+        for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+            if ((rt->fem_set & mask) && !fa->fp[i].sock_shared) {
+                ev.events = EPOLLIN | EPOLLET;
+                ev.data.u32 = i;
+                if (epoll_ctl(rt->epfd, EPOLL_CTL_ADD, fa->fp[i].client, &ev) < 0) {
+                    printf("FemArray_Open: epoll_ctl failed for FEM %d: error %d\n", i, errno);
+                    return (-1);
+                }
+            }
+            mask <<= 1;
+        }
+    }
+
     // Print setup
     if (fa->verbose) {
         printf("---------------------------------\n");
@@ -138,6 +392,9 @@ int FemArray_Open(FemArray* fa) {
             }
             mask <<= 1;
         }
+        for (k = 0; k < fa->rcv_thread_nb; k++) {
+            printf("Receive thread %d  : FEM set 0x%x cpu %d\n", k, fa->rcv_thr[k].fem_set, fa->rcv_thr[k].cpu);
+        }
         printf("---------------------------------\n");
     }
 
@@ -154,6 +411,147 @@ void FemArray_Close(FemArray* fa) {
     for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
         FemProxy_Close(&(fa->fp[i]));
     }
+
+    // Close the packet ring
+    if (fa->rcv_backend == RCV_BACKEND_PACKET) {
+        FemRing_Close((FemRing*) fa->ring);
+    }
+
+    // Close the uring and return the buffers it holds to the pool
+    if (fa->rcv_backend == RCV_BACKEND_URING) {
+        FemUring_Close((FemUring*) fa->uring);
+    }
+
+    // Close the epoll set and the wakeup eventfd of each receive thread
+    for (i = 0; i < MAX_RCV_THREADS; i++) {
+        if (fa->rcv_thr[i].epfd >= 0) {
+            close(fa->rcv_thr[i].epfd);
+            fa->rcv_thr[i].epfd = -1;
+        }
+        if (fa->rcv_thr[i].wake_fd >= 0) {
+            close(fa->rcv_thr[i].wake_fd);
+            fa->rcv_thr[i].wake_fd = -1;
+        }
+        fa->rcv_thr[i].fem_set = 0;
+    }
+}
+
+/*******************************************************************************
+ FemArray_Wakeup
+
+ Wakes up the receive threads so that they can check their state without
+ waiting for a datagram or for their timeout. Can be called from any thread.
+*******************************************************************************/
+int FemArray_Wakeup(FemArray* fa) {
+    uint64_t one = 1;
+    int k;
+    int err = 0;
+
+    for (k = 0; k < fa->rcv_thread_nb; k++) {
+        if (fa->rcv_thr[k].wake_fd < 0) {
+            continue;
+        }
+        if (write(fa->rcv_thr[k].wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            if (errno != EAGAIN) {
+                printf("FemArray_Wakeup: write failed: error %d\n", errno);
+                err = -1;
+            }
+        }
+    }
+    return (err);
+}
+
+/*******************************************************************************
+ FemArray_CanHoldBuffer
+
+ Tells if a buffer received can be held by another user. A frame of the packet
+ ring cannot: it would keep its whole ring block away from the kernel, which
+ drops packets when it wraps onto a block still in use.
+*******************************************************************************/
+int FemArray_CanHoldBuffer(FemArray* fa, const void* buf) {
+    if ((fa->rcv_backend == RCV_BACKEND_PACKET) && FemRing_IsOwner((FemRing*) fa->ring, (void*) buf)) {
+        return (0);
+    }
+    return (1);
+}
+
+/*******************************************************************************
+ FemArray_HoldBuffer
+
+ Adds a user to a buffer received: it must then be released once more with
+ FemArray_ReleaseBuffer() before it is recycled. The buffer must not be a frame
+ of the packet ring (see FemArray_CanHoldBuffer()). May be called from any
+ thread.
+*******************************************************************************/
+void FemArray_HoldBuffer(FemArray* fa, void* buf) {
+    BufPool_AddRef((BufPool*) fa->bp, buf);
+}
+
+/*******************************************************************************
+ FemArray_ReleaseBuffer
+
+ Gives back a buffer which is no longer used, to the packet ring if it is one
+ of its frames, to the provided buffer ring of the uring if it was lent to it,
+ or to the buffer pool otherwise. A buffer held by several users is only given
+ back by the last one. May be called from any thread.
+*******************************************************************************/
+void FemArray_ReleaseBuffer(FemArray* fa, void* buf) {
+    if ((fa->rcv_backend == RCV_BACKEND_PACKET) && FemRing_IsOwner((FemRing*) fa->ring, buf)) {
+        FemRing_ReleaseFrame((FemRing*) fa->ring, buf);
+    } else if (BufPool_DropRef((BufPool*) fa->bp, buf) > 0) {
+        // Still used by the storage thread or by the event builder
+    } else if ((fa->rcv_backend == RCV_BACKEND_URING) && FemUring_IsOwner((FemUring*) fa->uring, buf)) {
+        FemUring_ReleaseFrame((FemUring*) fa->uring, buf);
+    } else {
+        BufPool_ReturnBuffer(fa->bp, (unsigned long) buf);
+    }
+}
+
+/*******************************************************************************
+ FemArray_StartReceive
+
+ Creates the receive threads and pins them to their CPU core if one was set.
+*******************************************************************************/
+int FemArray_StartReceive(FemArray* fa) {
+    int k;
+    int err;
+    FemRcvThread* rt;
+
+    for (k = 0; k < fa->rcv_thread_nb; k++) {
+        rt = &(fa->rcv_thr[k]);
+        rt->thread.routine = reinterpret_cast<void (*)()>(FemArray_ReceiveLoop);
+        rt->thread.param = (void*) rt;
+        if ((err = Thread_Create(&rt->thread)) < 0) {
+            printf("FemArray_StartReceive: Thread_Create failed %d\n", err);
+            return (err);
+        }
+        if (rt->cpu >= 0) {
+            if ((err = Thread_Set_Affinity(&rt->thread, rt->cpu)) < 0) {
+                printf("FemArray_StartReceive: Warning: could not pin receive thread %d to cpu %d\n", k, rt->cpu);
+            }
+        }
+    }
+    return (0);
+}
+
+/*******************************************************************************
+ FemArray_JoinReceive
+
+ Waits until all the receive threads have stopped.
+*******************************************************************************/
+void FemArray_JoinReceive(FemArray* fa) {
+    int k;
+
+    for (k = 0; k < fa->rcv_thread_nb; k++) {
+        if (fa->rcv_thr[k].thread.thread_id >= 0) {
+            if (Thread_Join(&fa->rcv_thr[k].thread) < 0) {
+                printf("femarray: Thread_Join failed for receive thread %d.\n", k);
+            } else {
+                printf("femarray: Thread_Join done for receive thread %d.\n", k);
+            }
+            fa->rcv_thr[k].thread.thread_id = -1;
+        }
+    }
 }
 
 /*******************************************************************************
@@ -223,15 +621,480 @@ int FemArray_SendCommand(FemArray* fa, unsigned int fem_beg, unsigned int fem_en
 }
 
 /*******************************************************************************
- FemArray_SendDaq
+ FemArray_GetTruncCnt
+
+ Number of datagrams of FEM i dropped because they did not fit in a receive
+ buffer of the pool (socket and uring backends).
 *******************************************************************************/
-int FemArray_SendDaq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, unsigned int fem_pat, char* cmd) {
-    unsigned int i;
-    int err, err2;
-    unsigned int mask;
-    __int64 daq_sz;
-    char daq_cmd[40];
-    int fem_daq_sz;
+static unsigned int FemArray_GetTruncCnt(FemArray* fa, int i) {
+    if (fa->rcv_backend == RCV_BACKEND_URING) {
+        return (((FemUring*) fa->uring)->trunc_fem[i]);
+    }
+    return (fa->fp[i].trunc_cnt);
+}
+
+/*******************************************************************************
+ FemArray_CheckDrops
+
+ Exports the number of datagrams dropped by the kernel and of those truncated
+ and, if rcvbuf_auto is set, enlarges the receive buffer of the sockets that
+ lost datagrams since the last call.
+*******************************************************************************/
+static void FemArray_CheckDrops(FemArray* fa) {
+    int i;
+    unsigned int cur;
+    int sz, prv;
+    FemProxy* fp;
+    auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
+
+    if (fa->rcv_backend == RCV_BACKEND_PACKET) {
+        prometheus_manager.SetKernelDrops("ring", FemRing_GetDropCount((FemRing*) fa->ring));
+        return;
+    }
+
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        if (!(fa->fem_proxy_set & (1 << i))) {
+            continue;
+        }
+        fp = &(fa->fp[i]);
+
+        prometheus_manager.SetTruncatedDatagrams(std::to_string(i), FemArray_GetTruncCnt(fa, i));
+
+        // rxq_ovfl is updated by the receive thread of this FEM
+        cur = fp->rxq_ovfl;
+        prometheus_manager.SetKernelDrops(std::to_string(i), cur);
+        if (cur == fp->rxq_ovfl_chk) {
+            continue;
+        }
+        fp->rxq_ovfl_chk = cur;
+
+        if (fa->rcvbuf_auto && (fp->rcv_buf_sz < SOCK_REV_SIZE_MAX)) {
+            prv = fp->rcv_buf_sz;
+            sz = prv * 2;
+            if (sz > SOCK_REV_SIZE_MAX) {
+                sz = SOCK_REV_SIZE_MAX;
+            }
+            // Only report when the kernel granted more (limited by net.core.rmem_max without CAP_NET_ADMIN)
+            if ((sz = FemProxy_SetRcvBufSize(fp, sz)) > prv) {
+                printf("FemArray_CheckDrops: FEM %d receive buffer raised to %d bytes\n", i, sz);
+            }
+        }
+    }
+}
+
+/*******************************************************************************
+ FemArray_CheckRegrants
+
+ Exports the number of credit re-grants and the credit window of each FEM.
+*******************************************************************************/
+static void FemArray_CheckRegrants(FemArray* fa) {
+    int i;
+    auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
+
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        if (!(fa->fem_proxy_set & (1 << i))) {
+            continue;
+        }
+        prometheus_manager.SetCreditRegrants(std::to_string(i), fa->fp[i].regrant_cnt);
+        prometheus_manager.SetCreditWindow(std::to_string(i), fa->fp[i].cred_win);
+    }
+}
+
+/*******************************************************************************
+ FemArray_CheckEventTimeouts
+
+ Exports the number of events closed after a timeout that each FEM was missing
+ from.
+*******************************************************************************/
+static void FemArray_CheckEventTimeouts(FemArray* fa) {
+    EventBuilder* eb = (EventBuilder*) fa->eb;
+    int i;
+    auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
+
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        if (!(fa->fem_proxy_set & (1 << i))) {
+            continue;
+        }
+        prometheus_manager.SetEventTimeouts(std::to_string(i), eb->src_timeout_cnt[i]);
+    }
+}
+
+/*******************************************************************************
+ FemArray_CheckPool
+
+ Exports the occupancy of the buffer pool, the use of the thread caches and
+ the hold time histogram of the buffers of each FEM recycled since the last
+ call. The lowest number of free buffers is kept in pool_low for the DAQ
+ status.
+*******************************************************************************/
+static void FemArray_CheckPool(FemArray* fa) {
+    int i;
+    int low;
+    unsigned long long give, hit, refill, flush;
+    unsigned long long hist[POOL_HOLD_BIN_NB];
+    unsigned long long sum_us;
+    double hit_ratio;
+    BufPool* bp = (BufPool*) fa->bp;
+    auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
+
+    // Share of the buffers given by the thread caches since the last call
+    BufPool_GetCacheStats(bp, &give, &hit, &refill, &flush);
+    hit_ratio = (give != fa->pool_give_lst) ? ((double) (hit - fa->pool_hit_lst) / (give - fa->pool_give_lst)) : 0.0;
+    fa->pool_give_lst = give;
+    fa->pool_hit_lst = hit;
+    prometheus_manager.SetBufferPool(BufPool_GetFreeCnt(bp), hit_ratio, refill, flush);
+
+    low = BufPool_GetLowWater(bp);
+    if ((fa->pool_low < 0) || (low < fa->pool_low)) {
+        fa->pool_low = low;
+    }
+    prometheus_manager.SetBufferPoolOccupancy(low, BufPool_GetFailCnt(bp));
+
+    for (i = 0; (i < MAX_NUMBER_OF_FEMINOS) && (i < POOL_HOLD_SRC_NB); i++) {
+        if (!(fa->fem_proxy_set & (1 << i))) {
+            continue;
+        }
+        if (BufPool_GetHoldHist(bp, i, hist, &sum_us) > 0) {
+            prometheus_manager.ObserveBufferHoldTimes(std::to_string(i), std::vector<double>(hist, hist + POOL_HOLD_BIN_NB), (double) sum_us);
+        }
+    }
+}
+
+/*******************************************************************************
+ FemArray_Monitor
+
+ Runs the checks above at most every FEMARRAY_MONITOR_MS, whether a DAQ status
+ is asked for or not (e.g. with DAQ -1). Called by FemArray_Daq() on every
+ pass of the event builder, with the network mutex held.
+*******************************************************************************/
+static void FemArray_Monitor(FemArray* fa, unsigned long long now_ns) {
+    if ((now_ns - fa->mon_ts_lst) < (FEMARRAY_MONITOR_MS * 1000000ULL)) {
+        return;
+    }
+    fa->mon_ts_lst = now_ns;
+
+    FemArray_CheckDrops(fa);
+    FemArray_CheckRegrants(fa);
+    FemArray_CheckEventTimeouts(fa);
+    FemArray_CheckPool(fa);
+}
+
+/*******************************************************************************
+ FemArray_StatusWarnings
+
+ Returns the warnings for the DAQ status line about what happened since the
+ last status: datagrams dropped by the kernel or truncated, credits re-granted, incomplete
+ events and buffer pool running low or out of buffers. Called with the network
+ mutex held.
+*******************************************************************************/
+static string FemArray_StatusWarnings(FemArray* fa) {
+    EventBuilder* eb = (EventBuilder*) fa->eb;
+    BufPool* bp = (BufPool*) fa->bp;
+    std::stringstream ss;
+    std::stringstream sd;
+    std::stringstream sc;
+    std::stringstream sr;
+    std::stringstream st;
+    unsigned long long tot;
+    unsigned long long fail;
+    unsigned int cur;
+    int i;
+
+    if (fa->rcv_backend == RCV_BACKEND_PACKET) {
+        tot = ((FemRing*) fa->ring)->drop_cnt;
+        if (tot != fa->ring_drop_lst) {
+            sd << " | ⚠\uFE0F Kernel drops: ring " << (tot - fa->ring_drop_lst);
+            fa->ring_drop_lst = tot;
+        }
+    }
+
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        if (!(fa->fem_proxy_set & (1 << i))) {
+            continue;
+        }
+
+        cur = fa->fp[i].rxq_ovfl;
+        if ((fa->rcv_backend != RCV_BACKEND_PACKET) && (cur != fa->fp[i].rxq_ovfl_lst)) {
+            if (sd.tellp() == 0) {
+                sd << " | ⚠\uFE0F Kernel drops:";
+            }
+            sd << " FEM " << i << ": " << (cur - fa->fp[i].rxq_ovfl_lst);
+            fa->fp[i].rxq_ovfl_lst = cur;
+        }
+
+        cur = FemArray_GetTruncCnt(fa, i);
+        if ((fa->rcv_backend != RCV_BACKEND_PACKET) && (cur != fa->fp[i].trunc_lst)) {
+            if (sc.tellp() == 0) {
+                sc << " | ⚠\uFE0F Truncated datagrams (--pool-buffer-size):";
+            }
+            sc << " FEM " << i << ": " << (cur - fa->fp[i].trunc_lst);
+            fa->fp[i].trunc_lst = cur;
+        }
+
+        cur = fa->fp[i].regrant_cnt;
+        if (cur != fa->fp[i].regrant_lst) {
+            if (sr.tellp() == 0) {
+                sr << " | ⚠\uFE0F Credits re-granted:";
+            }
+            sr << " FEM " << i << ": " << (cur - fa->fp[i].regrant_lst);
+            fa->fp[i].regrant_lst = cur;
+        }
+
+        cur = eb->src_timeout_cnt[i];
+        if (cur != eb->src_timeout_lst[i]) {
+            if (st.tellp() == 0) {
+                st << " | ⚠\uFE0F Incomplete events:";
+            }
+            st << " FEM " << i << ": " << (cur - eb->src_timeout_lst[i]);
+            eb->src_timeout_lst[i] = cur;
+        }
+    }
+    ss << sd.str() << sc.str() << sr.str() << st.str();
+
+    fail = BufPool_GetFailCnt(bp);
+    if (fail != fa->pool_fail_lst) {
+        ss << " | ⚠\uFE0F Buffer pool empty: " << (fail - fa->pool_fail_lst) << " requests failed";
+        fa->pool_fail_lst = fail;
+    } else if ((fa->pool_low >= 0) && (fa->pool_low < (int) (bp->buf_nb / 8))) {
+        ss << " | ⚠\uFE0F Buffer pool low: " << fa->pool_low << " free";
+    }
+    fa->pool_low = -1;
+
+    return ss.str();
+}
+
+/*******************************************************************************
+ FemArray_CheckCredit
+
+ Re-grants the credits pending for a FEM when it has sent no data for
+ cred_timeout_ms: the data request or some of its replies were lost and would
+ otherwise keep these credits consumed for the rest of the run. Called with
+ the network mutex held.
+*******************************************************************************/
+static void FemArray_CheckCredit(FemArray* fa, unsigned int i, unsigned long long now) {
+    FemProxy* fp = &(fa->fp[i]);
+
+    if (fp->cred_rcv != fp->cred_chk) {
+        // Some data came in
+        fp->cred_chk = fp->cred_rcv;
+        fp->cred_chk_ts = now;
+        fp->cred_stalled = 0;
+        return;
+    }
+    if ((fp->pnd_recv <= 0) || ((fa->daq_infinite == 0) && (fa->daq_size_left <= 0))) {
+        // Nothing is expected
+        fp->cred_chk_ts = now;
+        return;
+    }
+    if (fp->cred_stalled || ((now - fp->cred_chk_ts) < (fa->cred_timeout_ms * 1000000ULL))) {
+        return;
+    }
+
+    fp->req_credit += fp->pnd_recv;
+    fp->pnd_recv = 0;
+    fp->rtt_req_ts = 0;
+    fp->cred_stalled = 1;
+    fp->regrant_cnt++;
+}
+
+/*******************************************************************************
+ FemArray_AdaptCredit
+
+ Updates the credit window of a FEM. The window aims at twice the amount of
+ data the FEM delivered per request round trip, plus one request, so that the
+ FEM does not wait for credits while the consumers keep up. When the input
+ queue of the event builder for that FEM or the storage queue fills up, the
+ window is halved instead. pressure is -1 until the storage queue has been
+ looked at during this call of FemArray_Daq(). Called with the network
+ mutex held.
+*******************************************************************************/
+static void FemArray_AdaptCredit(FemArray* fa, unsigned int i, unsigned long long now, int* pressure) {
+    FemProxy* fp = &(fa->fp[i]);
+    EventBuilder* eb = (EventBuilder*) fa->eb;
+    unsigned long long period;
+    unsigned long long used;
+    unsigned long long dt;
+    double target;
+    int win;
+    int win_min;
+    int win_max;
+    int nb_fem;
+
+    // Update the window at most once per period and per two round trips
+    period = 2 * fp->rtt_ns;
+    if (period < CREDIT_ADAPT_PERIOD_NS) {
+        period = CREDIT_ADAPT_PERIOD_NS;
+    }
+    if (fp->cred_ts_lst == 0) {
+        // First call: start measuring
+        fp->cred_rcv_lst = fp->cred_rcv;
+        fp->cred_ts_lst = now;
+        return;
+    }
+    if ((now - fp->cred_ts_lst) < period) {
+        return;
+    }
+    dt = now - fp->cred_ts_lst;
+    used = fp->cred_rcv - fp->cred_rcv_lst;
+    fp->cred_rcv_lst = fp->cred_rcv;
+    fp->cred_ts_lst = now;
+
+    // The window must allow one request and all windows together must leave half of the buffer pool to the event builder
+    nb_fem = __builtin_popcount(fa->fem_proxy_set);
+    if (nb_fem < 1) {
+        nb_fem = 1;
+    }
+    win_min = fa->req_threshold;
+    if (fa->cred_unit == 'B') {
+        win_max = (((BufPool*) fa->bp)->buf_nb / 2 / nb_fem) * ((BufPool*) fa->bp)->buf_sz;
+        if (win_max > MAX_CREDIT_WINDOW_BYTES) {
+            win_max = MAX_CREDIT_WINDOW_BYTES;
+        }
+    } else {
+        win_max = ((BufPool*) fa->bp)->buf_nb / 2 / nb_fem;
+    }
+    if (win_max < win_min) {
+        win_max = win_min;
+    }
+
+    if (*pressure < 0) {
+        *pressure = (feminos_daq_storage::StorageManager::Instance().GetQueueUsage() >= CREDIT_PRESSURE_FILL);
+    }
+
+    if (*pressure || (EventBuilder_GetQueueFill(eb, i) >= (MAX_QUEUE_SIZE / 2))) {
+        // The consumers fall behind
+        win = fp->cred_win / 2;
+    } else if ((used == 0) || (fp->rtt_ns == 0)) {
+        // Idle or round trip not measured yet: keep the current window
+        win = fp->cred_win;
+    } else {
+        // Move smoothly towards twice the amount delivered per round trip
+        target = 2.0 * ((double) used) * ((double) fp->rtt_ns) / ((double) dt) + fa->req_threshold;
+        win = (int) ((3.0 * fp->cred_win + target) / 4.0);
+    }
+
+    if (win < win_min) {
+        win = win_min;
+    } else if (win > win_max) {
+        win = win_max;
+    }
+
+    // Credits currently lent to the FEM are not affected: the available credit may become negative
+    fp->req_credit += win - fp->cred_win;
+    fp->cred_win = win;
+}
+
+/*******************************************************************************
+ FemArray_FormatDaq
+
+ Fills the preformatted data request of a FEM with the amount requested, the
+ credit unit and, unless this is the first request, the sequence number.
+ Returns the length of the command.
+*******************************************************************************/
+static int FemArray_FormatDaq(FemArray* fa, unsigned int i, int sz, int with_seq) {
+    static const char hex[] = "0123456789abcdef";
+    char* c = &(fa->snd_cmd[i][0]);
+    unsigned char seq = fa->fp[i].req_seq_nb;
+    int k;
+
+    if ((sz < 0) || (sz > 0xFFFFFF)) {
+        // Does not fit in the six digits of the template
+        if (with_seq) {
+            return (sprintf(c, "daq 0x%06x %c 0x%02x\n", sz, fa->cred_unit, seq));
+        }
+        return (sprintf(c, "daq 0x%06x %c\n", sz, fa->cred_unit));
+    }
+
+    for (k = 0; k < 6; k++) {
+        c[11 - k] = hex[(sz >> (4 * k)) & 0xF];
+    }
+    c[12] = ' ';
+    c[13] = fa->cred_unit;
+    if (!with_seq) {
+        c[14] = '\n';
+        return (15);
+    }
+    c[14] = ' ';
+    c[15] = '0';
+    c[16] = 'x';
+    c[17] = hex[seq >> 4];
+    c[18] = hex[seq & 0xF];
+    c[19] = '\n';
+    return (20);
+}
+
+/*******************************************************************************
+ FemArray_QueueDaq
+
+ Adds the data request just formatted for a FEM to the requests of this pass.
+*******************************************************************************/
+static void FemArray_QueueDaq(FemArray* fa, unsigned int i, int len) {
+    int n = fa->snd_nb;
+
+    fa->snd_iov[n].iov_base = &(fa->snd_cmd[i][0]);
+    fa->snd_iov[n].iov_len = len;
+    fa->snd_msg[n].msg_hdr.msg_name = &(fa->fp[i].target);
+    fa->snd_msg[n].msg_hdr.msg_namelen = sizeof(struct sockaddr);
+    fa->snd_msg[n].msg_hdr.msg_iov = &(fa->snd_iov[n]);
+    fa->snd_msg[n].msg_hdr.msg_iovlen = 1;
+    fa->snd_msg[n].msg_hdr.msg_control = (void*) 0;
+    fa->snd_msg[n].msg_hdr.msg_controllen = 0;
+    fa->snd_msg[n].msg_hdr.msg_flags = 0;
+    fa->snd_msg[n].msg_len = 0;
+    fa->snd_fem[n] = i;
+    fa->snd_nb++;
+}
+
+/*******************************************************************************
+ FemArray_FlushDaq
+
+ Sends the data requests gathered during a pass. Consecutive requests that go
+ out on the same socket (all of them in single socket mode) are sent with one
+ call to sendmmsg. A request that cannot be sent is reported and treated as
+ lost on the network. Returns 0 or the error of the first request that failed.
+*******************************************************************************/
+static int FemArray_FlushDaq(FemArray* fa) {
+    int beg;
+    int end;
+    int cnt;
+    int sock;
+    int err;
+    int err2;
+
+    err = 0;
+    beg = 0;
+    while (beg < fa->snd_nb) {
+        sock = fa->fp[fa->snd_fem[beg]].client;
+        for (end = beg + 1; (end < fa->snd_nb) && (fa->fp[fa->snd_fem[end]].client == sock); end++) {
+        }
+
+        while (beg < end) {
+            if ((cnt = sendmmsg(sock, &(fa->snd_msg[beg]), end - beg, 0)) <= 0) {
+                err2 = socket_get_error();
+                printf("FemArray_SendDaq: sendmmsg fem(%02d) failed: error %d\n", fa->snd_fem[beg], err2);
+                if (err == 0) {
+                    err = err2;
+                }
+                cnt = 1;
+            } else {
+                fa->snd_call_cnt++;
+                fa->snd_req_cnt += cnt;
+            }
+            beg += cnt;
+        }
+    }
+    fa->snd_nb = 0;
+
+    return (err);
+}
+
+/*******************************************************************************
+ FemArray_DaqStatus
+
+ Prints the DAQ status line and updates the metrics exported to prometheus.
+*******************************************************************************/
+static void FemArray_DaqStatus(FemArray* fa) {
+    int err;
     struct timeval now;
     struct timezone ltz;
     unsigned int diff;
@@ -241,136 +1104,229 @@ int FemArray_SendDaq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, u
     double daq_speed;
     __int64 daq_norm;
     char daq_u;
+    double rcv_batch_avg;
+    double req_rate;
+    double req_batch_avg;
+    double lat_p50, lat_p99;
 
-    err = 0;
-    mask = 1 << fem_beg;
+    diff = 0;
 
-    // Get argument
-#ifdef WIN32
-    if (sscanf(cmd, "DAQ %I64d", &daq_sz) != 1)
-#else
-    if (sscanf(cmd, "DAQ %llu", &daq_sz) != 1)
-#endif
-    {
-        if (fa->daq_infinite == 1) {
-            printf("infinite DAQ\n");
-        } else {
-            // Get the current time
-            gettimeofday(&now, &ltz);
-
-            daq_size_rcv = fa->daq_size_rcv;
-            daq_size_lst = fa->daq_size_lst;
-            daq_size_left = fa->daq_size_left;
-
-            // Compute the time difference since last DAQ command
-            if (fa->daq_last_time.tv_sec != 0) {
-                if (fa->daq_last_time.tv_usec < now.tv_usec) {
-                    diff = ((now.tv_sec - fa->daq_last_time.tv_sec) * 1000000) +
-                           (now.tv_usec - fa->daq_last_time.tv_usec);
-                } else {
-                    diff = ((now.tv_sec - fa->daq_last_time.tv_sec - 1) * 1000000) +
-                           (now.tv_usec + 1000000 - fa->daq_last_time.tv_usec);
-                }
-            }
+    // The warnings are collected under the network mutex, like the checks of FemArray_Monitor()
+    if ((err = Mutex_Lock(fa->snd_mutex)) < 0) {
+        printf("FemArray_DaqStatus: Mutex_Lock failed %d\n", err);
+        return;
+    }
+    const string warn_string = FemArray_StatusWarnings(fa);
+    if ((err = Mutex_Unlock(fa->snd_mutex)) < 0) {
+        printf("FemArray_DaqStatus: Mutex_Unlock failed %d\n", err);
+    }
 
-            // Compute transfer speed from last DAQ command to the current one
-            if (diff != 0) {
-                daq_speed = ((double) (fa->daq_size_rcv - fa->daq_size_lst)) / diff;
+    if (fa->daq_infinite == 1) {
+        cout << "infinite DAQ" << warn_string << endl;
+    } else {
+        // Get the current time
+        gettimeofday(&now, &ltz);
+
+        daq_size_rcv = fa->daq_size_rcv;
+        daq_size_lst = fa->daq_size_lst;
+        daq_size_left = fa->daq_size_left;
+
+        // Compute the time difference since last DAQ command
+        if (fa->daq_last_time.tv_sec != 0) {
+            if (fa->daq_last_time.tv_usec < now.tv_usec) {
+                diff = ((now.tv_sec - fa->daq_last_time.tv_sec) * 1000000) +
+                       (now.tv_usec - fa->daq_last_time.tv_usec);
             } else {
-                daq_speed = 0.0;
+                diff = ((now.tv_sec - fa->daq_last_time.tv_sec - 1) * 1000000) +
+                       (now.tv_usec + 1000000 - fa->daq_last_time.tv_usec);
             }
+        }
 
-            // Compute the data volume collected
-            daq_norm = daq_size_rcv;
-            daq_u = ' ';
-            if (daq_norm > 10240) {
-                daq_norm = daq_size_rcv / 1024;
-                daq_u = 'K';
-            }
-            if (daq_norm > 10240) {
-                daq_norm = daq_norm / 1024;
-                daq_u = 'M';
-            }
-            if (daq_norm > 10240) {
-                daq_norm = daq_norm / 1024;
-                daq_u = 'G';
-            }
-            if (daq_norm > 10240) {
-                daq_norm = daq_norm / 1024;
-                daq_u = 'T';
-            }
+        // Compute transfer speed from last DAQ command to the current one
+        if (diff != 0) {
+            daq_speed = ((double) (fa->daq_size_rcv - fa->daq_size_lst)) / diff;
+        } else {
+            daq_speed = 0.0;
+        }
 
-            /*
+        // Compute the data volume collected
+        daq_norm = daq_size_rcv;
+        daq_u = ' ';
+        if (daq_norm > 10240) {
+            daq_norm = daq_size_rcv / 1024;
+            daq_u = 'K';
+        }
+        if (daq_norm > 10240) {
+            daq_norm = daq_norm / 1024;
+            daq_u = 'M';
+        }
+        if (daq_norm > 10240) {
+            daq_norm = daq_norm / 1024;
+            daq_u = 'G';
+        }
+        if (daq_norm > 10240) {
+            daq_norm = daq_norm / 1024;
+            daq_u = 'T';
+        }
+
+        /*
 #ifdef WIN32
-            printf("0 DAQ: collected %I64d %cB (%I64d bytes %I64d bytes left) speed: %.2f MB/s\n", daq_norm, daq_u, daq_size_rcv, daq_size_left, daq_speed);
+        printf("0 DAQ: collected %I64d %cB (%I64d bytes %I64d bytes left) speed: %.2f MB/s\n", daq_norm, daq_u, daq_size_rcv, daq_size_left, daq_speed);
 #else
-            printf("0 DAQ: collected %llu %cB (%llu bytes %llu bytes left) speed: %.2f MB/s\n", daq_norm, daq_u,
-                   daq_size_rcv, daq_size_left, daq_speed);
+        printf("0 DAQ: collected %llu %cB (%llu bytes %llu bytes left) speed: %.2f MB/s\n", daq_norm, daq_u,
+               daq_size_rcv, daq_size_left, daq_speed);
 
 #endif
-             */
-            // const auto space_left_gb = feminos_daq_prometheus::GetFreeDiskSpaceGigabytes("/");
-            const auto speed_events_per_second = feminos_daq_storage::StorageManager::Instance().GetSpeedEventsPerSecond();
-            const auto number_of_events = feminos_daq_storage::StorageManager::Instance().GetNumberOfEntries();
-
-            auto& storageManager = feminos_daq_storage::StorageManager::Instance();
-            const auto queueUsage = storageManager.GetQueueUsage();
+         */
+        // const auto space_left_gb = feminos_daq_prometheus::GetFreeDiskSpaceGigabytes("/");
+        const auto speed_events_per_second = feminos_daq_storage::StorageManager::Instance().GetSpeedEventsPerSecond();
+        const auto number_of_events = feminos_daq_storage::StorageManager::Instance().GetNumberOfEntries();
+
+        auto& storageManager = feminos_daq_storage::StorageManager::Instance();
+        const auto queueUsage = storageManager.GetQueueUsage();
+
+        time_t now_time = time(nullptr);
+        tm* now_tm = gmtime(&now_time);
+        char time_str[80];
+        strftime(time_str, 80, "[%Y-%m-%dT%H:%M:%SZ]", now_tm);
+
+        string q_fill_string;
+        if (queueUsage > 0.05) {
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(1) << queueUsage * 100.0;
+            q_fill_string = " | ⚠\uFE0F Queue at " + ss.str() + "% Capacity ⚠\uFE0F - Consider changing the '--compression' option";
+        }
 
-            time_t now_time = time(nullptr);
-            tm* now_tm = gmtime(&now_time);
-            char time_str[80];
-            strftime(time_str, 80, "[%Y-%m-%dT%H:%M:%SZ]", now_tm);
+        // Average number of datagrams obtained per receive call that found some, since the last status
+        if (fa->rcv_call_cnt != fa->rcv_call_lst) {
+            rcv_batch_avg = ((double) (fa->rcv_dgram_cnt - fa->rcv_dgram_lst)) / (fa->rcv_call_cnt - fa->rcv_call_lst);
+        } else {
+            rcv_batch_avg = 0.0;
+        }
+        fa->rcv_call_lst = fa->rcv_call_cnt;
+        fa->rcv_dgram_lst = fa->rcv_dgram_cnt;
+
+        string rcv_batch_string;
+        if (fa->rcv_batch > 1) {
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(1) << rcv_batch_avg;
+            rcv_batch_string = " | Batch: " + ss.str() + " dgram/call";
+        }
 
-            string q_fill_string;
-            if (queueUsage > 0.05) {
-                std::stringstream ss;
-                ss << std::fixed << std::setprecision(1) << queueUsage * 100.0;
-                q_fill_string = " | ⚠\uFE0F Queue at " + ss.str() + "% Capacity ⚠\uFE0F - Consider changing the '--compression' option";
-            }
+        // Rate of data requests and average number of requests per send call since the last status
+        req_rate = (diff != 0) ? (((double) (fa->snd_req_cnt - fa->snd_req_lst)) * 1000000.0 / diff) : 0.0;
+        if (fa->snd_call_cnt != fa->snd_call_lst) {
+            req_batch_avg = ((double) (fa->snd_req_cnt - fa->snd_req_lst)) / (fa->snd_call_cnt - fa->snd_call_lst);
+        } else {
+            req_batch_avg = 0.0;
+        }
+        fa->snd_call_lst = fa->snd_call_cnt;
+        fa->snd_req_lst = fa->snd_req_cnt;
+
+        // Requests are only sent several at a time when the FEMs share a socket
+        string req_string;
+        if (fa->sock_fem >= 0) {
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(0) << req_rate << " req/s (" << std::setprecision(1) << req_batch_avg << "/call)";
+            req_string = " | Requests: " + ss.str();
+        }
 
-            cout << time_str << " | # Entries: " << number_of_events << " | 🏃 Speed: " << speed_events_per_second << " entry/s (" << daq_speed << " MB/s)" << q_fill_string << endl;
+        // Event building latency since the last status
+        string lat_string;
+        const auto lat_cnt = EventBuilder_GetLatency((EventBuilder*) fa->eb, &lat_p50, &lat_p99);
+        if (lat_cnt > 0) {
+            std::stringstream ss;
+            ss << std::fixed << std::setprecision(0) << lat_p50 << "/" << lat_p99;
+            lat_string = " | Latency p50/p99: " + ss.str() + " us";
+        }
 
-            auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
+        cout << time_str << " | # Entries: " << number_of_events << " | 🏃 Speed: " << speed_events_per_second << " entry/s (" << daq_speed << " MB/s)" << rcv_batch_string << req_string << lat_string << warn_string << q_fill_string << endl;
 
-            prometheus_manager.SetDaqSpeedMB(daq_speed);
-            prometheus_manager.SetDaqSpeedEvents(speed_events_per_second);
-            prometheus_manager.SetFrameQueueFillLevel(queueUsage);
+        auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
 
-            // Update the new time and size of received data
-            fa->daq_last_time = now;
-            fa->daq_size_lst = daq_size_rcv;
+        if (lat_cnt > 0) {
+            prometheus_manager.SetEventLatency(lat_p50, lat_p99);
         }
 
-        return 0;
+        prometheus_manager.SetDaqSpeedMB(daq_speed);
+        prometheus_manager.SetDaqSpeedEvents(speed_events_per_second);
+        prometheus_manager.SetFrameQueueFillLevel(queueUsage);
+        prometheus_manager.SetReceiveBatchSize(rcv_batch_avg);
+        prometheus_manager.SetCreditRequests(req_rate, req_batch_avg);
+
+        // Update the new time and size of received data
+        fa->daq_last_time = now;
+        fa->daq_size_lst = daq_size_rcv;
     }
 
+}
+
+/*******************************************************************************
+ FemArray_Daq
+
+ Typed front end of the data acquisition: starts, stops or sizes the
+ acquisition and sends data requests to the FEMs of the pattern that have
+ enough credits, or prints the DAQ status. This is what the event builder
+ calls on every pass to replenish the credits of the FEMs.
+*******************************************************************************/
+int FemArray_Daq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, unsigned int fem_pat, const FemDaqCmd* dc) {
+    unsigned int i;
+    int err, err2;
+    unsigned int mask;
+    int daq_len;
+    int fem_daq_sz;
+    unsigned long long now_ns;
+    int pressure;
+
+    if (dc->action == FEMDAQ_STATUS) {
+        FemArray_DaqStatus(fa);
+        return (0);
+    }
+
+    err = 0;
+    now_ns = 0;
+    mask = 1 << fem_beg;
+
     // Get mutex to send over the network
     if ((err = Mutex_Lock(fa->snd_mutex)) < 0) {
-        printf("FemArray_SendDaq: Mutex_Lock failed %d\n", err);
+        printf("FemArray_Daq: Mutex_Lock failed %d\n", err);
         return (err);
     }
 
-    if (daq_sz == 0) // stop acquisition
-    {
-        fa->daq_infinite = 0;
-        fa->daq_size_left = 0;
-    } else if (daq_sz == -1) // unlimited size
-    {
-        fa->daq_infinite = 1;
-    } else if (daq_sz == -2) // pursue on-going acquisition
-    {
+    now_ns = Time_GetMonotonicNs();
+    pressure = -1;
 
-    } else if (daq_sz > 0) // specify amount of data to collect
-    {
+    FemArray_Monitor(fa, now_ns);
+
+    switch (dc->action) {
+    case FEMDAQ_STOP:
+        fa->daq_infinite = 0;
+        fa->daq_size_left = 0;
+        break;
+    case FEMDAQ_START:
+        fa->daq_infinite = 1;
+        break;
+    case FEMDAQ_SET_SIZE:
         fa->daq_infinite = 0;
-        fa->daq_size_left = daq_sz;
+        fa->daq_size_left = dc->size;
         fa->daq_size_rcv = 0;
+        break;
+    default:
+        // Pursue on-going acquisition
+        break;
     }
 
     // Loop on fem set
     for (i = fem_beg; i <= fem_end; i++) {
         // Is this fem among the target?
         if (mask & fem_pat) {
+            if (fa->cred_timeout_ms > 0) {
+                FemArray_CheckCredit(fa, i, now_ns);
+            }
+            if (fa->cred_adapt) {
+                FemArray_AdaptCredit(fa, i, now_ns, &pressure);
+            }
+
             // Check that this fem has some credits
             if (fa->fp[i].req_credit >= fa->req_threshold) {
                 // Compute the size of this request
@@ -414,35 +1370,32 @@ int FemArray_SendDaq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, u
                     // On the first data request to that FEM we clear the local sequence number
                     // and we omit the sequence number in the command to also clear it at the remote end
                     if (fa->fp[i].is_first_req) {
-                        sprintf(daq_cmd, "daq 0x%06x %c\n", fem_daq_sz, fa->cred_unit);
+                        daq_len = FemArray_FormatDaq(fa, i, fem_daq_sz, 0);
                         fa->fp[i].req_seq_nb = 0xFF; // we put 0xFF so that the first sequence number sent will be 0x00
                         fa->fp[i].is_first_req = 0;
                     } else {
-                        sprintf(daq_cmd, "daq 0x%06x %c 0x%02x\n", fem_daq_sz, fa->cred_unit, fa->fp[i].req_seq_nb);
+                        daq_len = FemArray_FormatDaq(fa, i, fem_daq_sz, 1);
                     }
 
                     if (fa->drop_a_credit == 1) {
                         // Drop the request frame to inject a fault
                     } else {
                         if (fa->delay_a_credit) {
-                            // Delay the send of that credit
+                            // Delay the send of that credit (and of the others gathered in this pass)
                             Sleep(fa->delay_a_credit);
                             fa->delay_a_credit = 0;
                         }
-                        // Post the command normally
-                        if ((err = sendto(fa->fp[i].client,
-                                          daq_cmd,
-                                          strlen(daq_cmd),
-                                          0,
-                                          (struct sockaddr*) &(fa->fp[i].target),
-                                          sizeof(struct sockaddr))) == -1) {
-                            err = socket_get_error();
-                            printf("FemArray_SendDaq: sendto fem(%02d) failed: error %d\n", i, err);
-                            break;
-                        }
+                        // Post the command with the others at the end of the pass
+                        FemArray_QueueDaq(fa, i, daq_len);
                     }
                     fa->drop_a_credit = 0;
 
+                    // Time this request: its data comes after the data still pending for the previous ones
+                    if (fa->cred_adapt && (fem_daq_sz > 0) && (fa->fp[i].rtt_req_ts == 0)) {
+                        fa->fp[i].rtt_mark = fa->fp[i].cred_rcv + fa->fp[i].pnd_recv;
+                        fa->fp[i].rtt_req_ts = now_ns;
+                    }
+
                     fa->fp[i].req_credit -= fem_daq_sz;
                     fa->fp[i].pnd_recv += fem_daq_sz;
 
@@ -468,7 +1421,7 @@ int FemArray_SendDaq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, u
                     if (fa->daq_size_left <= 0) {
                         fa->fp[i].last_ack_sent = 1;
                     }
-                    // printf("FemArray_SendDaq: sent to FEM(%02d) %s", i, daq_cmd);
+                    // printf("FemArray_SendDaq: sent to FEM(%02d) %s", i, fa->snd_cmd[i]);
                 }
             } else {
                 // printf("FemArray_SendDaq: fem(%02d) has no more credits.\n", i);
@@ -483,46 +1436,87 @@ int FemArray_SendDaq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, u
         }
     }
 
+    // Send the requests of all FEMs, still under the mutex to keep them in sequence number order
+    err = FemArray_FlushDaq(fa);
+
     // Release network mutex
     if ((err2 = Mutex_Unlock(fa->snd_mutex)) < 0) {
-        printf("FemArray_SendDaq: Mutex_Unlock failed %d\n", err2);
+        printf("FemArray_Daq: Mutex_Unlock failed %d\n", err2);
         return (err2);
     }
 
     return (err);
 }
 
+/*******************************************************************************
+ FemArray_SendDaq
+
+ ASCII front end of FemArray_Daq() for the command fetcher:
+   DAQ        print the DAQ status
+   DAQ 0      stop the acquisition
+   DAQ -1     acquire for ever
+   DAQ -2     pursue the on-going acquisition (replenish credits)
+   DAQ N      acquire N bytes (or frames)
+*******************************************************************************/
+int FemArray_SendDaq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, unsigned int fem_pat, char* cmd) {
+    __int64 daq_sz;
+    FemDaqCmd dc;
+
+    daq_sz = 0;
+    // Get argument
+#ifdef WIN32
+    if (sscanf(cmd, "DAQ %I64d", &daq_sz) != 1)
+#else
+    if (sscanf(cmd, "DAQ %llu", &daq_sz) != 1)
+#endif
+    {
+        dc.action = FEMDAQ_STATUS;
+    } else if (daq_sz == 0) {
+        dc.action = FEMDAQ_STOP;
+    } else if (daq_sz == -1) {
+        dc.action = FEMDAQ_START;
+    } else if (daq_sz > 0) {
+        dc.action = FEMDAQ_SET_SIZE;
+    } else {
+        dc.action = FEMDAQ_REPLENISH;
+    }
+    dc.size = daq_sz;
+
+    return (FemArray_Daq(fa, fem_beg, fem_end, fem_pat, &dc));
+}
+
 /*******************************************************************************
  FemArray_EventBuilderIO
 *******************************************************************************/
 int FemArray_EventBuilderIO(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, unsigned int fem_pat) {
     unsigned int i;
-    int err, err2;
+    int err;
     unsigned int mask;
     EventBuilder* eb;
+    int k;
+    int posted;
 
     err = 0;
+    posted = 0;
     mask = 1 << fem_beg;
     eb = (EventBuilder*) fa->eb;
 
-    // Get mutex to event builder queues
-    if ((err = Mutex_Lock(eb->q_mutex)) < 0) {
-        printf("FemArray_EventBuilderIO: Mutex_Lock failed %d\n", err);
-        return (err);
-    }
-
-    // Loop on fem set
+    // Loop on fem set. The input queue of each FEM is only written by its receive thread and needs no lock
     for (i = fem_beg; i <= fem_end; i++) {
         // Is this fem among the target?
         if (mask & fem_pat) {
-            // Does this FEM has a buffer for the Event Builder?
-            if (fa->fp[i].buf_to_eb) {
-                // Post the buffer to the event builder
-                if ((err = EventBuilder_PutBufferToProcess(eb, fa->fp[i].buf_to_eb, i)) < 0) {
+            // Post all the buffers this FEM collected for the Event Builder
+            for (k = 0; k < fa->fp[i].buf_to_eb_cnt; k++) {
+                if ((err = EventBuilder_PutBufferToProcess(eb, fa->fp[i].buf_to_eb_v[k], i, fa->fp[i].buf_to_eb_ts[k])) < 0) {
                     printf("FemArray_EventBuilderIO: EventBuilder_PutBufferToProcess failed %d\n", err);
-                    return (err);
+                    break;
                 }
-                fa->fp[i].buf_to_eb = 0;
+                fa->fp[i].buf_to_eb_v[k] = 0;
+                posted++;
+            }
+            fa->fp[i].buf_to_eb_cnt = 0;
+            if (err < 0) {
+                break;
             }
         }
         // Did we do the last fem?
@@ -533,16 +1527,16 @@ int FemArray_EventBuilderIO(FemArray* fa, unsigned int fem_beg, unsigned int fem
         }
     }
 
-    // Release mutex to event builder queues
-    if ((err2 = Mutex_Unlock(eb->q_mutex)) < 0) {
-        printf("FemArray_EventBuilderIO: Mutex_Unlock failed %d\n", err2);
-        return (err2);
+    if (err < 0) {
+        return (err);
     }
 
-    // Wakeup the event builder
-    if ((err = Semaphore_Signal(eb->sem_wakeup)) < 0) {
-        printf("FemArray_EventBuilderIO: Semaphore_Signal failed %d\n", err);
-        return (err);
+    // Wakeup the event builder. In busy poll mode the receive loop never waits, so
+    // only do it when there is something new (the event builder spin has a timeout)
+    if (posted || !eb->busy_poll) {
+        if ((err = EventBuilder_Wakeup(eb)) < 0) {
+            return (err);
+        }
     }
 
     return (err);
@@ -625,128 +1619,488 @@ int FemArray_SavePedThrList(FemArray* fa, void* buf) {
     return (err);
 }
 
+/*******************************************************************************
+ FemArray_DispatchFrame
+
+ Common handling of a frame that was just processed by FemProxy_ProcessFrame():
+ save pedestal/threshold lists, return unused buffers to the pool, update the
+ count of command replies and collect data frames for the event builder.
+*******************************************************************************/
+static int FemArray_DispatchFrame(FemArray* fa, unsigned int i, int was_pnd, int* no_longer_pnd_cnt, int* was_event_data) {
+    int err = 0;
+    FemProxy* fp = &(fa->fp[i]);
+    unsigned long long sample;
+
+    // If the response is pedestal or thresholds, save them to file on disk
+    if (fa->is_list_fr_pnd && fp->buf_to_bp) {
+        if ((err = FemArray_SavePedThrList(fa, fp->buf_to_bp)) < 0) {
+            printf("FemArray_ReceiveLoop: FemArray_SavePedThrList failed\n", err);
+            return (err);
+        }
+    }
+
+    // Return this buffer to buffer manager if it is no longer used
+    if (fp->buf_to_bp) {
+        FemArray_ReleaseBuffer(fa, fp->buf_to_bp);
+        fp->buf_to_bp = (unsigned char*) 0;
+    }
+
+    // Check if a command was pending and is no longer pending for that fem
+    if ((was_pnd == 1) && (fp->is_cmd_pending == 0)) {
+        (*no_longer_pnd_cnt)++;
+    } else {
+        if (!fp->is_data_frame) {
+            printf("FemArray_ReceiveLoop: received monitoring or configuration reply frame from FEM %d but no command was pending.\n",
+                   i);
+        }
+    }
+    *was_event_data += fp->is_data_frame;
+
+    // Count the credits consumed by data frames and sample the request round trip time
+    if (fp->buf_to_eb) {
+        fp->cred_rcv += (fa->cred_unit == 'B') ? *((unsigned short*) fp->buf_to_eb) : 1;
+        if (fp->rtt_req_ts && (fp->cred_rcv > fp->rtt_mark)) {
+            sample = Time_GetMonotonicNs() - fp->rtt_req_ts;
+            fp->rtt_ns = fp->rtt_ns ? ((7 * fp->rtt_ns + sample) / 8) : sample;
+            fp->rtt_req_ts = 0;
+        }
+    }
+
+    // Collect the buffer to be handed to the event builder
+    if (fp->buf_to_eb) {
+        fp->buf_to_eb_v[fp->buf_to_eb_cnt] = fp->buf_to_eb;
+        fp->buf_to_eb_ts[fp->buf_to_eb_cnt] = fp->rcv_ts;
+        fp->buf_to_eb_cnt++;
+        fp->buf_to_eb = (unsigned char*) 0;
+    }
+
+    return (err);
+}
+
+/*******************************************************************************
+ FemArray_SourceFem
+
+ Returns the index of the FEM a datagram was sent by, according to its source
+ address, or -1 if it does not come from a FEM of the array.
+*******************************************************************************/
+static int FemArray_SourceFem(FemArray* fa, struct sockaddr_in* src) {
+    unsigned char* adr = (unsigned char*) &(src->sin_addr.s_addr);
+    int i;
+
+    if ((adr[0] != fa->rem_ip_beg[0]) || (adr[1] != fa->rem_ip_beg[1]) || (adr[2] != fa->rem_ip_beg[2]) ||
+        (ntohs(src->sin_port) != fa->rem_port)) {
+        return (-1);
+    }
+    i = adr[3] - fa->rem_ip_beg[3];
+    if ((i < 0) || (i >= MAX_NUMBER_OF_FEMINOS) || !(fa->fem_proxy_set & (1 << i))) {
+        return (-1);
+    }
+    return (i);
+}
+
+/*******************************************************************************
+ FemArray_ReceiveFem
+
+ Receives the datagrams pending on the socket of one FEM. In batched mode, up
+ to rcv_batch datagrams are read with a single system call. The network mutex
+ is only taken to process the frames, not to get buffers from the pool nor
+ during the system call. Returns the number of
+ datagrams received, 0 if the socket has been drained, or a negative value on a
+ fatal error.
+*******************************************************************************/
+static int FemArray_ReceiveFem(FemArray* fa, unsigned int i, int* no_longer_pnd_cnt, int* was_event_data) {
+    int err, err2;
+    int was_pnd;
+    int cnt;
+    int k;
+    int j;
+    FemProxy* fp = &(fa->fp[i]);
+    FemProxy* fq;
+
+    // Get the receive buffers that this FEM does not already have. They are only changed by its receive
+    // thread and the buffer pool needs no lock.
+    err = 0;
+    if (fa->rcv_batch <= 1) {
+        if (fp->buf_in == (unsigned char*) 0) {
+            if ((err = BufPool_GiveBuffer(fa->bp, (void**) (&(fp->buf_in)), AUTO_RETURNED)) < 0) {
+                printf("FemArray_ReceiveLoop: BufPool_GiveBuffer failed\n", err);
+            }
+        }
+    } else {
+        for (k = 0; (k < fa->rcv_batch) && (err >= 0); k++) {
+            if (fp->buf_in_v[k] == (unsigned char*) 0) {
+                if ((err = BufPool_GiveBuffer(fa->bp, (void**) (&(fp->buf_in_v[k])), AUTO_RETURNED)) < 0) {
+                    printf("FemArray_ReceiveLoop: BufPool_GiveBuffer failed\n", err);
+                }
+            }
+        }
+    }
+    if (err < 0) {
+        return (err);
+    }
+
+    // Receive the frames pending for that fem, up to the batch size
+    if (fa->rcv_batch <= 1) {
+        cnt = FemProxy_ReceiveFrame(fp, ((BufPool*) fa->bp)->buf_sz);
+    } else {
+        cnt = FemProxy_ReceiveBatch(fp, fa->rcv_batch, ((BufPool*) fa->bp)->buf_sz);
+    }
+    if (cnt < 0) {
+        // Transient errors (e.g. ICMP port unreachable) were retried: this one concerns the socket itself
+        printf("FemArray_ReceiveLoop: receive failed for FEM %d\n", i);
+        return (cnt);
+    }
+    if (cnt == 0) {
+        return (0);
+    }
+
+    // Get the network mutex
+    if ((err = Mutex_Lock(fa->snd_mutex)) < 0) {
+        printf("FemArray_ReceiveLoop: Mutex_Lock failed %d\n", err);
+        return (err);
+    }
+
+    fa->rcv_call_cnt++;
+    fa->rcv_dgram_cnt += cnt;
+
+    // Process each frame received; the buffers consumed are replaced at the next call
+    for (k = 0; k < cnt; k++) {
+        if (fa->rcv_batch > 1) {
+            fp->buf_in = fp->buf_in_v[k];
+            fp->buf_in_len = (unsigned short) fp->rcv_msg[k].msg_len;
+            fp->buf_in_v[k] = (unsigned char*) 0;
+        }
+
+        // In single socket mode, the frame goes to the proxy of the FEM that sent it
+        j = (int) i;
+        if (fa->sock_fem >= 0) {
+            if ((j = FemArray_SourceFem(fa, (fa->rcv_batch > 1) ? &(fp->rcv_src[k]) : &(fp->remote))) < 0) {
+                printf("FemArray_ReceiveLoop: dropped a datagram that does not come from a FEM of the array\n");
+                // Keep the buffer for the next receive
+                if (fa->rcv_batch > 1) {
+                    fp->buf_in_v[k] = fp->buf_in;
+                    fp->buf_in = (unsigned char*) 0;
+                }
+                continue;
+            }
+            if (j != (int) i) {
+                fa->fp[j].buf_in = fp->buf_in;
+                fa->fp[j].buf_in_len = fp->buf_in_len;
+                fp->buf_in = (unsigned char*) 0;
+            }
+        }
+        fq = &(fa->fp[j]);
+        fq->rcv_ts = fp->rcv_ts_v[(fa->rcv_batch > 1) ? k : 0];
+        BufPool_HoldBegin((BufPool*) fa->bp, fq->buf_in, j, fq->rcv_ts);
+
+        // See if there is a command pending reply for that fem
+        was_pnd = fq->is_cmd_pending;
+
+        if ((err = FemProxy_ProcessFrame(fq)) < 0) {
+            break;
+        }
+        if ((err = FemArray_DispatchFrame(fa, j, was_pnd, no_longer_pnd_cnt, was_event_data)) < 0) {
+            break;
+        }
+    }
+
+    // Release the network mutex
+    if ((err2 = Mutex_Unlock(fa->snd_mutex)) < 0) {
+        printf("FemArray_ReceiveLoop: Mutex_Unlock failed %d\n", err2);
+        return (err2);
+    }
+    if (err < 0) {
+        return (err);
+    }
+
+    return (cnt);
+}
+
+/*******************************************************************************
+ FemArray_ReceiveRing
+
+ Reads the next block of the packet ring if it is ready. The frames are
+ processed in place. Returns 1 if a block was read, 0 if none was ready, or a
+ negative value on a fatal error.
+*******************************************************************************/
+static int FemArray_ReceiveRing(FemArray* fa, int* no_longer_pnd_cnt, int* was_event_data) {
+    FemRing* fr = (FemRing*) fa->ring;
+    FemProxy* fp;
+    int err, err2;
+    int was_pnd;
+    int cnt;
+    int i;
+    unsigned char* buf;
+    unsigned short len;
+    unsigned long long ts;
+
+    if (FemRing_GetBlock(fr) == 0) {
+        return (0);
+    }
+
+    // Get the network mutex
+    if ((err = Mutex_Lock(fa->snd_mutex)) < 0) {
+        printf("FemArray_ReceiveLoop: Mutex_Lock failed %d\n", err);
+        return (err);
+    }
+
+    cnt = 0;
+    while (FemRing_NextFrame(fr, &i, &buf, &len, &ts)) {
+        fp = &(fa->fp[i]);
+        fp->rcv_ts = ts;
+
+        // See if there is a command pending reply for that fem
+        was_pnd = fp->is_cmd_pending;
+
+        fp->buf_in = buf;
+        fp->buf_in_len = len;
+        if ((err = FemProxy_ProcessFrame(fp)) < 0) {
+            break;
+        }
+        if ((err = FemArray_DispatchFrame(fa, i, was_pnd, no_longer_pnd_cnt, was_event_data)) < 0) {
+            break;
+        }
+        cnt++;
+
+        // A block can hold more frames of a FEM than can be collected: pass them to the event builder now
+        if (fp->buf_to_eb_cnt == MAX_RCV_BATCH) {
+            if ((err = Mutex_Unlock(fa->snd_mutex)) < 0) {
+                printf("FemArray_ReceiveLoop: Mutex_Unlock failed %d\n", err);
+                return (err);
+            }
+            if ((err = FemArray_EventBuilderIO(fa, i, i, 1 << i)) < 0) {
+                return (err);
+            }
+            if ((err = Mutex_Lock(fa->snd_mutex)) < 0) {
+                printf("FemArray_ReceiveLoop: Mutex_Lock failed %d\n", err);
+                return (err);
+            }
+        }
+    }
+
+    fa->rcv_call_cnt++;
+    fa->rcv_dgram_cnt += cnt;
+
+    // Release the network mutex
+    if ((err2 = Mutex_Unlock(fa->snd_mutex)) < 0) {
+        printf("FemArray_ReceiveLoop: Mutex_Unlock failed %d\n", err2);
+        return (err2);
+    }
+    if (err < 0) {
+        return (err);
+    }
+
+    // The block goes back to the kernel when the event builder has released all its frames
+    FemRing_PutBlock(fr);
+
+    return (1);
+}
+
+/*******************************************************************************
+ FemArray_ReceiveUring
+
+ Processes the datagrams completed by the multishot receives of the uring, up
+ to FEMURING_MAX_CQE per call, and posts again the receives that have ended.
+ Returns the number of datagrams processed or a negative value on a fatal
+ error.
+*******************************************************************************/
+static int FemArray_ReceiveUring(FemArray* fa, int* no_longer_pnd_cnt, int* was_event_data) {
+    FemUring* fu = (FemUring*) fa->uring;
+    FemProxy* fp;
+    int err, err2;
+    int was_pnd;
+    int cnt;
+    int i;
+    unsigned char* buf;
+    unsigned short len;
+    unsigned int ovfl;
+    unsigned long long ts;
+
+    // Get the network mutex
+    if ((err = Mutex_Lock(fa->snd_mutex)) < 0) {
+        printf("FemArray_ReceiveLoop: Mutex_Lock failed %d\n", err);
+        return (err);
+    }
+
+    cnt = 0;
+    ovfl = 0;
+    while ((cnt < FEMURING_MAX_CQE) && FemUring_NextFrame(fu, &i, &buf, &len, &ovfl, &ts)) {
+        fp = &(fa->fp[i]);
+        fp->rcv_ts = ts;
+        if (ovfl > fp->rxq_ovfl) {
+            fp->rxq_ovfl = ovfl;
+        }
+        BufPool_HoldBegin((BufPool*) fa->bp, buf, i, ts);
+
+        // See if there is a command pending reply for that fem
+        was_pnd = fp->is_cmd_pending;
+
+        fp->buf_in = buf;
+        fp->buf_in_len = len;
+        if ((err = FemProxy_ProcessFrame(fp)) < 0) {
+            break;
+        }
+        if ((err = FemArray_DispatchFrame(fa, i, was_pnd, no_longer_pnd_cnt, was_event_data)) < 0) {
+            break;
+        }
+        cnt++;
+
+        // Pass the frames of a FEM to the event builder before they exceed what can be collected
+        if (fp->buf_to_eb_cnt == MAX_RCV_BATCH) {
+            if ((err = Mutex_Unlock(fa->snd_mutex)) < 0) {
+                printf("FemArray_ReceiveLoop: Mutex_Unlock failed %d\n", err);
+                return (err);
+            }
+            if ((err = FemArray_EventBuilderIO(fa, i, i, 1 << i)) < 0) {
+                return (err);
+            }
+            if ((err = Mutex_Lock(fa->snd_mutex)) < 0) {
+                printf("FemArray_ReceiveLoop: Mutex_Lock failed %d\n", err);
+                return (err);
+            }
+        }
+    }
+
+    if (err >= 0) {
+        err = FemUring_Submit(fu);
+    }
+
+    fa->rcv_call_cnt++;
+    fa->rcv_dgram_cnt += cnt;
+
+    // Release the network mutex
+    if ((err2 = Mutex_Unlock(fa->snd_mutex)) < 0) {
+        printf("FemArray_ReceiveLoop: Mutex_Unlock failed %d\n", err2);
+        return (err2);
+    }
+    if (err < 0) {
+        return (err);
+    }
+
+    return (cnt);
+}
+
 /*******************************************************************************
  FemArray_ReceiveLoop
+
+ The sockets are watched in edge-triggered mode, so a socket reported ready
+ must be read until it is empty. To keep the number of buffers in flight
+ bounded and to be fair between FEMs, each ready FEM is read once per pass
+ (up to rcv_batch datagrams) and is kept in the set of ready FEMs until a read
+ finds its socket empty. While some FEM is ready, epoll is only polled.
+ Each receive thread runs this loop on its own subset of FEMs. In busy poll
+ mode epoll is not used: every socket is read on each pass.
 *******************************************************************************/
-int FemArray_ReceiveLoop(FemArray* fa) {
+int FemArray_ReceiveLoop(FemRcvThread* rt) {
+    FemArray* fa = (FemArray*) rt->fa;
+    EventBuilder* eb = (EventBuilder*) fa->eb;
     int err;
-    struct timeval t_timeout;
     unsigned int mask;
     unsigned int i;
-    int nsock;
-    int smax;
-    fd_set readfds, writefds, exceptfds, readfds_work;
+    int k;
+    int nev;
+    int cnt;
+    unsigned int rdy_set;
+    int ring_rdy;
+    uint64_t wake_cnt;
+    struct epoll_event events[MAX_NUMBER_OF_FEMINOS + 1];
     int no_longer_pnd_cnt;
-    int was_pnd;
     int signal_cmd;
     int was_event_data;
+    int idle_ms;
 
     // printf("FemArray_ReceiveLoop: started\n");
 
-    // Build the socket descriptor set from which we want to read
-    FD_ZERO(&readfds);
-    FD_ZERO(&writefds);
-    FD_ZERO(&exceptfds);
-    mask = 0x00000001;
-    nsock = 0;
-    smax = 0;
-    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
-        if (fa->fem_proxy_set & mask) {
-            FD_SET(fa->fp[i].client, &readfds);
-            if (fa->fp[i].client > smax) {
-                smax = fa->fp[i].client;
-            }
-            // printf("fa->fp[i].client=%d smax=%d\n", fa->fp[i].client, smax);
-            nsock++;
-        }
-        mask <<= 1;
+    // Without traffic, wake up the event builder often enough to detect lost credits and stalled events in time
+    idle_ms = 5000;
+    if ((fa->cred_timeout_ms > 0) && ((fa->cred_timeout_ms / 2) < idle_ms)) {
+        idle_ms = (fa->cred_timeout_ms / 2) + 1;
+    }
+    if ((eb->ev_timeout_ms > 0) && ((int) (eb->ev_timeout_ms / 2) < idle_ms)) {
+        idle_ms = (int) (eb->ev_timeout_ms / 2) + 1;
     }
-    smax++;
 
     // Main loop receiving frames over the network interface
     err = 0;
+    rdy_set = 0;
+    ring_rdy = 0;
     while (fa->state) {
-        t_timeout.tv_sec = 5;
-        t_timeout.tv_usec = 0;
+        if (fa->busy_poll) {
+            // Read all the sockets (or the ring) on every pass without waiting
+            nev = 0;
+            if (fa->rcv_backend != RCV_BACKEND_SOCKET) {
+                ring_rdy = 1;
+            } else if (fa->sock_fem >= 0) {
+                rdy_set = 1 << fa->sock_fem;
+            } else {
+                rdy_set = rt->fem_set;
+            }
+        }
+        // Wait for any of the sockets to be ready or for a wakeup. The event builder
+        // may be waiting a short time for fragments in time stamp mode
+        else if ((nev = epoll_wait(rt->epfd, &events[0], MAX_NUMBER_OF_FEMINOS + 1,
+                                   ((rdy_set || ring_rdy) ? 0 : (eb->ts_wait_ns ? (int) (eb->ts_wait_ms + 1) : idle_ms)))) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("FemArray_ReceiveLoop: epoll_wait failed: error %d\n", errno);
+            return (-1);
+        }
 
-        // Copy the read fds from what we computed outside the loop
-        readfds_work = readfds;
+        // Add the sockets that became ready to the set of ready FEMs
+        for (k = 0; k < nev; k++) {
+            i = events[k].data.u32;
+            if (i == MAX_NUMBER_OF_FEMINOS) {
+                // Wakeup from another thread: clear the event, the state is checked by the loop
+                if (read(rt->wake_fd, &wake_cnt, sizeof(wake_cnt)) < 0) {
+                    // The counter was already cleared
+                }
+            } else if (i == MAX_NUMBER_OF_FEMINOS + 1) {
+                ring_rdy = 1;
+            } else {
+                rdy_set |= (1 << i);
+            }
+        }
 
-        // Wait for any of these sockets to be ready
-        if ((err = select(smax, &readfds_work, &writefds, &exceptfds, &t_timeout)) < 0) {
-            printf("FemArray_ReceiveLoop: select failed %d\n", err);
-            return (err);
+        // On timeout, look at all sockets (or at the ring) in case an event was missed
+        if ((nev == 0) && (rdy_set == 0) && (ring_rdy == 0)) {
+            if (fa->rcv_backend != RCV_BACKEND_SOCKET) {
+                ring_rdy = 1;
+            } else if (fa->sock_fem >= 0) {
+                rdy_set = 1 << fa->sock_fem;
+            } else {
+                rdy_set = rt->fem_set;
+            }
         }
 
         no_longer_pnd_cnt = 0;
         was_event_data = 0;
 
-        if (err == 0) {
-            // printf("nothing received!\n");
-        } else {
-            // Get the network mutex
-            if ((err = Mutex_Lock(fa->snd_mutex)) < 0) {
-                printf("FemArray_ReceiveLoop: Mutex_Lock failed %d\n", err);
-                return (err);
-            }
-
-            // printf("received on %d sockets!\n", err);
-            mask = 0x00000001;
-            was_pnd = 0;
-            for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
-                if (fa->fem_proxy_set & mask) {
-                    if (FD_ISSET(fa->fp[i].client, &readfds_work)) {
-                        // printf("socket %d has pending data\n", err);
-                        //  See if there is a command pending reply for that fem
-                        was_pnd = fa->fp[i].is_cmd_pending;
-
-                        // Get a receive buffer for that FEM if we do not already have one
-                        if (fa->fp[i].buf_in == (unsigned char*) 0) {
-                            if ((err = BufPool_GiveBuffer(fa->bp, (void*) (&(fa->fp[i].buf_in)), AUTO_RETURNED)) < 0) {
-                                printf("FemArray_ReceiveLoop: BufPool_GiveBuffer failed\n", err);
-                                return (err);
-                            }
-                        }
-
-                        // Receive the frame for that fem
-                        if ((err = FemProxy_Receive(&fa->fp[i])) < 0) {
-                            return (err);
-                        }
-
-                        // If the response is pedestal or thresholds, save them to file on disk
-                        if (fa->is_list_fr_pnd) {
-                            if ((err = FemArray_SavePedThrList(fa, fa->fp[i].buf_to_bp)) < 0) {
-                                printf("FemArray_ReceiveLoop: FemArray_SavePedThrList failed\n", err);
-                                return (err);
-                            }
-                        }
-
-                        // Return this buffer to buffer manager if it is no longer used
-                        if (fa->fp[i].buf_to_bp) {
-                            BufPool_ReturnBuffer(fa->bp, (unsigned long) (fa->fp[i].buf_to_bp));
-                        }
-
-                        // Check if a command was pending and is no longer pending for that fem
-                        if ((was_pnd == 1) && (fa->fp[i].is_cmd_pending == 0)) {
-                            no_longer_pnd_cnt++;
-                        } else {
-                            if (!fa->fp[i].is_data_frame) {
-                                printf("FemArray_ReceiveLoop: received monitoring or configuration reply frame from FEM %d but no command was pending.\n",
-                                       i);
-                            }
-                        }
-                        was_event_data += fa->fp[i].is_data_frame;
-                        // printf("was_pnd = %d no_longer_pnd_cnt=%d\n", was_pnd, no_longer_pnd_cnt);
-                    }
+        mask = 0x00000001;
+        for (i = 0; (i < MAX_NUMBER_OF_FEMINOS) && rdy_set; i++) {
+            if (rdy_set & mask) {
+                if ((cnt = FemArray_ReceiveFem(fa, i, &no_longer_pnd_cnt, &was_event_data)) < 0) {
+                    return (cnt);
+                }
+                // The FEM stays ready until its socket is found empty
+                if (cnt == 0) {
+                    rdy_set &= ~mask;
                 }
-                mask <<= 1;
             }
+            mask <<= 1;
+        }
 
-            // Release the network mutex
-            if ((err = Mutex_Unlock(fa->snd_mutex)) < 0) {
-                printf("FemArray_ReceiveLoop: Mutex_Unlock failed %d\n", err);
-                return (err);
+        // The ring stays ready until no block (or no completion) is found
+        if (ring_rdy) {
+            if (fa->rcv_backend == RCV_BACKEND_URING) {
+                cnt = FemArray_ReceiveUring(fa, &no_longer_pnd_cnt, &was_event_data);
+            } else {
+                cnt = FemArray_ReceiveRing(fa, &no_longer_pnd_cnt, &was_event_data);
             }
+            if (cnt < 0) {
+                return (cnt);
+            }
+            ring_rdy = (cnt > 0);
         }
 
         signal_cmd = 0;
@@ -788,12 +2142,14 @@ int FemArray_ReceiveLoop(FemArray* fa) {
         }
 
         // Perform the required buffer IO with the event builder
-        if ((err = FemArray_EventBuilderIO(fa, 0, 31, fa->fem_proxy_set)) < 0) {
+        if ((err = FemArray_EventBuilderIO(fa, 0, 31, rt->fem_set)) < 0) {
             return (err);
         }
     }
 
-    printf("FemArray_ReceiveLoop: completed.\n");
+    BufPool_FlushCache((BufPool*) fa->bp);
+
+    printf("FemArray_ReceiveLoop: receive thread %d completed.\n", rt->id);
 
     return (err);
 }
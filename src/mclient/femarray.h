@@ -30,9 +30,51 @@
 
 #define MAX_NUMBER_OF_FEMINOS 32
 
-typedef struct _FemArray {
+#define MAX_RCV_THREADS 8
+
+// Adaptive credit window
+#define CREDIT_ADAPT_PERIOD_NS 10000000ULL // minimum time between two updates of the credit window of a FEM
+#define CREDIT_PRESSURE_FILL 0.5           // storage queue fill level above which the credit windows shrink
+#define CREDIT_TIMEOUT_MS 1000             // default time without data after which pending credits are presumed lost
+
+#define FEMARRAY_MONITOR_MS 1000 // period of the checks of the kernel drops, receive buffers and metrics
+
+#define DAQ_CMD_SIZE 40 // room for a data request command
+
+// Receive backends
+#define RCV_BACKEND_SOCKET 0 // one UDP socket per FEM
+#define RCV_BACKEND_PACKET 1 // memory mapped AF_PACKET ring shared by all FEMs (see femring.h)
+#define RCV_BACKEND_URING 2  // io_uring multishot receive on the FEM sockets (see femuring.h)
+
+// A receive thread services the sockets of a subset of the FEMs
+typedef struct _FemRcvThread {
     int id;
     ThreadStruct thread;
+
+    void* fa;             // pointer to FEM Array
+    unsigned int fem_set; // pattern of the FEMs serviced by this thread
+    int cpu;              // CPU core the thread is pinned to (-1: not pinned)
+
+    int epfd;    // epoll instance watching the sockets of the FEMs of this thread
+    int wake_fd; // eventfd used to wake up this thread
+} FemRcvThread;
+
+// Data acquisition actions of FemArray_Daq()
+typedef enum _FemDaqAction {
+    FEMDAQ_STATUS,    // print the DAQ status
+    FEMDAQ_STOP,      // stop the acquisition
+    FEMDAQ_START,     // acquire for ever
+    FEMDAQ_SET_SIZE,  // acquire the amount of data given by size
+    FEMDAQ_REPLENISH, // pursue the on-going acquisition: send requests to the FEMs that have credits
+} FemDaqAction;
+
+typedef struct _FemDaqCmd {
+    FemDaqAction action;
+    __int64 size; // amount of data to acquire (FEMDAQ_SET_SIZE)
+} FemDaqCmd;
+
+typedef struct _FemArray {
+    int id;
     int state;
 
     int rem_ip_beg[4];
@@ -61,12 +103,50 @@ typedef struct _FemArray {
 
     int req_threshold; // Minimum number of credits to send a new request
     char cred_unit;    // Credit units, B: Bytes  F: Frames
+    int cred_adapt;    // set to 1 to size the credit window of each FEM from its round trip time and the consumers
+    int cred_timeout_ms; // time without data after which the pending credits of a FEM are re-granted (0: never)
 
     int drop_a_credit;  // flag set to 1 to inject a fault by dropping a credit frame
     int delay_a_credit; // Set to non zero to delay a credit frame by the amount specified
 
-    void* bp; // Pointer to Buffer Pool
-    void* eb; // Pointer to Event Builder
+    char snd_cmd[MAX_NUMBER_OF_FEMINOS][DAQ_CMD_SIZE]; // data request of each FEM, preformatted "daq 0x000000 B 0x00\n"
+    struct mmsghdr snd_msg[MAX_NUMBER_OF_FEMINOS];     // data requests gathered during one pass, sent with sendmmsg
+    struct iovec snd_iov[MAX_NUMBER_OF_FEMINOS];       // one vector per data request
+    int snd_fem[MAX_NUMBER_OF_FEMINOS];                // FEM of each data request gathered
+    int snd_nb;                                        // number of data requests gathered
+    unsigned long long snd_call_cnt;                   // number of calls made to send data requests
+    unsigned long long snd_req_cnt;                    // number of data requests sent
+    unsigned long long snd_call_lst;                   // number of send calls at the time of the last status
+    unsigned long long snd_req_lst;                    // number of data requests at the time of the last status
+
+    int rcv_batch;                    // maximum number of datagrams read per socket and per wakeup (1: one recvfrom per wakeup)
+    unsigned long long rcv_call_cnt;  // number of calls made to receive datagrams
+    unsigned long long rcv_dgram_cnt; // number of datagrams received
+    unsigned long long rcv_call_lst;  // number of receive calls at the time of the last status
+    unsigned long long rcv_dgram_lst; // number of datagrams at the time of the last status
+
+    unsigned long long pool_give_lst; // number of buffers given by the pool caches at the time of the last status
+    unsigned long long pool_hit_lst;  // number of buffers given from a pool cache at the time of the last status
+    unsigned long long pool_fail_lst; // number of failed buffer requests at the time of the last status
+    int pool_low;                     // lowest number of free buffers seen since the last status (-1: not checked)
+    unsigned long long ring_drop_lst; // packets dropped by the kernel from the ring at the time of the last status
+    unsigned long long mon_ts_lst;    // time (ns) of the last run of FemArray_Monitor()
+
+    int rcvbuf_auto; // set to 1 to enlarge the receive buffer of the sockets that drop datagrams
+    int single_sock; // set to 1 to receive the datagrams of all FEMs on a single socket
+    int sock_fem;    // FEM that owns the socket shared by all FEMs in single socket mode (-1: one socket per FEM)
+
+    int busy_poll;      // 1: the receive threads spin on the sockets instead of waiting for events
+    int busy_poll_usec; // SO_BUSY_POLL time set on the sockets in busy poll mode (0: not set)
+
+    int rcv_backend;                       // RCV_BACKEND_SOCKET, RCV_BACKEND_PACKET or RCV_BACKEND_URING
+    int rcv_thread_nb;                     // number of receive threads the FEMs are distributed to
+    FemRcvThread rcv_thr[MAX_RCV_THREADS]; // receive threads
+
+    void* bp;    // Pointer to Buffer Pool
+    void* ring;  // Pointer to packet ring (packet receive backend)
+    void* uring; // Pointer to io_uring (uring receive backend)
+    void* eb;    // Pointer to Event Builder
 
     FILE* pedthr; // Pointer to File for storing pedestal or thresholds
 
@@ -79,7 +159,14 @@ void FemArray_Clear(FemArray* fa);
 int FemArray_Open(FemArray* fa);
 void FemArray_Close(FemArray* fa);
 int FemArray_SendCommand(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, unsigned int fem_pat, char* cmd);
+int FemArray_Daq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, unsigned int fem_pat, const FemDaqCmd* dc);
 int FemArray_SendDaq(FemArray* fa, unsigned int fem_beg, unsigned int fem_end, unsigned int fem_pat, char* cmd);
-int FemArray_ReceiveLoop(FemArray* fa);
+int FemArray_ReceiveLoop(FemRcvThread* rt);
+int FemArray_StartReceive(FemArray* fa);
+void FemArray_JoinReceive(FemArray* fa);
+int FemArray_Wakeup(FemArray* fa);
+int FemArray_CanHoldBuffer(FemArray* fa, const void* buf);
+void FemArray_HoldBuffer(FemArray* fa, void* buf);
+void FemArray_ReleaseBuffer(FemArray* fa, void* buf);
 
 #endif
@@ -21,6 +21,29 @@
   and the pointer to the frame skips the first two bytes which is set to the
   size of the UDP datagram received.
 
+  Added FemProxy_ReceiveBatch() to collect several datagrams with a single
+  call to recvmmsg().
+
+  Enabled SO_RXQ_OVFL on the socket: the count of datagrams dropped by the
+  kernel is read from the ancillary data of the datagrams received. Added
+  FemProxy_SetRcvBufSize() to change the receive buffer size while running.
+
+  Added FemProxy_OpenShared() for the single socket mode where the proxies of
+  all FEMs use the socket of the first one. The source address of each
+  datagram received in batched mode is kept to find the FEM it comes from.
+
+  Enabled SO_TIMESTAMPNS on the socket: the time each datagram arrived is kept
+  to measure the latency of the event builder. Added FemProxy_SetBusyPoll().
+
+  Removed FemProxy_Receive(): it was not used any more and read up to 8192
+  bytes whatever the size of the pool buffers.
+
+  The receive functions retry after a transient socket error (e.g. ICMP port
+  unreachable) and only report the other errors, which are printed.
+
+  Datagrams truncated because they did not fit in a receive buffer are
+  dropped and counted (trunc_cnt) instead of being passed on.
+
 *******************************************************************************/
 
 #include "femproxy.h"
@@ -41,6 +64,18 @@ void FemProxy_Clear(FemProxy* fem) {
     fem->target_adr = (unsigned char*) 0;
     fem->req_credit = MAX_REQ_CREDIT_BYTES;
     fem->pnd_recv = 0;
+    fem->cred_win = MAX_REQ_CREDIT_BYTES;
+    fem->cred_rcv = 0;
+    fem->cred_rcv_lst = 0;
+    fem->cred_ts_lst = 0;
+    fem->rtt_mark = 0;
+    fem->rtt_req_ts = 0;
+    fem->rtt_ns = 0;
+    fem->cred_chk = 0;
+    fem->cred_chk_ts = 0;
+    fem->cred_stalled = 0;
+    fem->regrant_cnt = 0;
+    fem->regrant_lst = 0;
     fem->is_first_req = 1;
     fem->last_ack_sent = 1;
 
@@ -58,9 +93,30 @@ void FemProxy_Clear(FemProxy* fem) {
     fem->daq_reply_cnt = 0;
     fem->cmd_failed = 0;
 
+    fem->sock_shared = 0;
+
     fem->buf_in = (unsigned char*) 0;
     fem->buf_to_bp = (unsigned char*) 0;
     fem->buf_to_eb = (unsigned char*) 0;
+
+    for (int i = 0; i < MAX_RCV_BATCH; i++) {
+        fem->buf_in_v[i] = (unsigned char*) 0;
+        fem->buf_to_eb_v[i] = (unsigned char*) 0;
+    }
+    fem->buf_to_eb_cnt = 0;
+    for (int i = 0; i < MAX_RCV_BATCH; i++) {
+        fem->buf_to_eb_ts[i] = 0;
+        fem->rcv_ts_v[i] = 0;
+    }
+    fem->rcv_ts = 0;
+
+    fem->rcv_buf_sz = 0;
+    fem->rxq_ovfl = 0;
+    fem->rxq_ovfl_lst = 0;
+    fem->rxq_ovfl_chk = 0;
+    fem->rcv_err_cnt = 0;
+    fem->trunc_cnt = 0;
+    fem->trunc_lst = 0;
 }
 
 /*******************************************************************************
@@ -76,6 +132,23 @@ void FemProxy_MsgStatClear(FemProxy* fem) {
     fem->daq_reply_dupl_cnt = 0;
 }
 
+/*******************************************************************************
+ FemProxy_SetTarget()
+*******************************************************************************/
+static void FemProxy_SetTarget(FemProxy* fem, int* rem_ip_base, int ix, int rpt) {
+    fem->rem_port = rpt;
+    fem->target.sin_family = PF_INET;
+    fem->target.sin_port = htons((unsigned short) fem->rem_port);
+    fem->target_adr = (unsigned char*) &(fem->target.sin_addr.s_addr);
+    fem->target_adr[0] = *(rem_ip_base + 0);
+    fem->target_adr[1] = *(rem_ip_base + 1);
+    fem->target_adr[2] = *(rem_ip_base + 2);
+    fem->target_adr[3] = *(rem_ip_base + 3) + ix;
+    fem->remote_size = sizeof(fem->remote);
+
+    fem->fem_id = ix;
+}
+
 /*******************************************************************************
  FemProxy_Open()
 *******************************************************************************/
@@ -119,7 +192,22 @@ int FemProxy_Open(FemProxy* fem, int* loc_ip, int* rem_ip_base, int ix, int rpt)
 
     // Check receive socket size
     if (rcvsz_done < rcvsz_req) {
-        printf("FemProxy_Open(%d): Warning: recv buffer size set to %d bytes while %d bytes were requested. Data losses may occur\n", rcvsz_done, rcvsz_req);
+        printf("FemProxy_Open(%d): Warning: recv buffer size set to %d bytes while %d bytes were requested. Data losses may occur\n", ix, rcvsz_done, rcvsz_req);
+    }
+    fem->rcv_buf_sz = rcvsz_done;
+
+    // Ask the kernel to report the number of datagrams it dropped on this socket
+    nb = 1;
+    if ((err = setsockopt(fem->client, SOL_SOCKET, SO_RXQ_OVFL, (char*) &nb, sizeof(nb))) != 0) {
+        err = socket_get_error();
+        printf("FemProxy_Open(%d): Warning: setsockopt SO_RXQ_OVFL failed: error %d. Kernel drops will not be reported\n", ix, err);
+    }
+
+    // Ask the kernel for the time each datagram arrived
+    nb = 1;
+    if ((err = setsockopt(fem->client, SOL_SOCKET, SO_TIMESTAMPNS, (char*) &nb, sizeof(nb))) != 0) {
+        err = socket_get_error();
+        printf("FemProxy_Open(%d): Warning: setsockopt SO_TIMESTAMPNS failed: error %d. Latency will not be measured\n", ix, err);
     }
 
     // Bind the socket to the local IP address
@@ -137,17 +225,24 @@ int FemProxy_Open(FemProxy* fem, int* loc_ip, int* rem_ip_base, int ix, int rpt)
     }
 
     // Init target address
-    fem->rem_port = rpt;
-    fem->target.sin_family = PF_INET;
-    fem->target.sin_port = htons((unsigned short) fem->rem_port);
-    fem->target_adr = (unsigned char*) &(fem->target.sin_addr.s_addr);
-    fem->target_adr[0] = *(rem_ip_base + 0);
-    fem->target_adr[1] = *(rem_ip_base + 1);
-    fem->target_adr[2] = *(rem_ip_base + 2);
-    fem->target_adr[3] = *(rem_ip_base + 3) + ix;
-    fem->remote_size = sizeof(fem->remote);
+    FemProxy_SetTarget(fem, rem_ip_base, ix, rpt);
 
-    fem->fem_id = ix;
+    return (0);
+}
+
+/*******************************************************************************
+ FemProxy_OpenShared()
+
+ Opens a proxy that sends its commands and gets its replies through the socket
+ already opened by another proxy. The datagrams received on that socket are
+ dispatched to the proxy of the FEM they come from by the caller.
+*******************************************************************************/
+int FemProxy_OpenShared(FemProxy* fem, FemProxy* owner, int* rem_ip_base, int ix, int rpt) {
+    fem->client = owner->client;
+    fem->sock_shared = 1;
+
+    // Init target address
+    FemProxy_SetTarget(fem, rem_ip_base, ix, rpt);
 
     return (0);
 }
@@ -156,6 +251,11 @@ int FemProxy_Open(FemProxy* fem, int* loc_ip, int* rem_ip_base, int ix, int rpt)
  FemProxy_Close()
 *******************************************************************************/
 void FemProxy_Close(FemProxy* fem) {
+    // A shared socket is closed by its owner
+    if (fem->sock_shared) {
+        fem->client = 0;
+        fem->sock_shared = 0;
+    }
     if (fem->client) {
         closesocket(fem->client);
         fem->client = 0;
@@ -249,22 +349,236 @@ int FemProxy_ProcessFrame(FemProxy* fem) {
 }
 
 /*******************************************************************************
- FemProxy_Receive()
+ FemProxy_ParseCtrl()
+
+ Reads the ancillary data of the datagram received in buffer k: updates the
+ count of datagrams dropped by the kernel and gets the arrival time of the
+ datagram. The kernel only attaches the count of drops once drops have
+ occurred; it is cumulative since the socket was opened.
+*******************************************************************************/
+static void FemProxy_ParseCtrl(FemProxy* fem, struct msghdr* mh, int k) {
+    struct cmsghdr* cm;
+    unsigned int drops;
+    struct timespec ts;
+
+    fem->rcv_ts_v[k] = 0;
+    for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET) {
+            continue;
+        }
+        if (cm->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&drops, CMSG_DATA(cm), sizeof(drops));
+            if (drops > fem->rxq_ovfl) {
+                fem->rxq_ovfl = drops;
+            }
+        } else if (cm->cmsg_type == SCM_TIMESTAMPNS) {
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            fem->rcv_ts_v[k] = (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        }
+    }
+}
+
+/*******************************************************************************
+ FemProxy_IsTransientError()
+
+ Tells if a receive error does not concern the socket itself: an error sent
+ back by ICMP for an earlier datagram (e.g. port unreachable after a command
+ was sent to a FEM that is down) or a signal. The kernel reports such an
+ error once and the datagrams pending are still there.
+*******************************************************************************/
+static int FemProxy_IsTransientError(int err) {
+    switch (err) {
+        case EINTR:
+        case ECONNREFUSED:
+        case EHOSTUNREACH:
+        case EHOSTDOWN:
+        case ENETUNREACH:
+            return (1);
+        default:
+            return (0);
+    }
+}
+
+/*******************************************************************************
+ FemProxy_Truncated()
+
+ Counts a datagram that did not fit in a receive buffer of buf_sz bytes and
+ warns the first time it happens for this fem. The datagram is dropped: its
+ buffer is not passed on and is used again for the next datagram.
+*******************************************************************************/
+static void FemProxy_Truncated(FemProxy* fem, int buf_sz) {
+    if (fem->trunc_cnt == 0) {
+        printf("FemProxy(%d): Warning: datagram larger than the %d byte receive buffers dropped. Increase --pool-buffer-size\n", fem->fem_id, buf_sz);
+    }
+    fem->trunc_cnt++;
+}
+
+/*******************************************************************************
+ FemProxy_ReceiveFrame()
+
+ Reads one datagram pending on the socket of this fem into buf_in without
+ processing it. buf_sz is the size of buf_in. Transient errors are counted and
+ the read is tried again, as are truncated datagrams which are dropped.
+ Returns 1 if a datagram was received, 0 if none was pending, or -1 on a
+ socket error.
 *******************************************************************************/
-int FemProxy_Receive(FemProxy* fem) {
+int FemProxy_ReceiveFrame(FemProxy* fem, int buf_sz) {
     int length;
     int err;
+    struct msghdr mh;
+    struct iovec iov;
+
+    iov.iov_base = fem->buf_in;
+    iov.iov_len = buf_sz;
+    mh.msg_name = (void*) &(fem->remote);
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+
+    do {
+        mh.msg_namelen = sizeof(fem->remote);
+        mh.msg_control = (void*) &(fem->rcv_ctrl[0][0]);
+        mh.msg_controllen = sizeof(fem->rcv_ctrl[0]);
+        mh.msg_flags = 0;
+        if ((length = recvmsg(fem->client, &mh, 0)) < 0) {
+            err = socket_get_error();
+            if ((err == EAGAIN) || (err == EWOULDBLOCK)) {
+                return (0);
+            }
+            if (!FemProxy_IsTransientError(err)) {
+                printf("FemProxy_ReceiveFrame(%d): recvmsg failed: error %d\n", fem->fem_id, err);
+                return (-1);
+            }
+            fem->rcv_err_cnt++;
+        } else if (mh.msg_flags & MSG_TRUNC) {
+            // Still read the count of kernel drops it carries
+            FemProxy_ParseCtrl(fem, &mh, 0);
+            FemProxy_Truncated(fem, buf_sz);
+            length = -1;
+        }
+    } while (length < 0);
+
+    fem->buf_in_len = (unsigned short) length;
+    FemProxy_ParseCtrl(fem, &mh, 0);
+    return (1);
+}
 
-    err = 0;
+/*******************************************************************************
+ FemProxy_ReceiveBatch()
+
+ Reads up to nb datagrams pending on the socket of this fem into the buffers
+ buf_in_v[0..nb-1] which must all have been allocated by the caller. Transient
+ errors are counted and the read is tried again. Truncated datagrams are
+ dropped: the others are moved down so that the datagrams kept are in
+ buf_in_v[0..cnt-1]. Returns the number of datagrams received (0 if none was
+ pending) or a negative value on error. The datagrams are not processed here:
+ the caller passes each of them to FemProxy_ProcessFrame().
+*******************************************************************************/
+int FemProxy_ReceiveBatch(FemProxy* fem, int nb, int buf_sz) {
+    int i;
+    int j;
+    int cnt;
+    int err;
+    unsigned char* buf;
+
+    do {
+        for (i = 0; i < nb; i++) {
+            fem->rcv_iov[i].iov_base = fem->buf_in_v[i];
+            fem->rcv_iov[i].iov_len = buf_sz;
+            fem->rcv_msg[i].msg_hdr.msg_name = (void*) &(fem->rcv_src[i]);
+            fem->rcv_msg[i].msg_hdr.msg_namelen = sizeof(fem->rcv_src[i]);
+            fem->rcv_msg[i].msg_hdr.msg_iov = &(fem->rcv_iov[i]);
+            fem->rcv_msg[i].msg_hdr.msg_iovlen = 1;
+            fem->rcv_msg[i].msg_hdr.msg_control = (void*) &(fem->rcv_ctrl[i][0]);
+            fem->rcv_msg[i].msg_hdr.msg_controllen = sizeof(fem->rcv_ctrl[i]);
+            fem->rcv_msg[i].msg_hdr.msg_flags = 0;
+            fem->rcv_msg[i].msg_len = 0;
+        }
+
+        if ((cnt = recvmmsg(fem->client, &(fem->rcv_msg[0]), nb, MSG_DONTWAIT, (struct timespec*) 0)) < 0) {
+            err = socket_get_error();
+            if ((err == EAGAIN) || (err == EWOULDBLOCK)) {
+                return (0);
+            }
+            if (!FemProxy_IsTransientError(err)) {
+                printf("FemProxy_ReceiveBatch(%d): recvmmsg failed: error %d\n", fem->fem_id, err);
+                return (-1);
+            }
+            fem->rcv_err_cnt++;
+            continue;
+        }
 
-    // Read data pending from the socket of this fem
-    length = recvfrom(fem->client, fem->buf_in, 8192, 0, (struct sockaddr*) &(fem->remote), &(fem->remote_size));
-    if (length < 0) {
+        j = 0;
+        for (i = 0; i < cnt; i++) {
+            FemProxy_ParseCtrl(fem, &(fem->rcv_msg[i].msg_hdr), j);
+            if (fem->rcv_msg[i].msg_hdr.msg_flags & MSG_TRUNC) {
+                FemProxy_Truncated(fem, buf_sz);
+                continue;
+            }
+            // Swap the buffers so that the one of the datagram dropped is used again
+            if (j != i) {
+                buf = fem->buf_in_v[j];
+                fem->buf_in_v[j] = fem->buf_in_v[i];
+                fem->buf_in_v[i] = buf;
+                fem->rcv_msg[j].msg_len = fem->rcv_msg[i].msg_len;
+                fem->rcv_src[j] = fem->rcv_src[i];
+            }
+            j++;
+        }
+
+        // A batch of truncated datagrams only does not mean that the socket is empty
+        if ((cnt > 0) && (j == 0)) {
+            cnt = -1;
+        } else {
+            cnt = j;
+        }
+    } while (cnt < 0);
+
+    return (cnt);
+}
+
+/*******************************************************************************
+ FemProxy_SetRcvBufSize()
+
+ Changes the size of the socket receive buffer. SO_RCVBUFFORCE is tried first
+ to go beyond the system limit (net.core.rmem_max) when the process has the
+ CAP_NET_ADMIN capability. Returns the size granted by the kernel or a
+ negative value on error.
+*******************************************************************************/
+int FemProxy_SetRcvBufSize(FemProxy* fem, int size) {
+    int done;
+    int err;
+    socklen_t optlen = sizeof(int);
+
+    if (setsockopt(fem->client, SOL_SOCKET, SO_RCVBUFFORCE, (char*) &size, sizeof(size)) != 0) {
+        if (setsockopt(fem->client, SOL_SOCKET, SO_RCVBUF, (char*) &size, sizeof(size)) != 0) {
+            err = socket_get_error();
+            printf("FemProxy_SetRcvBufSize(%d): setsockopt failed: error %d\n", fem->fem_id, err);
+            return (-1);
+        }
+    }
+    if (getsockopt(fem->client, SOL_SOCKET, SO_RCVBUF, (char*) &done, &optlen) != 0) {
         err = socket_get_error();
-        return (err);
-    } else {
-        fem->buf_in_len = (unsigned short) length;
-        err = FemProxy_ProcessFrame(fem);
+        printf("FemProxy_SetRcvBufSize(%d): getsockopt failed: error %d\n", fem->fem_id, err);
+        return (-1);
+    }
+    fem->rcv_buf_sz = done;
+    return (done);
+}
+
+/*******************************************************************************
+ FemProxy_SetBusyPoll()
+
+ Sets the time in microseconds the kernel may busy poll the network device
+ for datagrams when the socket is read and its receive queue is empty
+ (SO_BUSY_POLL). Values above net.core.busy_read need CAP_NET_ADMIN.
+*******************************************************************************/
+int FemProxy_SetBusyPoll(FemProxy* fem, int usec) {
+    int err;
+
+    if (setsockopt(fem->client, SOL_SOCKET, SO_BUSY_POLL, (char*) &usec, sizeof(usec)) != 0) {
+        err = socket_get_error();
+        printf("FemProxy_SetBusyPoll(%d): setsockopt failed: error %d\n", fem->fem_id, err);
+        return (-1);
     }
-    return (err);
+    return (0);
 }
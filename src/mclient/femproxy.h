@@ -23,12 +23,19 @@
  Constants, types and global variables
 *******************************************************************************/
 #define SOCK_REV_SIZE 200 * 1024
+#define SOCK_REV_SIZE_MAX 64 * 1024 * 1024 // limit for the automatic adjustment of the receive buffer size
 #define MAX_REQ_CREDIT_BYTES 16 * 1024
 #define CREDIT_THRESHOLD_FOR_REQ 8 * 1024
+#define MAX_CREDIT_WINDOW_BYTES 1024 * 1024 // upper limit of the adaptive credit window
+#define MAX_RCV_BATCH 64 // maximum number of datagrams collected with one call to recvmmsg
+
+// Room for the ancillary data of a datagram: count of kernel drops and arrival time
+#define RCV_CTRL_SIZE (CMSG_SPACE(sizeof(unsigned int)) + CMSG_SPACE(sizeof(struct timespec)))
 
 typedef struct _FemProxy {
     int fem_id;
     int client;
+    int sock_shared; // the socket belongs to the proxy of another FEM (single socket mode)
     struct sockaddr_in target;
     unsigned char* target_adr;
 
@@ -38,6 +45,7 @@ typedef struct _FemProxy {
 
     int req_credit;     // amount of bytes that can be requested at this time
     int pnd_recv;       // requested bytes pending receive
+    int cred_win;       // credit window: req_credit + pnd_recv when all credits are accounted for
     int is_first_req;   // Will the next data request be the first one
     int last_ack_sent;  // Was the last daq command to finish acquisition sent
     int cmd_posted_cnt; // number of command posted
@@ -51,6 +59,19 @@ typedef struct _FemProxy {
     int daq_reply_dupl_cnt; // number of daq replies duplicated
     int cmd_failed;         // number of command that failed
 
+    unsigned long long cred_rcv;     // credits consumed by the data frames received (bytes or frames)
+    unsigned long long cred_rcv_lst; // credits consumed at the last update of the credit window
+    unsigned long long cred_ts_lst;  // time (ns) of the last update of the credit window
+    unsigned long long rtt_mark;     // value of cred_rcv after which data answers the request being timed
+    unsigned long long rtt_req_ts;   // time (ns) the request being timed was sent (0: none)
+    unsigned long long rtt_ns;       // smoothed time from a data request to its first data frame (0: unknown)
+
+    unsigned long long cred_chk;    // value of cred_rcv when the FEM was last seen sending data
+    unsigned long long cred_chk_ts; // time (ns) the FEM was last seen sending data or having nothing pending
+    int cred_stalled;               // credits were re-granted and no data came since
+    unsigned int regrant_cnt;       // number of times the pending credits were presumed lost and re-granted
+    unsigned int regrant_lst;       // value of regrant_cnt at the last status
+
     unsigned char req_seq_nb; // sequence number of the next daq request
     unsigned char exp_rep_nb; // expected sequence number of the daq next response
 
@@ -58,6 +79,26 @@ typedef struct _FemProxy {
     unsigned short buf_in_len; // buffer in length
     unsigned char* buf_to_bp;  // buffer to return to buffer pool
     unsigned char* buf_to_eb;  // buffer to be passed to event builder
+
+    unsigned char* buf_in_v[MAX_RCV_BATCH];    // buffers to receive data in batched mode
+    struct mmsghdr rcv_msg[MAX_RCV_BATCH];     // message headers for recvmmsg
+    struct iovec rcv_iov[MAX_RCV_BATCH];       // one vector per receive buffer
+    struct sockaddr_in rcv_src[MAX_RCV_BATCH]; // source address of each datagram received in batched mode
+    unsigned char* buf_to_eb_v[MAX_RCV_BATCH];     // buffers collected for the event builder since the last hand over
+    unsigned long long buf_to_eb_ts[MAX_RCV_BATCH]; // arrival time of each buffer in buf_to_eb_v
+    int buf_to_eb_cnt;                              // number of buffers in buf_to_eb_v
+
+    unsigned long long rcv_ts_v[MAX_RCV_BATCH]; // arrival time (ns) given by the kernel for each datagram received (0: unknown)
+    unsigned long long rcv_ts;                  // arrival time of the frame being processed
+
+    char rcv_ctrl[MAX_RCV_BATCH][RCV_CTRL_SIZE]; // ancillary data of each received datagram
+    int rcv_buf_sz;                              // size of the socket receive buffer granted by the kernel
+    unsigned int rxq_ovfl;                       // datagrams dropped by the kernel on this socket (SO_RXQ_OVFL)
+    unsigned int rxq_ovfl_lst;                   // datagrams dropped by the kernel at the last status
+    unsigned int rxq_ovfl_chk;                   // datagrams dropped by the kernel at the last check of the receive buffer
+    unsigned int rcv_err_cnt;                    // transient errors reported by the socket (e.g. ICMP port unreachable)
+    unsigned int trunc_cnt;                      // datagrams dropped because they did not fit in a receive buffer
+    unsigned int trunc_lst;                      // datagrams truncated at the last status
 } FemProxy;
 
 /*******************************************************************************
@@ -65,8 +106,13 @@ typedef struct _FemProxy {
 *******************************************************************************/
 void FemProxy_Clear(FemProxy* fem);
 int FemProxy_Open(FemProxy* fem, int* loc_ip, int* rem_ip_base, int ix, int rpt);
+int FemProxy_OpenShared(FemProxy* fem, FemProxy* owner, int* rem_ip_base, int ix, int rpt);
 void FemProxy_Close(FemProxy* fem);
-int FemProxy_Receive(FemProxy* fem);
+int FemProxy_ReceiveFrame(FemProxy* fem, int buf_sz);
+int FemProxy_ReceiveBatch(FemProxy* fem, int nb, int buf_sz);
+int FemProxy_ProcessFrame(FemProxy* fem);
+int FemProxy_SetRcvBufSize(FemProxy* fem, int size);
+int FemProxy_SetBusyPoll(FemProxy* fem, int usec);
 void FemProxy_MsgStatClear(FemProxy* fem);
 
 #endif
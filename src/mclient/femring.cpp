@@ -0,0 +1,419 @@
+/*******************************************************************************
+
+ File:        femring.cpp
+
+ Description: Implementation of the packet ring receive backend.
+
+ The datagrams sent by the Feminos cards are captured by an AF_PACKET socket
+ in a memory mapped TPACKET_V3 ring. A BPF filter only lets IPv4 UDP datagrams
+ sent from the FEM port into the ring, and the UDP sockets of the FEMs (still
+ used to send commands) get a filter that drops everything they would
+ receive, so that datagrams are not queued twice.
+
+ The payload of each datagram is handed to the event builder in place: like in
+ the socket path, its first short word is overwritten with the size of the
+ datagram. A ring block is given back to the kernel when it has been read and
+ all the frames it contains have been released by FemRing_ReleaseFrame(),
+ which is called when the event builder recycles its buffers.
+
+ Datagrams must not be fragmented: the network interface must use an MTU large
+ enough for the frames sent by the FEMs (jumbo frames). The filter drops the
+ fragments that do not carry the UDP header in the kernel and lets the first
+ fragment of each datagram in the ring, where FemRing_NextFrame() drops it,
+ counts it and warns about the MTU.
+
+
+ History:
+   Created as an alternative to the UDP socket receive path of FemArray
+
+*******************************************************************************/
+
+#include "femring.h"
+
+#include <cstdio>
+#include <ifaddrs.h>
+#include <linux/filter.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <sys/mman.h>
+
+/*******************************************************************************
+ FemRing_Clear
+*******************************************************************************/
+void FemRing_Clear(FemRing* fr) {
+    int i;
+
+    fr->sock = -1;
+    fr->map = (unsigned char*) 0;
+    fr->map_sz = 0;
+    fr->rd = 0;
+    fr->seq = 1; // the kernel numbers blocks from 1
+    fr->cur_pkt = (unsigned char*) 0;
+    fr->cur_left = 0;
+    for (i = 0; i < FEMRING_BLOCK_NB; i++) {
+        fr->blk_ref[i] = 0;
+    }
+    fr->fem_set = 0;
+    fr->src_ip_net[0] = 0;
+    fr->src_ip_net[1] = 0;
+    fr->src_ip_net[2] = 0;
+    fr->src_ip_beg = 0;
+    fr->src_port = 0;
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        fr->loc_port[i] = 0;
+    }
+    fr->skipped_cnt = 0;
+    fr->frag_cnt = 0;
+    fr->drop_cnt = 0;
+}
+
+/*******************************************************************************
+ FemRing_GetIfIndex
+
+ Returns the index of the network interface which has the local IP address
+ specified, 0 (i.e. all interfaces) if the address is 0.0.0.0, or -1 if no
+ interface has that address.
+*******************************************************************************/
+static int FemRing_GetIfIndex(int* loc_ip) {
+    struct ifaddrs* ifa_list;
+    struct ifaddrs* ifa;
+    unsigned char* a;
+    int ix = -1;
+
+    if ((*(loc_ip + 0) == 0) && (*(loc_ip + 1) == 0) && (*(loc_ip + 2) == 0) && (*(loc_ip + 3) == 0)) {
+        return (0);
+    }
+
+    if (getifaddrs(&ifa_list) != 0) {
+        printf("FemRing_GetIfIndex: getifaddrs failed: error %d\n", errno);
+        return (-1);
+    }
+    for (ifa = ifa_list; ifa; ifa = ifa->ifa_next) {
+        if ((ifa->ifa_addr == (struct sockaddr*) 0) || (ifa->ifa_addr->sa_family != AF_INET)) {
+            continue;
+        }
+        a = (unsigned char*) &(((struct sockaddr_in*) ifa->ifa_addr)->sin_addr.s_addr);
+        if ((a[0] == *(loc_ip + 0)) && (a[1] == *(loc_ip + 1)) && (a[2] == *(loc_ip + 2)) && (a[3] == *(loc_ip + 3))) {
+            ix = if_nametoindex(ifa->ifa_name);
+            break;
+        }
+    }
+    freeifaddrs(ifa_list);
+
+    return (ix);
+}
+
+/*******************************************************************************
+ FemRing_Open
+*******************************************************************************/
+int FemRing_Open(FemRing* fr, FemArray* fa) {
+    int i;
+    unsigned int mask;
+    int ver;
+    int ifindex;
+    struct tpacket_req3 req;
+    struct sockaddr_ll sll;
+    struct sockaddr_in loc;
+    socklen_t loc_len;
+    struct sock_fprog prog;
+
+    // Accept IPv4 UDP datagrams which come from the FEM port. Only the first fragment of a fragmented datagram has
+    // the UDP header: it is accepted so that fragmentation is detected, the other fragments are dropped
+    struct sock_filter fem_code[] = {
+            BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),                          // Ethernet type
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETH_P_IP, 0, 8),             //   IPv4 ?
+            BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 23),                          // IP protocol
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 6),          //   UDP ?
+            BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 20),                          // IP flags and fragment offset
+            BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x1FFF, 4, 0),              //   fragment other than the first ?
+            BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 14),                         // IP header length
+            BPF_STMT(BPF_LD | BPF_H | BPF_IND, 14),                          // UDP source port
+            BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (unsigned int) fa->rem_port, 0, 1), // FEM port ?
+            BPF_STMT(BPF_RET | BPF_K, 0x40000),                              // accept
+            BPF_STMT(BPF_RET | BPF_K, 0),                                    // drop
+    };
+
+    // Drop everything: used on the UDP sockets of the FEMs
+    struct sock_filter drop_code[] = {
+            BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+
+    // Remember how to recognize the datagrams of each FEM
+    fr->fem_set = fa->fem_proxy_set;
+    fr->src_ip_net[0] = (unsigned char) fa->rem_ip_beg[0];
+    fr->src_ip_net[1] = (unsigned char) fa->rem_ip_beg[1];
+    fr->src_ip_net[2] = (unsigned char) fa->rem_ip_beg[2];
+    fr->src_ip_beg = (unsigned char) fa->rem_ip_beg[3];
+    fr->src_port = (unsigned short) fa->rem_port;
+    mask = 0x1;
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        if (fa->fem_proxy_set & mask) {
+            loc_len = sizeof(loc);
+            if (getsockname(fa->fp[i].client, (struct sockaddr*) &loc, &loc_len) != 0) {
+                printf("FemRing_Open: getsockname failed for FEM %d: error %d\n", i, errno);
+                return (-1);
+            }
+            fr->loc_port[i] = ntohs(loc.sin_port);
+        }
+        mask <<= 1;
+    }
+
+    // Find the interface to capture on
+    if ((ifindex = FemRing_GetIfIndex(&(fa->loc_ip[0]))) < 0) {
+        printf("FemRing_Open: no network interface has the local IP address %d.%d.%d.%d\n",
+               fa->loc_ip[0], fa->loc_ip[1], fa->loc_ip[2], fa->loc_ip[3]);
+        return (-1);
+    }
+
+    // Create the packet socket: it captures nothing until it is bound to a protocol
+    if ((fr->sock = socket(AF_PACKET, SOCK_RAW, 0)) < 0) {
+        printf("FemRing_Open: socket failed: error %d (the packet receive backend requires CAP_NET_RAW)\n", errno);
+        return (-1);
+    }
+
+    ver = TPACKET_V3;
+    if (setsockopt(fr->sock, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) != 0) {
+        printf("FemRing_Open: setsockopt PACKET_VERSION failed: error %d\n", errno);
+        return (-1);
+    }
+
+    // Create the ring
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = FEMRING_BLOCK_SIZE;
+    req.tp_block_nr = FEMRING_BLOCK_NB;
+    req.tp_frame_size = FEMRING_FRAME_SIZE;
+    req.tp_frame_nr = (FEMRING_BLOCK_SIZE / FEMRING_FRAME_SIZE) * FEMRING_BLOCK_NB;
+    req.tp_retire_blk_tov = FEMRING_RETIRE_TIMEOUT_MS;
+    req.tp_feature_req_word = 0;
+    if (setsockopt(fr->sock, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+        printf("FemRing_Open: setsockopt PACKET_RX_RING failed: error %d\n", errno);
+        return (-1);
+    }
+
+    fr->map_sz = req.tp_block_size * req.tp_block_nr;
+    fr->map = (unsigned char*) mmap((void*) 0, fr->map_sz, PROT_READ | PROT_WRITE, MAP_SHARED, fr->sock, 0);
+    if (fr->map == (unsigned char*) MAP_FAILED) {
+        fr->map = (unsigned char*) 0;
+        printf("FemRing_Open: mmap failed: error %d\n", errno);
+        return (-1);
+    }
+
+    // Only let the datagrams of the FEMs in the ring
+    prog.len = sizeof(fem_code) / sizeof(fem_code[0]);
+    prog.filter = fem_code;
+    if (setsockopt(fr->sock, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+        printf("FemRing_Open: setsockopt SO_ATTACH_FILTER failed: error %d\n", errno);
+        return (-1);
+    }
+
+    // Start capturing
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_IP);
+    sll.sll_ifindex = ifindex;
+    if (bind(fr->sock, (struct sockaddr*) &sll, sizeof(sll)) != 0) {
+        printf("FemRing_Open: bind failed: error %d\n", errno);
+        return (-1);
+    }
+
+    // The UDP sockets of the FEMs are only used to send from now on
+    prog.len = sizeof(drop_code) / sizeof(drop_code[0]);
+    prog.filter = drop_code;
+    mask = 0x1;
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        if (fa->fem_proxy_set & mask) {
+            if (setsockopt(fa->fp[i].client, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) != 0) {
+                printf("FemRing_Open: setsockopt SO_ATTACH_FILTER failed for FEM %d: error %d\n", i, errno);
+                return (-1);
+            }
+        }
+        mask <<= 1;
+    }
+
+    return (0);
+}
+
+/*******************************************************************************
+ FemRing_Close
+*******************************************************************************/
+void FemRing_Close(FemRing* fr) {
+    if (fr->map) {
+        munmap(fr->map, fr->map_sz);
+        fr->map = (unsigned char*) 0;
+    }
+    if (fr->sock >= 0) {
+        close(fr->sock);
+        fr->sock = -1;
+    }
+    if (fr->skipped_cnt || fr->frag_cnt) {
+        printf("FemRing_Close: %llu packets skipped, %llu fragmented datagrams dropped\n", fr->skipped_cnt, fr->frag_cnt);
+    }
+}
+
+/*******************************************************************************
+ FemRing_IsOwner
+
+ Tells if a buffer is a frame located in the ring.
+*******************************************************************************/
+int FemRing_IsOwner(FemRing* fr, void* buf) {
+    if ((fr->map) && ((unsigned char*) buf >= fr->map) && ((unsigned char*) buf < (fr->map + fr->map_sz))) {
+        return (1);
+    }
+    return (0);
+}
+
+/*******************************************************************************
+ FemRing_DropRef
+
+ Gives a block back to the kernel when it is no longer used.
+*******************************************************************************/
+static void FemRing_DropRef(FemRing* fr, unsigned int blk) {
+    struct tpacket_block_desc* desc;
+
+    if (__sync_sub_and_fetch(&(fr->blk_ref[blk]), 1) == 0) {
+        desc = (struct tpacket_block_desc*) (fr->map + blk * FEMRING_BLOCK_SIZE);
+        __sync_synchronize();
+        desc->hdr.bh1.block_status = TP_STATUS_KERNEL;
+    }
+}
+
+/*******************************************************************************
+ FemRing_ReleaseFrame
+
+ Called when a frame of the ring is no longer used. May be called from any
+ thread.
+*******************************************************************************/
+void FemRing_ReleaseFrame(FemRing* fr, void* buf) {
+    FemRing_DropRef(fr, (unsigned int) (((unsigned char*) buf - fr->map) / FEMRING_BLOCK_SIZE));
+}
+
+/*******************************************************************************
+ FemRing_GetBlock
+
+ Returns 1 if the next block of the ring was filled by the kernel and can be
+ read with FemRing_NextFrame(), 0 otherwise. A block that was already read but
+ still has frames in use has an older sequence number and is not read again.
+*******************************************************************************/
+int FemRing_GetBlock(FemRing* fr) {
+    struct tpacket_block_desc* desc;
+
+    desc = (struct tpacket_block_desc*) (fr->map + fr->rd * FEMRING_BLOCK_SIZE);
+    if (((desc->hdr.bh1.block_status & TP_STATUS_USER) == 0) || (desc->hdr.bh1.seq_num != fr->seq)) {
+        return (0);
+    }
+    __sync_synchronize();
+
+    // The block is in use until it has been read completely
+    fr->blk_ref[fr->rd] = 1;
+    fr->cur_pkt = (unsigned char*) desc + desc->hdr.bh1.offset_to_first_pkt;
+    fr->cur_left = desc->hdr.bh1.num_pkts;
+
+    return (1);
+}
+
+/*******************************************************************************
+ FemRing_NextFrame
+
+ Gets the payload of the next datagram of the current block sent by a FEM of
+ the array and the time it was captured. Returns 1 if a datagram was found, 0
+ if the end of the block was reached. The frame returned must be released with
+ FemRing_ReleaseFrame().
+*******************************************************************************/
+int FemRing_NextFrame(FemRing* fr, int* fem, unsigned char** buf, unsigned short* len, unsigned long long* ts) {
+    struct tpacket3_hdr* hdr;
+    unsigned char* ip;
+    unsigned char* udp;
+    unsigned int avail;
+    unsigned int ihl;
+    unsigned int ulen;
+    unsigned short sport;
+    unsigned short dport;
+    int ix;
+
+    while (fr->cur_left) {
+        hdr = (struct tpacket3_hdr*) fr->cur_pkt;
+        fr->cur_left--;
+        fr->cur_pkt += hdr->tp_next_offset;
+
+        // Locate the IP header and check what was captured
+        ip = (unsigned char*) hdr + hdr->tp_net;
+        if ((hdr->tp_net < hdr->tp_mac) || (hdr->tp_snaplen < (unsigned int) (hdr->tp_net - hdr->tp_mac) + 28)) {
+            fr->skipped_cnt++;
+            continue;
+        }
+        avail = hdr->tp_snaplen - (hdr->tp_net - hdr->tp_mac);
+        if (((ip[0] >> 4) != 4) || (ip[9] != IPPROTO_UDP)) {
+            fr->skipped_cnt++;
+            continue;
+        }
+        if (((ip[6] << 8) | ip[7]) & 0x3FFF) {
+            if (fr->frag_cnt == 0) {
+                printf("FemRing: Warning: fragmented datagram dropped. The packet receive backend requires an MTU large enough for the FEM frames\n");
+            }
+            fr->frag_cnt++;
+            continue;
+        }
+
+        // Check that the datagram comes from a FEM of the array and goes to the socket of that FEM
+        ihl = (ip[0] & 0xF) * 4;
+        udp = ip + ihl;
+        sport = (unsigned short) ((udp[0] << 8) | udp[1]);
+        dport = (unsigned short) ((udp[2] << 8) | udp[3]);
+        ulen = (udp[4] << 8) | udp[5];
+        ix = (int) ip[15] - (int) fr->src_ip_beg;
+        if ((sport != fr->src_port) ||
+            (ip[12] != fr->src_ip_net[0]) || (ip[13] != fr->src_ip_net[1]) || (ip[14] != fr->src_ip_net[2]) ||
+            (ix < 0) || (ix >= MAX_NUMBER_OF_FEMINOS) || ((fr->fem_set & (1 << ix)) == 0) ||
+            (dport != fr->loc_port[ix]) ||
+            (ulen < 10) || ((ihl + ulen) > avail)) {
+            fr->skipped_cnt++;
+            continue;
+        }
+
+        // The frame is now in use
+        __sync_add_and_fetch(&(fr->blk_ref[fr->rd]), 1);
+
+        *fem = ix;
+        *buf = udp + 8;
+        *len = (unsigned short) (ulen - 8);
+        *ts = (unsigned long long) hdr->tp_sec * 1000000000ULL + hdr->tp_nsec;
+        return (1);
+    }
+
+    return (0);
+}
+
+/*******************************************************************************
+ FemRing_PutBlock
+
+ Called when the current block has been read. The block goes back to the
+ kernel as soon as none of its frames is used.
+*******************************************************************************/
+void FemRing_PutBlock(FemRing* fr) {
+    unsigned int blk;
+
+    blk = fr->rd;
+    fr->rd = (fr->rd + 1) % FEMRING_BLOCK_NB;
+    fr->seq++;
+    fr->cur_left = 0;
+
+    FemRing_DropRef(fr, blk);
+}
+
+/*******************************************************************************
+ FemRing_GetDropCount
+
+ Returns the number of packets dropped by the kernel since the ring was opened
+ because no block was free.
+*******************************************************************************/
+unsigned long long FemRing_GetDropCount(FemRing* fr) {
+    struct tpacket_stats_v3 st;
+    socklen_t len = sizeof(st);
+
+    // The kernel clears its statistics each time they are read
+    if ((fr->sock >= 0) && (getsockopt(fr->sock, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)) {
+        fr->drop_cnt += st.tp_drops;
+    }
+    return (fr->drop_cnt);
+}
@@ -0,0 +1,64 @@
+/*******************************************************************************
+
+ File:        femring.h
+
+ Description: Definitions for the packet ring receive backend. Frames sent
+ by the Feminos cards are captured with an AF_PACKET socket in a memory mapped
+ TPACKET_V3 ring and are passed to the event builder without being copied.
+
+
+ History:
+   Created as an alternative to the UDP socket receive path of FemArray
+
+*******************************************************************************/
+
+#ifndef FEMRING_H
+#define FEMRING_H
+
+#include "femarray.h"
+
+/*******************************************************************************
+ Constants types and global variables
+*******************************************************************************/
+
+#define FEMRING_BLOCK_SIZE (128 * 1024) // size of a ring block: a few jumbo frames so that blocks fill up quickly
+#define FEMRING_BLOCK_NB 512            // number of blocks in the ring
+#define FEMRING_FRAME_SIZE 16384        // nominal frame size (TPACKET_V3 frames are packed in blocks)
+#define FEMRING_RETIRE_TIMEOUT_MS 1     // a block partially filled is passed to user space after this time
+
+typedef struct _FemRing {
+    int sock;            // AF_PACKET socket
+    unsigned char* map;  // memory mapped ring
+    unsigned int map_sz; // size of the memory mapped ring
+    unsigned int rd;     // index of the next block to read
+    unsigned long long seq; // sequence number expected for the next block to read
+
+    unsigned char* cur_pkt; // next packet to read in the current block
+    unsigned int cur_left;  // number of packets left to read in the current block
+
+    int blk_ref[FEMRING_BLOCK_NB]; // frames of each block still used + 1 while the block is being read
+
+    unsigned int fem_set;                           // pattern of the FEMs of the array
+    unsigned char src_ip_net[3];                    // first three bytes of the FEM IP addresses
+    unsigned char src_ip_beg;                       // last byte of the IP address of FEM 0
+    unsigned short src_port;                        // UDP port the FEMs send from
+    unsigned short loc_port[MAX_NUMBER_OF_FEMINOS]; // local UDP port of the socket of each FEM
+    unsigned long long skipped_cnt;                 // packets captured but not for a FEM of the array
+    unsigned long long frag_cnt;                    // fragmented datagrams which cannot be handled
+    unsigned long long drop_cnt;                    // packets dropped by the kernel because the ring was full
+} FemRing;
+
+/*******************************************************************************
+ Function prototypes
+*******************************************************************************/
+void FemRing_Clear(FemRing* fr);
+int FemRing_Open(FemRing* fr, FemArray* fa);
+void FemRing_Close(FemRing* fr);
+int FemRing_IsOwner(FemRing* fr, void* buf);
+void FemRing_ReleaseFrame(FemRing* fr, void* buf);
+int FemRing_GetBlock(FemRing* fr);
+int FemRing_NextFrame(FemRing* fr, int* fem, unsigned char** buf, unsigned short* len, unsigned long long* ts);
+void FemRing_PutBlock(FemRing* fr);
+unsigned long long FemRing_GetDropCount(FemRing* fr);
+
+#endif
@@ -0,0 +1,346 @@
+/*******************************************************************************
+
+ File:        femuring.cpp
+
+ Description: Implementation of the io_uring receive backend.
+
+ A multishot recvmsg is posted once on the socket of each FEM: it keeps
+ producing one completion per datagram until it runs out of buffers or fails.
+ The buffers are taken by the kernel from a provided buffer ring. Half of the
+ buffer pool is lent to that ring when it is opened, and a buffer index in the
+ ring is its index in the pool, so a completion directly gives the pool buffer
+ that holds the datagram.
+
+ Each buffer starts with the io_uring_recvmsg_out header and the control
+ messages (the SO_RXQ_OVFL count and the arrival time), followed by the
+ datagram. The datagram is handed to the event builder in place and the buffer
+ goes back to the provided buffer ring in FemUring_ReleaseFrame() when the
+ event builder recycles it.
+
+ When the provided buffer ring is empty, the multishot receive of a FEM ends
+ with ENOBUFS and is posted again by FemUring_Submit(); the datagrams stay in
+ the socket receive queue meanwhile.
+
+
+ History:
+   Created as an alternative to the UDP socket receive path of FemArray
+
+*******************************************************************************/
+
+#include "femuring.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/*******************************************************************************
+ FemUring_Clear
+*******************************************************************************/
+void FemUring_Clear(FemUring* fu) {
+    int i;
+
+#ifdef HAVE_LIBURING
+    fu->br = (struct io_uring_buf_ring*) 0;
+#endif
+    fu->fd = -1;
+    fu->buf_nb = 0;
+    fu->bp = (void*) 0;
+    fu->rel_lock = 0;
+    fu->lent = (unsigned char*) 0;
+    fu->fem_set = 0;
+    fu->rearm_set = 0;
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        fu->sock[i] = -1;
+        fu->trunc_fem[i] = 0;
+    }
+    memset(&(fu->msg), 0, sizeof(fu->msg));
+    fu->nobuf_cnt = 0;
+    fu->trunc_cnt = 0;
+}
+
+/*******************************************************************************
+ FemUring_BufIndex
+
+ Index in the buffer pool of the buffer that contains an address.
+*******************************************************************************/
+static unsigned long FemUring_BufIndex(FemUring* fu, void* buf) {
+    BufPool* bp = (BufPool*) fu->bp;
+
+    return (BUFPOOL_INDEX(bp, buf));
+}
+
+/*******************************************************************************
+ FemUring_Open
+
+ Creates the ring, lends buffers of the pool to the provided buffer ring and
+ posts a multishot receive on the socket of each FEM. The sockets must be open
+ and fa->bp must point to the buffer pool.
+*******************************************************************************/
+int FemUring_Open(FemUring* fu, FemArray* fa) {
+#ifdef HAVE_LIBURING
+    int i;
+    int err;
+    int nb;
+    unsigned int mask;
+    unsigned long ix;
+    void* buf;
+    BufPool* bp;
+
+    fu->bp = fa->bp;
+    fu->fem_set = fa->fem_proxy_set;
+    bp = (BufPool*) fu->bp;
+
+    // No source address is needed, only the count of datagrams dropped by the kernel and the arrival time
+    fu->msg.msg_namelen = 0;
+    fu->msg.msg_controllen = RCV_CTRL_SIZE;
+
+    if ((err = io_uring_queue_init(FEMURING_DEPTH, &(fu->ring), 0)) < 0) {
+        printf("FemUring_Open: io_uring_queue_init failed: error %d\n", -err);
+        return (-1);
+    }
+    fu->fd = fu->ring.ring_fd;
+
+    if ((fu->lent = (unsigned char*) calloc(bp->buf_nb, sizeof(unsigned char))) == (unsigned char*) 0) {
+        printf("FemUring_Open: could not allocate the buffer flags\n");
+        return (-1);
+    }
+
+    fu->br = io_uring_setup_buf_ring(&(fu->ring), FEMURING_BUF_NB, FEMURING_BGID, 0, &err);
+    if (!fu->br) {
+        printf("FemUring_Open: io_uring_setup_buf_ring failed: error %d (Linux 6.0 or later is needed)\n", -err);
+        return (-1);
+    }
+
+    // Lend half of the buffer pool to the provided buffer ring
+    nb = bp->buf_nb / 2;
+    if (nb > FEMURING_BUF_NB) {
+        nb = FEMURING_BUF_NB;
+    }
+    for (i = 0; i < nb; i++) {
+        if ((err = BufPool_GiveBuffer(bp, &buf, AUTO_RETURNED)) < 0) {
+            printf("FemUring_Open: BufPool_GiveBuffer failed %d\n", err);
+            return (err);
+        }
+        ix = FemUring_BufIndex(fu, buf);
+        fu->lent[ix] = 1;
+        io_uring_buf_ring_add(fu->br, buf, bp->buf_sz, (unsigned short) ix, io_uring_buf_ring_mask(FEMURING_BUF_NB), i);
+        fu->buf_nb++;
+    }
+    io_uring_buf_ring_advance(fu->br, fu->buf_nb);
+    BufPool_FlushCache(bp);
+
+    // Post a multishot receive on the socket of each FEM
+    mask = 0x1;
+    for (i = 0; i < MAX_NUMBER_OF_FEMINOS; i++) {
+        if (fu->fem_set & mask) {
+            fu->sock[i] = fa->fp[i].client;
+            fu->rearm_set |= mask;
+        }
+        mask <<= 1;
+    }
+
+    return (FemUring_Submit(fu));
+#else
+    (void) fu;
+    (void) fa;
+    printf("FemUring_Open: this program was built without liburing, the uring receive backend is not available\n");
+    return (-1);
+#endif
+}
+
+/*******************************************************************************
+ FemUring_Close
+
+ Deletes the ring and returns the buffers lent to the buffer pool. Must only
+ be called once the event builder no longer uses frames of the ring.
+*******************************************************************************/
+void FemUring_Close(FemUring* fu) {
+#ifdef HAVE_LIBURING
+    unsigned int i;
+    BufPool* bp = (BufPool*) fu->bp;
+
+    if (fu->fd < 0) {
+        return;
+    }
+    if (fu->br) {
+        io_uring_free_buf_ring(&(fu->ring), fu->br, FEMURING_BUF_NB, FEMURING_BGID);
+        fu->br = (struct io_uring_buf_ring*) 0;
+    }
+    io_uring_queue_exit(&(fu->ring));
+    fu->fd = -1;
+
+    for (i = 0; fu->lent && (i < bp->buf_nb); i++) {
+        if (fu->lent[i]) {
+            BufPool_ReturnBuffer(bp, (unsigned long) BUFPOOL_ADDR(bp, i));
+        }
+    }
+    BufPool_FlushCache(bp);
+    free(fu->lent);
+    fu->lent = (unsigned char*) 0;
+    fu->buf_nb = 0;
+
+    if (fu->nobuf_cnt || fu->trunc_cnt) {
+        printf("FemUring_Close: %llu receives ran out of buffers, %llu truncated datagrams dropped\n", fu->nobuf_cnt, fu->trunc_cnt);
+    }
+#else
+    (void) fu;
+#endif
+}
+
+/*******************************************************************************
+ FemUring_IsOwner
+
+ Tells if a buffer belongs to the provided buffer ring.
+*******************************************************************************/
+int FemUring_IsOwner(FemUring* fu, void* buf) {
+    BufPool* bp = (BufPool*) fu->bp;
+
+    if ((fu->fd < 0) || (!fu->lent) || (!BUFPOOL_OWNS(bp, buf))) {
+        return (0);
+    }
+    return (fu->lent[FemUring_BufIndex(fu, buf)]);
+}
+
+/*******************************************************************************
+ FemUring_ReleaseFrame
+
+ Gives a buffer back to the provided buffer ring. The address may point
+ anywhere in the buffer. May be called from any thread.
+*******************************************************************************/
+void FemUring_ReleaseFrame(FemUring* fu, void* buf) {
+#ifdef HAVE_LIBURING
+    BufPool* bp = (BufPool*) fu->bp;
+    unsigned long ix = FemUring_BufIndex(fu, buf);
+
+    BufPool_HoldEnd(bp, buf);
+    while (__sync_lock_test_and_set(&(fu->rel_lock), 1)) {
+    }
+    io_uring_buf_ring_add(fu->br, BUFPOOL_ADDR(bp, ix), bp->buf_sz, (unsigned short) ix, io_uring_buf_ring_mask(FEMURING_BUF_NB), 0);
+    io_uring_buf_ring_advance(fu->br, 1);
+    __sync_lock_release(&(fu->rel_lock));
+#else
+    (void) fu;
+    (void) buf;
+#endif
+}
+
+/*******************************************************************************
+ FemUring_NextFrame
+
+ Returns 1 and the FEM, address, size and arrival time of the next datagram
+ received, or 0 if no completion is pending. ovfl is set to the count of
+ datagrams dropped by the kernel on that socket when the completion carries it.
+*******************************************************************************/
+int FemUring_NextFrame(FemUring* fu, int* fem, unsigned char** buf, unsigned short* len, unsigned int* ovfl, unsigned long long* ts) {
+#ifdef HAVE_LIBURING
+    struct io_uring_cqe* cqe;
+    struct io_uring_recvmsg_out* out;
+    struct cmsghdr* cm;
+    struct timespec tv;
+    unsigned char* pbuf;
+    unsigned int flags;
+    int res;
+    int i;
+
+    while (io_uring_peek_cqe(&(fu->ring), &cqe) == 0) {
+        i = (int) io_uring_cqe_get_data64(cqe);
+        res = cqe->res;
+        flags = cqe->flags;
+        io_uring_cqe_seen(&(fu->ring), cqe);
+
+        // Without this flag the multishot receive has ended and must be posted again
+        if (!(flags & IORING_CQE_F_MORE)) {
+            fu->rearm_set |= (1 << i);
+        }
+
+        if (res < 0) {
+            if (res == -ENOBUFS) {
+                fu->nobuf_cnt++;
+            } else {
+                printf("FemUring_NextFrame: receive failed for FEM %d: error %d\n", i, -res);
+            }
+            continue;
+        }
+        if (!(flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+
+        pbuf = BUFPOOL_ADDR((BufPool*) fu->bp, flags >> IORING_CQE_BUFFER_SHIFT);
+        out = io_uring_recvmsg_validate(pbuf, res, &(fu->msg));
+        if ((!out) || (out->flags & MSG_TRUNC)) {
+            if (fu->trunc_fem[i] == 0) {
+                printf("FemUring(%d): Warning: datagram larger than the receive buffers dropped. Increase --pool-buffer-size\n", i);
+            }
+            fu->trunc_fem[i]++;
+            fu->trunc_cnt++;
+            FemUring_ReleaseFrame(fu, pbuf);
+            continue;
+        }
+
+        *ts = 0;
+        for (cm = io_uring_recvmsg_cmsg_firsthdr(out, &(fu->msg)); cm; cm = io_uring_recvmsg_cmsg_nexthdr(out, &(fu->msg), cm)) {
+            if ((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SO_RXQ_OVFL)) {
+                memcpy(ovfl, CMSG_DATA(cm), sizeof(*ovfl));
+            } else if ((cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_TIMESTAMPNS)) {
+                memcpy(&tv, CMSG_DATA(cm), sizeof(tv));
+                *ts = (unsigned long long) tv.tv_sec * 1000000000ULL + tv.tv_nsec;
+            }
+        }
+
+        *fem = i;
+        *buf = (unsigned char*) io_uring_recvmsg_payload(out, &(fu->msg));
+        *len = (unsigned short) io_uring_recvmsg_payload_length(out, res, &(fu->msg));
+        return (1);
+    }
+#else
+    (void) fu;
+    (void) fem;
+    (void) buf;
+    (void) len;
+    (void) ovfl;
+    (void) ts;
+#endif
+    return (0);
+}
+
+/*******************************************************************************
+ FemUring_Submit
+
+ Posts again the multishot receive of the FEMs for which it has ended.
+*******************************************************************************/
+int FemUring_Submit(FemUring* fu) {
+#ifdef HAVE_LIBURING
+    struct io_uring_sqe* sqe;
+    unsigned int mask;
+    int i;
+    int err;
+    int cnt;
+
+    cnt = 0;
+    mask = 0x1;
+    for (i = 0; (i < MAX_NUMBER_OF_FEMINOS) && fu->rearm_set; i++) {
+        if (fu->rearm_set & mask) {
+            if ((sqe = io_uring_get_sqe(&(fu->ring))) == (struct io_uring_sqe*) 0) {
+                break;
+            }
+            io_uring_prep_recvmsg_multishot(sqe, fu->sock[i], &(fu->msg), 0);
+            sqe->flags |= IOSQE_BUFFER_SELECT;
+            sqe->buf_group = FEMURING_BGID;
+            io_uring_sqe_set_data64(sqe, (__u64) i);
+            fu->rearm_set &= ~mask;
+            cnt++;
+        }
+        mask <<= 1;
+    }
+
+    if (cnt) {
+        if ((err = io_uring_submit(&(fu->ring))) < 0) {
+            printf("FemUring_Submit: io_uring_submit failed: error %d\n", -err);
+            return (-1);
+        }
+    }
+#else
+    (void) fu;
+#endif
+    return (0);
+}
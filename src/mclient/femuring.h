@@ -0,0 +1,73 @@
+/*******************************************************************************
+
+ File:        femuring.h
+
+ Description: Definitions for the io_uring receive backend. A multishot
+ recvmsg is posted on the socket of each Feminos card and the kernel picks the
+ receive buffers from a provided buffer ring filled with buffers of the buffer
+ pool. Completions are handed to the event builder in place.
+
+ This backend requires liburing (HAVE_LIBURING) and Linux 6.0 or later.
+
+
+ History:
+   Created as an alternative to the UDP socket receive path of FemArray
+
+*******************************************************************************/
+
+#ifndef FEMURING_H
+#define FEMURING_H
+
+#include "bufpool.h"
+#include "femarray.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+/*******************************************************************************
+ Constants types and global variables
+*******************************************************************************/
+
+#define FEMURING_DEPTH 64    // submission queue size: one multishot receive per FEM
+#define FEMURING_BUF_NB 256  // buffers lent by the pool to the provided buffer ring (power of 2)
+#define FEMURING_BGID 0      // buffer group of the provided buffer ring
+#define FEMURING_MAX_CQE 256 // maximum number of completions processed per call
+
+// Bytes of a provided buffer used before the datagram: the io_uring_recvmsg_out header (4 32-bit words) and the
+// control messages. The pool buffers must be this much larger than the largest datagram
+#define FEMURING_HDR_SIZE (16 + RCV_CTRL_SIZE)
+
+typedef struct _FemUring {
+#ifdef HAVE_LIBURING
+    struct io_uring ring;         // submission and completion queues
+    struct io_uring_buf_ring* br; // provided buffer ring
+#endif
+    int fd;       // file descriptor of the ring, watched by epoll (-1: not open)
+    int buf_nb;   // number of buffers lent by the pool
+    void* bp;     // buffer pool the buffers are lent from
+    int rel_lock; // serializes the buffers given back to the provided buffer ring
+
+    unsigned char* lent; // 1 for each pool buffer that belongs to the provided buffer ring
+
+    unsigned int fem_set;            // pattern of the FEMs of the array
+    unsigned int rearm_set;          // FEMs whose multishot receive has ended and must be posted again
+    int sock[MAX_NUMBER_OF_FEMINOS]; // socket of each FEM
+    struct msghdr msg;               // recvmsg layout: no address, room for the drop count and the arrival time
+    unsigned long long nobuf_cnt;    // receives ended because the provided buffer ring was empty
+    unsigned long long trunc_cnt;    // datagrams dropped because they did not fit in a buffer
+    unsigned int trunc_fem[MAX_NUMBER_OF_FEMINOS]; // datagrams of each FEM dropped because they did not fit in a buffer
+} FemUring;
+
+/*******************************************************************************
+ Function prototypes
+*******************************************************************************/
+void FemUring_Clear(FemUring* fu);
+int FemUring_Open(FemUring* fu, FemArray* fa);
+void FemUring_Close(FemUring* fu);
+int FemUring_IsOwner(FemUring* fu, void* buf);
+void FemUring_ReleaseFrame(FemUring* fu, void* buf);
+int FemUring_NextFrame(FemUring* fu, int* fem, unsigned char** buf, unsigned short* len, unsigned int* ovfl, unsigned long long* ts);
+int FemUring_Submit(FemUring* fu);
+
+#endif
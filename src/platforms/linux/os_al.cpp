@@ -18,6 +18,7 @@
 *******************************************************************************/
 /*#define _POSIX_C_SOURCE 199506L*/
 #include <cstdio>
+#include <cstring>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -30,6 +31,7 @@
 #include <sys/msg.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
@@ -58,6 +60,7 @@
 #define DBG_Thread_Delete
 #define DBG_Thread_Set_Priority
 #define DBG_Thread_Get_Priority
+#define DBG_Thread_Set_Affinity
 #define DBG_Thread_Get_Myself
 #define DBG_Thread_Set_Signal
 
@@ -714,6 +717,35 @@ int Thread_Get_Priority(ThreadStruct* thread) {
     return (thread->current_priority);
 }
 
+/******************************************************************************/
+/* Thread_Set_Affinity: binds the thread to one CPU core                      */
+/*  0 on success                                                              */
+/* -1 on failure                                                              */
+/******************************************************************************/
+int Thread_Set_Affinity(ThreadStruct* thread, int cpu) {
+    cpu_set_t cpu_set;
+    int err;
+
+    DBG_Thread_Set_Affinity("Thread_Set_Affinity: thread_id=0x%x cpu=%d\n",
+                            thread->thread_id, cpu);
+
+    if ((cpu < 0) || (cpu >= CPU_SETSIZE)) {
+        OSAL_ERR("Thread_Set_Affinity: illegal cpu %d\n", cpu);
+        return -1;
+    }
+
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    if ((err = pthread_setaffinity_np((pthread_t) thread->thread_id,
+                                      sizeof(cpu_set_t), &cpu_set)) != 0) {
+        OSAL_ERR("Thread_Set_Affinity: pthread_setaffinity_np failed %d\n", err);
+        return -1;
+    }
+
+    DBG_Thread_Set_Affinity("Thread_Set_Affinity: done\n");
+    return 0;
+}
+
 /******************************************************************************/
 /* signal_set_fun: sets signal handler for all signals                        */
 /*  0 on success                                                              */
@@ -873,6 +905,98 @@ int Pipe_Open(void** pi, char* pipe_name) {
     return -1;
 }
 
+/******************************************************************************/
+/* Time_GetNs: wall clock time in nanoseconds, on the same clock as the       */
+/* receive timestamps given by the kernel (SO_TIMESTAMPNS)                    */
+/******************************************************************************/
+unsigned long long Time_GetNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/******************************************************************************/
+/* Time_GetMonotonicNs: time in nanoseconds from an arbitrary origin, not     */
+/* affected by changes of the wall clock                                      */
+/******************************************************************************/
+unsigned long long Time_GetMonotonicNs(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/******************************************************************************/
+/* Memory_Alloc_Large: maps a zeroed memory region of at least size bytes,    */
+/* backed by huge pages when possible (reserved huge pages first, then        */
+/* transparent huge pages), optionally bound to a NUMA node (-1: any), and    */
+/* prefaulted so that no page fault occurs when it is used.                   */
+/* pages is set to one of the MEMORY_PAGES_ values.                           */
+/*  pointer to the region on success                                          */
+/*  NULL on failure                                                           */
+/******************************************************************************/
+#define OSAL_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+#define OSAL_MPOL_BIND 2
+
+void* Memory_Alloc_Large(unsigned long size, int numa_node, int* pages) {
+    void* mem;
+    unsigned long sz;
+    unsigned long off;
+    unsigned long node_mask[16];
+
+    sz = (size + OSAL_HUGE_PAGE_SIZE - 1) & ~(OSAL_HUGE_PAGE_SIZE - 1);
+
+    *pages = MEMORY_PAGES_HUGETLB;
+    mem = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (mem == MAP_FAILED) {
+        // No huge page reserved (vm.nr_hugepages): use normal pages and ask for transparent huge pages
+        *pages = MEMORY_PAGES_NORMAL;
+        mem = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) {
+            OSAL_ERR("Memory_Alloc_Large: mmap of %lu bytes failed %d\n", sz, errno);
+            return NULL;
+        }
+        if (madvise(mem, sz, MADV_HUGEPAGE) == 0) {
+            *pages = MEMORY_PAGES_THP;
+        }
+    }
+
+    // Bind the region to a NUMA node before any page is allocated
+    if ((numa_node >= 0) && (numa_node < (int) (sizeof(node_mask) * 8))) {
+        memset(node_mask, 0, sizeof(node_mask));
+        node_mask[numa_node / (sizeof(unsigned long) * 8)] = 1UL << (numa_node % (sizeof(unsigned long) * 8));
+        if (syscall(SYS_mbind, mem, sz, OSAL_MPOL_BIND, node_mask, sizeof(node_mask) * 8, 0) != 0) {
+            OSAL_WAR("Memory_Alloc_Large: mbind to NUMA node %d failed %d\n", numa_node, errno);
+        }
+    }
+
+    // Prefault the region
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(mem, sz, MADV_POPULATE_WRITE) == 0) {
+        return mem;
+    }
+#endif
+    for (off = 0; off < sz; off += 4096) {
+        ((volatile unsigned char*) mem)[off] = 0;
+    }
+
+    return mem;
+}
+
+/******************************************************************************/
+/* Memory_Free_Large: unmaps a region given by Memory_Alloc_Large             */
+/******************************************************************************/
+void Memory_Free_Large(void* mem, unsigned long size) {
+    unsigned long sz;
+
+    if (mem == NULL) {
+        return;
+    }
+    sz = (size + OSAL_HUGE_PAGE_SIZE - 1) & ~(OSAL_HUGE_PAGE_SIZE - 1);
+    munmap(mem, sz);
+}
+
 /*
  * Pipe_Close : Deletes named pipe in client
  *  0 on success
@@ -57,9 +57,21 @@ int Thread_Delete(ThreadStruct* thread);
 int Thread_Join(ThreadStruct* thread);
 int Thread_Set_Priority(ThreadStruct* thread, int priority);
 int Thread_Get_Priority(ThreadStruct* thread);
+int Thread_Set_Affinity(ThreadStruct* thread, int cpu);
 long Thread_Get_Myself(ThreadStruct* thread);
 int Thread_Set_Signal(ThreadStruct* thread, void* sig_fun);
 
+/* Operating system independent time */
+unsigned long long Time_GetNs(void);
+unsigned long long Time_GetMonotonicNs(void);
+
+/* Operating system independent allocation of large memory regions */
+#define MEMORY_PAGES_NORMAL 0   // backed by normal pages
+#define MEMORY_PAGES_HUGETLB 1  // backed by reserved huge pages
+#define MEMORY_PAGES_THP 2      // transparent huge pages requested
+void* Memory_Alloc_Large(unsigned long size, int numa_node, int* pages);
+void Memory_Free_Large(void* mem, unsigned long size);
+
 /* Operating system independent bi-directionnal named pipes for messages */
 int Pipe_Create(void** pi, char* pipe_name);
 int Pipe_Delete(void** pi);
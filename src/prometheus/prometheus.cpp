@@ -106,6 +106,102 @@ feminos_daq_prometheus::PrometheusManager::PrometheusManager() {
                                                             {0.99, 0.02},
                                                     });
 
+    daq_receive_batch_size_now = &BuildGauge()
+                                          .Name("daq_receive_batch_size_now")
+                                          .Help("Average number of datagrams read per receive call")
+                                          .Register(*registry)
+                                          .Add({});
+
+    daq_event_latency_p50 = &BuildGauge()
+                                     .Name("daq_event_latency_p50_us")
+                                     .Help("Median latency from the arrival of the last frame of an event to the end of the built event, in microseconds")
+                                     .Register(*registry)
+                                     .Add({});
+
+    daq_event_latency_p99 = &BuildGauge()
+                                     .Name("daq_event_latency_p99_us")
+                                     .Help("99th percentile of the latency from the arrival of the last frame of an event to the end of the built event, in microseconds")
+                                     .Register(*registry)
+                                     .Add({});
+
+    daq_kernel_dropped_datagrams = &BuildGauge()
+                                            .Name("daq_kernel_dropped_datagrams")
+                                            .Help("Number of datagrams dropped by the kernel before they could be read, per FEM socket or packet ring")
+                                            .Register(*registry);
+
+    daq_truncated_datagrams = &BuildGauge()
+                                       .Name("daq_truncated_datagrams")
+                                       .Help("Number of datagrams dropped because they were larger than the receive buffers (--pool-buffer-size), per FEM")
+                                       .Register(*registry);
+
+    daq_credit_requests_per_s_now = &BuildGauge()
+                                             .Name("daq_credit_requests_per_s_now")
+                                             .Help("Data requests (credits) sent to the FEMs per second")
+                                             .Register(*registry)
+                                             .Add({});
+
+    daq_credit_request_batch_size_now = &BuildGauge()
+                                                 .Name("daq_credit_request_batch_size_now")
+                                                 .Help("Average number of data requests sent with one sendmmsg call")
+                                                 .Register(*registry)
+                                                 .Add({});
+
+    daq_credit_window = &BuildGauge()
+                                 .Name("daq_credit_window")
+                                 .Help("Current credit window of each FEM (bytes or frames that may be requested and not yet consumed)")
+                                 .Register(*registry);
+
+    daq_credit_regrants = &BuildGauge()
+                                   .Name("daq_credit_regrants")
+                                   .Help("Number of times the pending credits of a FEM were presumed lost after a timeout and granted again")
+                                   .Register(*registry);
+
+    daq_event_timeouts = &BuildGauge()
+                                  .Name("daq_event_timeouts")
+                                  .Help("Number of events closed after the event timeout without the data of a FEM")
+                                  .Register(*registry);
+
+    daq_buffer_pool_free_buffers = &BuildGauge()
+                                            .Name("daq_buffer_pool_free_buffers")
+                                            .Help("Number of free buffers in the receive buffer pool, including those cached by the threads")
+                                            .Register(*registry)
+                                            .Add({});
+
+    daq_buffer_pool_cache_hit_ratio_now = &BuildGauge()
+                                                   .Name("daq_buffer_pool_cache_hit_ratio_now")
+                                                   .Help("Fraction of the buffers given from a thread cache without accessing the shared free queue")
+                                                   .Register(*registry)
+                                                   .Add({});
+
+    daq_buffer_pool_cache_refills = &BuildGauge()
+                                             .Name("daq_buffer_pool_cache_refills")
+                                             .Help("Number of refills of the thread buffer caches from the shared free queue")
+                                             .Register(*registry)
+                                             .Add({});
+
+    daq_buffer_pool_cache_flushes = &BuildGauge()
+                                             .Name("daq_buffer_pool_cache_flushes")
+                                             .Help("Number of flushes of the thread buffer caches to the shared free queue")
+                                             .Register(*registry)
+                                             .Add({});
+
+    daq_buffer_pool_free_low_water = &BuildGauge()
+                                              .Name("daq_buffer_pool_free_low_water")
+                                              .Help("Lowest number of buffers left in the shared free queue of the buffer pool since the previous update")
+                                              .Register(*registry)
+                                              .Add({});
+
+    daq_buffer_pool_alloc_failures = &BuildGauge()
+                                              .Name("daq_buffer_pool_alloc_failures")
+                                              .Help("Number of buffers requested from the buffer pool when none was free")
+                                              .Register(*registry)
+                                              .Add({});
+
+    daq_buffer_hold_time_us = &BuildHistogram()
+                                       .Name("daq_buffer_hold_time_us")
+                                       .Help("Time in microseconds a receive buffer is held from the arrival of its frame until it is recycled, per FEM")
+                                       .Register(*registry);
+
     run_number = &BuildGauge()
                           .Name("run_number")
                           .Help("Run number")
@@ -200,6 +296,131 @@ void feminos_daq_prometheus::PrometheusManager::SetDaqSpeedEvents(double speed)
     }
 }
 
+void feminos_daq_prometheus::PrometheusManager::SetReceiveBatchSize(double size) {
+    if (daq_receive_batch_size_now) {
+        daq_receive_batch_size_now->Set(size);
+    }
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetEventLatency(double p50, double p99) {
+    if (daq_event_latency_p50) {
+        daq_event_latency_p50->Set(p50);
+    }
+    if (daq_event_latency_p99) {
+        daq_event_latency_p99->Set(p99);
+    }
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetKernelDrops(const string& source, unsigned long long count) {
+    if (!daq_kernel_dropped_datagrams) {
+        return;
+    }
+
+    auto it = daq_kernel_dropped_datagrams_per_source.find(source);
+    if (it == daq_kernel_dropped_datagrams_per_source.end()) {
+        it = daq_kernel_dropped_datagrams_per_source.emplace(source, &daq_kernel_dropped_datagrams->Add({{"source", source}})).first;
+    }
+    it->second->Set(double(count));
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetTruncatedDatagrams(const string& fem, unsigned int count) {
+    if (!daq_truncated_datagrams) {
+        return;
+    }
+
+    auto it = daq_truncated_datagrams_per_fem.find(fem);
+    if (it == daq_truncated_datagrams_per_fem.end()) {
+        it = daq_truncated_datagrams_per_fem.emplace(fem, &daq_truncated_datagrams->Add({{"fem", fem}})).first;
+    }
+    it->second->Set(double(count));
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetCreditRequests(double rate, double batch_size) {
+    if (daq_credit_requests_per_s_now) {
+        daq_credit_requests_per_s_now->Set(rate);
+    }
+    if (daq_credit_request_batch_size_now) {
+        daq_credit_request_batch_size_now->Set(batch_size);
+    }
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetCreditWindow(const string& fem, int window) {
+    if (!daq_credit_window) {
+        return;
+    }
+
+    auto it = daq_credit_window_per_fem.find(fem);
+    if (it == daq_credit_window_per_fem.end()) {
+        it = daq_credit_window_per_fem.emplace(fem, &daq_credit_window->Add({{"fem", fem}})).first;
+    }
+    it->second->Set(double(window));
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetCreditRegrants(const string& fem, unsigned int count) {
+    if (!daq_credit_regrants) {
+        return;
+    }
+
+    auto it = daq_credit_regrants_per_fem.find(fem);
+    if (it == daq_credit_regrants_per_fem.end()) {
+        it = daq_credit_regrants_per_fem.emplace(fem, &daq_credit_regrants->Add({{"fem", fem}})).first;
+    }
+    it->second->Set(double(count));
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetEventTimeouts(const string& fem, unsigned int count) {
+    if (!daq_event_timeouts) {
+        return;
+    }
+
+    auto it = daq_event_timeouts_per_fem.find(fem);
+    if (it == daq_event_timeouts_per_fem.end()) {
+        it = daq_event_timeouts_per_fem.emplace(fem, &daq_event_timeouts->Add({{"fem", fem}})).first;
+    }
+    it->second->Set(double(count));
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetBufferPool(int free_buffers, double cache_hit_ratio, unsigned long long cache_refills, unsigned long long cache_flushes) {
+    if (daq_buffer_pool_free_buffers) {
+        daq_buffer_pool_free_buffers->Set(free_buffers);
+    }
+    if (daq_buffer_pool_cache_hit_ratio_now) {
+        daq_buffer_pool_cache_hit_ratio_now->Set(cache_hit_ratio);
+    }
+    if (daq_buffer_pool_cache_refills) {
+        daq_buffer_pool_cache_refills->Set(double(cache_refills));
+    }
+    if (daq_buffer_pool_cache_flushes) {
+        daq_buffer_pool_cache_flushes->Set(double(cache_flushes));
+    }
+}
+
+void feminos_daq_prometheus::PrometheusManager::SetBufferPoolOccupancy(int low_water, unsigned long long failures) {
+    if (daq_buffer_pool_free_low_water) {
+        daq_buffer_pool_free_low_water->Set(low_water);
+    }
+    if (daq_buffer_pool_alloc_failures) {
+        daq_buffer_pool_alloc_failures->Set(double(failures));
+    }
+}
+
+void feminos_daq_prometheus::PrometheusManager::ObserveBufferHoldTimes(const string& fem, const std::vector<double>& bucket_increments, double sum_us) {
+    if (!daq_buffer_hold_time_us) {
+        return;
+    }
+
+    auto it = daq_buffer_hold_time_us_per_fem.find(fem);
+    if (it == daq_buffer_hold_time_us_per_fem.end()) {
+        // Powers of 2 microseconds, as binned by the buffer pool: the last increment is for the +Inf bucket
+        Histogram::BucketBoundaries boundaries;
+        for (size_t i = 1; i < bucket_increments.size(); i++) {
+            boundaries.push_back(double(1ULL << i));
+        }
+        it = daq_buffer_hold_time_us_per_fem.emplace(fem, &daq_buffer_hold_time_us->Add({{"fem", fem}}, boundaries)).first;
+    }
+    it->second->ObserveMultiple(bucket_increments, sum_us);
+}
+
 void feminos_daq_prometheus::PrometheusManager::ExposeRootOutputFilename(const string& filename) {
     // check file exists and get absolute path
     if (!std::filesystem::exists(filename)) {
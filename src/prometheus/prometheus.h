@@ -15,6 +15,7 @@
 
 #include <filesystem>
 #include <iostream>
+#include <map>
 #include <mutex>
 
 using namespace prometheus;
@@ -43,6 +44,28 @@ public:
 
     void SetDaqSpeedEvents(double speed);
 
+    void SetReceiveBatchSize(double size);
+
+    void SetKernelDrops(const std::string& source, unsigned long long count);
+
+    void SetTruncatedDatagrams(const std::string& fem, unsigned int count);
+
+    void SetEventLatency(double p50, double p99);
+
+    void SetCreditWindow(const std::string& fem, int window);
+
+    void SetCreditRequests(double rate, double batch_size);
+
+    void SetCreditRegrants(const std::string& fem, unsigned int count);
+
+    void SetEventTimeouts(const std::string& fem, unsigned int count);
+
+    void SetBufferPool(int free_buffers, double cache_hit_ratio, unsigned long long cache_refills, unsigned long long cache_flushes);
+
+    void SetBufferPoolOccupancy(int low_water, unsigned long long failures);
+
+    void ObserveBufferHoldTimes(const std::string& fem, const std::vector<double>& bucket_increments, double sum_us);
+
     void SetNumberOfEvents(unsigned int id);
 
     void SetRunNumber(unsigned int id);
@@ -77,6 +100,39 @@ private:
     Gauge* daq_frames_queue_fill_level_now = nullptr;
     Summary* daq_frames_queue_fill_level = nullptr;
 
+    Gauge* daq_receive_batch_size_now = nullptr;
+
+    Gauge* daq_event_latency_p50 = nullptr;
+    Gauge* daq_event_latency_p99 = nullptr;
+
+    Family<Gauge>* daq_kernel_dropped_datagrams = nullptr;
+    std::map<std::string, Gauge*> daq_kernel_dropped_datagrams_per_source;
+
+    Family<Gauge>* daq_truncated_datagrams = nullptr;
+    std::map<std::string, Gauge*> daq_truncated_datagrams_per_fem;
+
+    Gauge* daq_credit_requests_per_s_now = nullptr;
+    Gauge* daq_credit_request_batch_size_now = nullptr;
+
+    Family<Gauge>* daq_credit_window = nullptr;
+    std::map<std::string, Gauge*> daq_credit_window_per_fem;
+
+    Family<Gauge>* daq_credit_regrants = nullptr;
+    std::map<std::string, Gauge*> daq_credit_regrants_per_fem;
+
+    Family<Gauge>* daq_event_timeouts = nullptr;
+    std::map<std::string, Gauge*> daq_event_timeouts_per_fem;
+
+    Gauge* daq_buffer_pool_free_buffers = nullptr;
+    Gauge* daq_buffer_pool_cache_hit_ratio_now = nullptr;
+    Gauge* daq_buffer_pool_cache_refills = nullptr;
+    Gauge* daq_buffer_pool_cache_flushes = nullptr;
+    Gauge* daq_buffer_pool_free_low_water = nullptr;
+    Gauge* daq_buffer_pool_alloc_failures = nullptr;
+
+    Family<Histogram>* daq_buffer_hold_time_us = nullptr;
+    std::map<std::string, Histogram*> daq_buffer_hold_time_us_per_fem;
+
     Gauge* number_of_signals_in_last_event = nullptr;
     Summary* number_of_signals_in_event = nullptr;
 
@@ -2,6 +2,7 @@
 #include "storage.h"
 #include "frame.h"
 #include "prometheus.h"
+#include <algorithm>
 #include <iostream>
 #include <thread>
 
@@ -21,6 +22,35 @@ void feminos_daq_storage::StorageManager::Checkpoint(bool force) {
 
 StorageManager::StorageManager() = default;
 
+StorageManager::~StorageManager() {
+    // Let the storage thread write what is left in the ring and return, followed by the decoding threads, before what
+    // they use is destroyed
+    if (!storage_thread_running) {
+        return;
+    }
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    if (std::this_thread::get_id() != storage_thread_id) {
+        stopping = true;
+        {
+            lock_guard<mutex> lock(frames_mutex);
+            frames_cv.notify_all();
+        }
+        while (storage_thread_running && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    } else {
+        // The program exits from the storage thread itself (early_exit)
+        {
+            lock_guard<mutex> lock(decode_mutex);
+            storage_thread_running = false;
+        }
+        decode_cv.notify_all();
+    }
+    while (decode_threads_running && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
 double StorageManager::GetSpeedEventsPerSecond() const {
     const auto millis = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() - millisSinceEpochForSpeedCalculation;
     if (millis <= 0) {
@@ -29,7 +59,7 @@ double StorageManager::GetSpeedEventsPerSecond() const {
     return 1000.0 * GetNumberOfEntries() / millis;
 }
 
-bool ReadFrame(const std::vector<unsigned short>& frame_data, feminos_daq_storage::Event& event) {
+bool ReadFrame(const unsigned short* frame_data, unsigned int words, feminos_daq_storage::Event& event) {
     unsigned short r0, r1, r2;
     unsigned short n0, n1;
     unsigned short cardNumber, chipNumber, daqChannel;
@@ -37,22 +67,23 @@ bool ReadFrame(const std::vector<unsigned short>& frame_data, feminos_daq_storag
     int tmp_i[10];
     int si = 0;
 
-    auto p = const_cast<unsigned short*>(frame_data.data());
+    auto p = frame_data;
     auto start = p;
+    const auto end = frame_data + words;
 
     bool end_of_event = false;
     bool done = false;
 
     unsigned int signal_id = 0;
-    std::array<unsigned short, 512> signal_data = {};
+    std::array<unsigned short, MAX_POINTS> signal_data = {};
 
-    while (!done) {
+    while (!done && p < end) {
         // Is it a prefix for 14-bit content?
         if ((*p & PFX_14_BIT_CONTENT_MASK) == PFX_CARD_CHIP_CHAN_HIT_IX) {
             // if (sgnl.GetSignalID() >= 0 && sgnl.GetNumberOfPoints() >= fMinPoints) {                fSignalEvent->AddSignal(sgnl);            }
 
             if (si > 0) {
-                event.add_signal(signal_id, signal_data);
+                event.add_signal(signal_id, signal_data.data(), si);
             }
 
             cardNumber = GET_CARD_IX(*p);
@@ -70,12 +101,13 @@ bool ReadFrame(const std::vector<unsigned short>& frame_data, feminos_daq_storag
         }
         // Is it a prefix for 12-bit content?
         else if ((*p & PFX_12_BIT_CONTENT_MASK) == PFX_ADC_SAMPLE) {
-            r0 = GET_ADC_DATA(*p);
-
-            signal_data[si] = r0;
-
-            p++;
-            si++;
+            // Samples come in runs: copy the whole run at once. Samples beyond MAX_POINTS are dropped
+            const int n = Frame_ExtractAdcRun(p, end, signal_data.data() + si, MAX_POINTS - si);
+            if (n == 0) {
+                p++;
+            }
+            p += n;
+            si += n;
         }
         // Is it a prefix for 4-bit content?
         else if ((*p & PFX_4_BIT_CONTENT_MASK) == PFX_START_OF_EVENT) {
@@ -129,7 +161,7 @@ bool ReadFrame(const std::vector<unsigned short>& frame_data, feminos_daq_storag
         else if ((*p & PFX_0_BIT_CONTENT_MASK) == PFX_END_OF_FRAME) {
             // if (sgnl.GetSignalID() >= 0 && sgnl.GetNumberOfPoints() >= fMinPoints) { fSignalEvent->AddSignal(sgnl); }
             if (si > 0) {
-                event.add_signal(signal_id, signal_data);
+                event.add_signal(signal_id, signal_data.data(), si);
             }
 
             done = true;
@@ -189,8 +221,12 @@ void StorageManager::Initialize(const string& filename) {
     event_tree = std::make_unique<TTree>("events", "Signal events. Each entry is an event which may contain multiple signals");
 
     event_tree->Branch("timestamp", &event.timestamp);
+    event_tree->Branch("missing_sources", &event.missing_sources);
     event_tree->Branch("signal_ids", &event.signal_ids);
     event_tree->Branch("signal_values", &event.signal_values);
+    if (!event.fixed_length) {
+        event_tree->Branch("signal_lengths", &event.signal_lengths);
+    }
 
     run_tree = std::make_unique<TTree>("run", "Run metadata");
 
@@ -213,45 +249,207 @@ void StorageManager::Initialize(const string& filename) {
 
     prometheus_manager.UpdateOutputRootFileSize();
 
-    thread([this]() {
-        while (true) {
-            const auto frame = PopFrame();
+    // Slot i of the ring is empty, ready to be filled at position i
+    max_frames = 1;
+    while (max_frames < std::max(queue_capacity, min_queue_capacity)) {
+        max_frames <<= 1;
+    }
+    frames = std::make_unique<FrameSlot[]>(max_frames);
+    for (size_t i = 0; i < max_frames; i++) {
+        frames[i].seq.store(i, std::memory_order_relaxed);
+    }
 
-            if (frame.empty()) {
-                // PopFrame does not block since it requires locking the mutex. If there are no frames in the queue, it should return an empty frame
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            } else if (frame.size() == 1 && frame[0] == 0) {
-                // special frame signaling end of built event
-                auto& storage_manager = feminos_daq_storage::StorageManager::Instance();
-                auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
+    // Enough events in flight to keep the decoding threads busy while the oldest one is written
+    if (decode_threads > max_decode_threads) {
+        decode_threads = max_decode_threads;
+    }
+    jobs.clear();
+    for (unsigned int i = 0; i < (decode_threads ? 2 * decode_threads + 2 : 1); i++) {
+        jobs.push_back(std::make_unique<EventJob>());
+        jobs.back()->event.fixed_length = event.fixed_length;
+    }
+    storage_thread_running = true;
+    for (unsigned int i = 0; i < decode_threads; i++) {
+        decode_threads_running++;
+        thread([this]() { DecodeLoop(); }).detach();
+    }
 
-                if (storage_manager.IsInitialized()) {
+    thread storage_thread([this]() {
+        const size_t batch_size = 256;
+        std::vector<Frame> batch;
+        batch.reserve(batch_size);
+        bool released = false;
+        while (true) {
+            WriteDecodedEvents();
 
-                    storage_manager.event.id = storage_manager.event_tree->GetEntries();
-                    storage_manager.event_tree->Fill();
+            if (PopFrames(batch, batch_size) == 0) {
+                // Decode the frames of the event being gathered while waiting for the rest, so that their receive
+                // buffers are not held meanwhile. The decoding thread of the event goes on from there.
+                released |= DecodeEvent(*jobs[jobs_next % jobs.size()]);
 
-                    storage_manager.Checkpoint();
+                // Hand back the buffers released while busy so that none stays in the cache of this thread, then
+                // sleep until a frame is added or an event is decoded
+                if (released && flush_released) {
+                    flush_released();
+                }
+                released = false;
 
-                    prometheus_manager.SetNumberOfSignalsInEvent(storage_manager.event.size());
-                    prometheus_manager.SetNumberOfEvents(storage_manager.event_tree->GetEntries());
+                if (stopping && (jobs_written == jobs_next)) {
+                    break;
+                }
+                unique_lock<mutex> lock(frames_mutex);
+                frames_waiting = true;
+                frames_cv.wait(lock, [this]() { return !IsQueueEmpty() || IsEventDecoded() || stopping; });
+                frames_waiting = false;
+                continue;
+            }
 
-                    prometheus_manager.UpdateOutputRootFileSize();
+            for (auto& frame: batch) {
+                EventJob& job = *jobs[jobs_next % jobs.size()];
+                if (!frame.end_of_event) {
+                    // Without decoding threads the frames are decoded as they come, otherwise with their event
+                    if (decode_threads == 0) {
+                        released |= DecodeFrame(frame, job.event);
+                    } else {
+                        job.frames.push_back(std::move(frame));
+                    }
+                    continue;
+                }
 
-                    const bool exit_due_to_entries = storage_manager.stop_run_after_entries > 0 && storage_manager.event_tree->GetEntries() >= storage_manager.stop_run_after_entries;
-                    const bool exit_due_to_time = storage_manager.stop_run_after_seconds > 0 && double(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()) - double(storage_manager.run_time_start_millis) > storage_manager.stop_run_after_seconds * 1000.0;
-                    if (exit_due_to_entries || exit_due_to_time) {
-                        cout << "Stopping run at " << storage_manager.event_tree->GetEntries() << " entries" << endl;
-                        early_exit();
+                // end of built event, with the missing sources if the event is incomplete
+                job.event.missing_sources = frame.missing_sources;
+                DispatchEvent(job);
+                jobs_next++;
+
+                // The next event needs a free job: write the oldest one once it is decoded
+                while (jobs_next - jobs_written >= jobs.size()) {
+                    WriteDecodedEvents();
+                    if (jobs_next - jobs_written >= jobs.size()) {
+                        unique_lock<mutex> lock(frames_mutex);
+                        frames_waiting = true;
+                        frames_cv.wait(lock, [this]() { return IsEventDecoded(); });
+                        frames_waiting = false;
                     }
                 }
+            }
+        }
+        {
+            lock_guard<mutex> lock(decode_mutex);
+            storage_thread_running = false;
+        }
+        decode_cv.notify_all();
+    });
+    storage_thread_id = storage_thread.get_id();
+    storage_thread.detach();
+}
+
+bool StorageManager::DecodeFrame(const Frame& frame, Event& event) {
+    // read frame data into event, then give back the receive buffer it was read from
+    ReadFrame(frame.words(), frame.size, event);
+    if (frame.buffer) {
+        release_buffer(frame.buffer);
+        frames_held--;
+        return true;
+    }
+    return false;
+}
 
-                storage_manager.Clear();
-            } else {
-                // read frame data into event
-                ReadFrame(frame, event);
+bool StorageManager::DecodeEvent(EventJob& job) {
+    bool released = false;
+
+    for (const auto& frame: job.frames) {
+        released |= DecodeFrame(frame, job.event);
+    }
+    job.frames.clear();
+    return released;
+}
+
+void StorageManager::DecodeLoop() {
+    EventJob* job;
+    bool released = false;
+
+    while (true) {
+        {
+            unique_lock<mutex> lock(decode_mutex);
+            if (decode_queue.empty()) {
+                // Hand back the buffers released while busy so that none stays in the cache of this thread
+                if (released && flush_released) {
+                    lock.unlock();
+                    flush_released();
+                    released = false;
+                    lock.lock();
+                }
+                // Return once the storage thread has written the last events
+                decode_cv.wait(lock, [this]() { return !decode_queue.empty() || !storage_thread_running; });
+                if (decode_queue.empty()) {
+                    break;
+                }
             }
+            job = decode_queue.front();
+            decode_queue.pop();
         }
-    }).detach();
+
+        released |= DecodeEvent(*job);
+        job->decoded = true;
+        WakeUp();
+    }
+    decode_threads_running--;
+}
+
+void StorageManager::DispatchEvent(EventJob& job) {
+    if (decode_threads == 0) {
+        job.decoded = true;
+        return;
+    }
+    {
+        lock_guard<mutex> lock(decode_mutex);
+        decode_queue.push(&job);
+    }
+    decode_cv.notify_one();
+}
+
+bool StorageManager::IsEventDecoded() const {
+    return jobs_written < jobs_next && jobs[jobs_written % jobs.size()]->decoded;
+}
+
+void StorageManager::WriteDecodedEvents() {
+    while (IsEventDecoded()) {
+        EventJob& job = *jobs[jobs_written % jobs.size()];
+        WriteEvent(job);
+        job.decoded = false;
+        jobs_written++;
+    }
+}
+
+void StorageManager::WriteEvent(EventJob& job) {
+    auto& prometheus_manager = feminos_daq_prometheus::PrometheusManager::Instance();
+
+    // The branches of the event tree point to the members of event: swap the decoded data in rather than copying it
+    event.timestamp = job.event.timestamp;
+    event.missing_sources = job.event.missing_sources;
+    event.signal_ids.swap(job.event.signal_ids);
+    event.signal_values.swap(job.event.signal_values);
+    event.signal_lengths.swap(job.event.signal_lengths);
+    job.event.clear();
+
+    event.id = event_tree->GetEntries();
+    event_tree->Fill();
+
+    Checkpoint();
+
+    prometheus_manager.SetNumberOfSignalsInEvent(event.size());
+    prometheus_manager.SetNumberOfEvents(event_tree->GetEntries());
+
+    prometheus_manager.UpdateOutputRootFileSize();
+
+    const bool exit_due_to_entries = stop_run_after_entries > 0 && event_tree->GetEntries() >= stop_run_after_entries;
+    const bool exit_due_to_time = stop_run_after_seconds > 0 && double(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count()) - double(run_time_start_millis) > stop_run_after_seconds * 1000.0;
+    if (exit_due_to_entries || exit_due_to_time) {
+        cout << "Stopping run at " << event_tree->GetEntries() << " entries" << endl;
+        early_exit();
+    }
+
+    Clear();
 }
 
 void StorageManager::SetOutputDirectory(const string& directory) {
@@ -281,24 +479,89 @@ void StorageManager::SetOutputDirectory(const string& directory) {
     }
 }
 
-void StorageManager::AddFrame(const vector<unsigned short>& frame) {
-    lock_guard<mutex> lock(frames_mutex);
-    frames.push(frame);
+void StorageManager::AddFrame(const unsigned short* data, unsigned int words, void* buffer) {
+    Frame frame;
+    frame.size = words;
+    if (buffer) {
+        // the words are read in place, the buffer is released once they are decoded
+        frame.data = data;
+        frame.buffer = buffer;
+        frames_held++;
+    } else {
+        frame.copy.assign(data, data + words);
+    }
+    PushFrame(std::move(frame));
+}
+
+void StorageManager::AddEndOfEvent(unsigned int missing_sources) {
+    Frame frame;
+    frame.end_of_event = true;
+    frame.missing_sources = missing_sources;
+    PushFrame(std::move(frame));
+}
+
+void StorageManager::PushFrame(Frame&& frame) {
+    unsigned long pos = frames_enq.load(std::memory_order_relaxed);
+    FrameSlot* slot;
+
+    // Claim the slot at the end of the ring
+    while (true) {
+        slot = &frames[pos & (max_frames - 1)];
+        const long diff = (long) (slot->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (frames_enq.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            throw std::runtime_error("Too many frames in queue");
+        } else {
+            pos = frames_enq.load(std::memory_order_relaxed);
+        }
+    }
+    slot->frame = std::move(frame);
+    slot->seq.store(pos + 1);
     frames_count++;
 
-    if (frames.size() >= max_frames) {
-        throw std::runtime_error("Too many frames in queue");
+    WakeUp();
+}
+
+void StorageManager::WakeUp() {
+    // The storage thread checks again what it waits for after it says it waits: one of the two sees the other
+    if (frames_waiting) {
+        lock_guard<mutex> lock(frames_mutex);
+        frames_cv.notify_one();
+    }
+}
+
+bool StorageManager::IsQueueEmpty() const {
+    const unsigned long pos = frames_deq.load(std::memory_order_relaxed);
+    return frames[pos & (max_frames - 1)].seq.load() != pos + 1;
+}
+
+size_t StorageManager::PopFrames(std::vector<Frame>& batch, size_t max) {
+    unsigned long pos = frames_deq.load(std::memory_order_relaxed);
+
+    batch.clear();
+    while (batch.size() < max) {
+        FrameSlot& slot = frames[pos & (max_frames - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+            break;
+        }
+        batch.push_back(std::move(slot.frame));
+        // the slot is empty, ready to be filled on the next turn of the ring
+        slot.seq.store(pos + max_frames, std::memory_order_release);
+        pos++;
     }
+    frames_deq.store(pos, std::memory_order_relaxed);
+    return batch.size();
 }
 
-std::vector<unsigned short> StorageManager::PopFrame() {
-    lock_guard<mutex> lock(frames_mutex);
-    if (frames.empty()) {
-        return {};
+bool StorageManager::WaitFramesReleased(std::chrono::milliseconds timeout) const {
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (frames_held > 0 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
-    auto frame = frames.front();
-    frames.pop();
-    return std::move(frame);
+    return frames_held == 0;
 }
 
 unsigned int StorageManager::GetNumberOfFramesInserted() const {
@@ -306,8 +569,9 @@ unsigned int StorageManager::GetNumberOfFramesInserted() const {
 }
 
 unsigned int StorageManager::GetNumberOfFramesInQueue() {
-    lock_guard<mutex> lock(frames_mutex);
-    return frames.size();
+    // the frames taken are counted first so that the difference is never negative
+    const unsigned long deq = frames_deq.load();
+    return frames_enq.load() - deq;
 }
 
 double StorageManager::GetQueueUsage() {
@@ -317,6 +581,11 @@ double StorageManager::GetQueueUsage() {
 void StorageManager::early_exit() const {
     // Invoking this from a thread is not the cleanest way to exit the program, but it appears to work
 
+    // Stop the reception of new frames right away
+    if (stop_acquisition) {
+        stop_acquisition();
+    }
+
     if (file) {
         file->Write("", TObject::kOverwrite);
         file->Close();
@@ -328,13 +597,31 @@ void StorageManager::early_exit() const {
 std::pair<unsigned short, std::array<unsigned short, MAX_POINTS>> Event::get_signal_id_data_pair(size_t index) const {
     unsigned short channel = signal_ids[index];
     std::array<unsigned short, MAX_POINTS> data{};
-    for (size_t i = 0; i < MAX_POINTS; ++i) {
-        data[i] = signal_values[index * 512 + i];
+
+    // Without lengths every signal has MAX_POINTS data points, otherwise the signal starts after the previous ones
+    size_t offset = index * MAX_POINTS;
+    size_t points = MAX_POINTS;
+    if (!signal_lengths.empty()) {
+        offset = 0;
+        for (size_t i = 0; i < index; ++i) {
+            offset += signal_lengths[i];
+        }
+        points = std::min<size_t>(signal_lengths[index], MAX_POINTS);
+    }
+    for (size_t i = 0; i < points; ++i) {
+        data[i] = signal_values[offset + i];
     }
     return {channel, data};
 }
 
-void Event::add_signal(unsigned short id, const array<unsigned short, MAX_POINTS>& data) {
+void Event::add_signal(unsigned short id, const unsigned short* data, size_t points) {
     signal_ids.push_back(id);
-    signal_values.insert(signal_values.end(), data.begin(), data.end());
+    if (fixed_length) {
+        points = std::min<size_t>(points, MAX_POINTS);
+        signal_values.insert(signal_values.end(), data, data + points);
+        signal_values.resize(signal_values.size() + MAX_POINTS - points, 0);
+    } else {
+        signal_values.insert(signal_values.end(), data, data + points);
+        signal_lengths.push_back(points);
+    }
 }
@@ -6,9 +6,15 @@
 #include <TTree.h>
 #include <array>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <queue>
 #include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace feminos_daq_storage {
@@ -20,25 +26,35 @@ class Event {
 public:
     unsigned long long timestamp = 0;
     unsigned int id = 0;
+    unsigned int missing_sources = 0; // FEMs whose data is missing (event closed after the event builder timeout)
     std::vector<unsigned short> signal_ids;
-    std::vector<unsigned short> signal_values; // all data points from all signals concatenated (same order as signal_ids)
+    std::vector<unsigned short> signal_values;  // all data points from all signals concatenated (same order as signal_ids)
+    std::vector<unsigned short> signal_lengths; // number of data points of each signal (same order as signal_ids)
+
+    // Every signal is stored with MAX_POINTS data points (zero padded) and signal_lengths is left empty, as in the
+    // files written before signal_lengths was added
+    bool fixed_length = false;
 
     Event() {
         // reserve space for the maximum number of signals and points
         signal_ids.reserve(MAX_SIGNALS);
         signal_values.reserve(MAX_POINTS * MAX_POINTS);
+        signal_lengths.reserve(MAX_SIGNALS);
     }
 
     void clear() {
         timestamp = 0;
         id = 0;
+        missing_sources = 0;
         signal_ids.clear();
         signal_values.clear();
+        signal_lengths.clear();
     }
 
     void shrink_to_fit() {
         signal_ids.shrink_to_fit();
         signal_values.shrink_to_fit();
+        signal_lengths.shrink_to_fit();
     }
 
     size_t size() const {
@@ -47,7 +63,31 @@ public:
 
     std::pair<unsigned short, std::array<unsigned short, MAX_POINTS>> get_signal_id_data_pair(size_t index) const;
 
-    void add_signal(unsigned short id, const std::array<unsigned short, MAX_POINTS>& data);
+    void add_signal(unsigned short id, const unsigned short* data, size_t points);
+};
+
+// Frame waiting in the queue of the storage thread: either 16-bit words read in place from a receive buffer, which
+// is held until the frame is decoded, or a copy of them. The end of a built event is a frame without words.
+class Frame {
+public:
+    const unsigned short* data = nullptr; // words of the frame read in place (nullptr for a copy)
+    void* buffer = nullptr;               // receive buffer holding the words read in place
+    unsigned int size = 0;                // number of words
+    std::vector<unsigned short> copy;     // words of the frame when it is a copy
+    bool end_of_event = false;
+    unsigned int missing_sources = 0; // sources missing from the built event that ends here
+
+    const unsigned short* words() const {
+        return data ? data : copy.data();
+    }
+};
+
+// Built event gathered by the storage thread, decoded by a worker and written in order by the storage thread
+class EventJob {
+public:
+    std::vector<Frame> frames; // frames waiting to be decoded
+    Event event;
+    std::atomic<bool> decoded = false;
 };
 
 class StorageManager {
@@ -63,6 +103,8 @@ public:
 
     StorageManager();
 
+    ~StorageManager();
+
     void Initialize(const std::string& filename);
 
     void Clear() {
@@ -123,22 +165,89 @@ public:
         return output_directory;
     }
 
-    void AddFrame(const std::vector<unsigned short>& frame);
-    std::vector<unsigned short> PopFrame();
+    void AddFrame(const unsigned short* data, unsigned int words, void* buffer);
+    void AddEndOfEvent(unsigned int missing_sources);
+    size_t PopFrames(std::vector<Frame>& batch, size_t max);
     unsigned int GetNumberOfFramesInQueue();
     double GetQueueUsage();
     unsigned int GetNumberOfFramesInserted() const;
 
+    // A frame can be queued in its receive buffer as long as few buffers are held, otherwise the pool could run dry,
+    // and as long as holding that buffer does not hold up the receive path (see can_hold_buffer)
+    bool CanHoldFrame(const void* buffer) const {
+        return release_buffer && frames_held < max_frames_held && (!can_hold_buffer || can_hold_buffer(buffer));
+    }
+    bool WaitFramesReleased(std::chrono::milliseconds timeout) const;
+
+    // Called before exiting when the run is stopped from the storage thread (entries or time limit reached)
+    std::function<void()> stop_acquisition;
+
+    // Gives back a receive buffer once its frame is decoded, and flushes what the storage thread released when idle
+    std::function<void(void*)> release_buffer;
+    std::function<void()> flush_released;
+    std::function<bool(const void*)> can_hold_buffer;
+    unsigned int max_frames_held = 0;
+
+    // Frames the storage queue must hold, rounded up to a power of 2 when the ring is allocated in Initialize
+    size_t queue_capacity = 0;
+    static constexpr size_t min_queue_capacity = 1 << 16;
+
+    // Number of threads decoding the built events (0: decoded by the storage thread)
+    unsigned int decode_threads = 0;
+    static constexpr unsigned int max_decode_threads = 16;
+
 private:
     // make it a point in the past to force a checkpoint on the first event
     const std::chrono::duration<int64_t> checkpoint_interval = std::chrono::seconds(10);
     std::chrono::time_point<std::chrono::system_clock> checkpoint_last = std::chrono::system_clock::now() - checkpoint_interval;
     std::string output_directory;
 
-    std::queue<std::vector<unsigned short>> frames;
+    // Bounded ring of frames: any thread may add frames, only the storage thread takes them. seq tells whether a slot
+    // holds a frame for the consumer (position + 1) or is empty for a producer (position).
+    struct FrameSlot {
+        std::atomic<unsigned long> seq;
+        Frame frame;
+    };
+    std::unique_ptr<FrameSlot[]> frames;
+    alignas(64) std::atomic<unsigned long> frames_enq = 0; // position where the next frame is added
+    alignas(64) std::atomic<unsigned long> frames_deq = 0; // position of the next frame to take
     std::atomic<unsigned long long> frames_count = 0;
+    std::atomic<unsigned int> frames_held = 0;
+    size_t max_frames = 0; // power of 2, set in Initialize from queue_capacity
+
+    // The storage thread only waits when the ring is empty. Producers take the mutex to wake it up only then.
+    std::atomic<bool> frames_waiting = false;
     std::mutex frames_mutex;
-    const size_t max_frames = 1000000; // this should be about 2GB when full (depends on frame size)
+    std::condition_variable frames_cv;
+
+    // Set when the program exits: the storage thread empties the ring and returns, then the decoding threads
+    std::atomic<bool> stopping = false;
+    std::atomic<bool> storage_thread_running = false;
+    std::atomic<unsigned int> decode_threads_running = 0;
+    std::thread::id storage_thread_id;
+
+    void PushFrame(Frame&& frame);
+    bool IsQueueEmpty() const;
+    void WakeUp();
+
+    // Built events in progress: event jobs_next is gathered in jobs[jobs_next % jobs.size()], the events from
+    // jobs_written on are being decoded or wait to be written. Only used by the storage thread.
+    std::vector<std::unique_ptr<EventJob>> jobs;
+    unsigned long long jobs_next = 0;
+    unsigned long long jobs_written = 0;
+
+    // Built events waiting for a decoding thread
+    std::queue<EventJob*> decode_queue;
+    std::mutex decode_mutex;
+    std::condition_variable decode_cv;
+
+    bool DecodeFrame(const Frame& frame, Event& event);
+    bool DecodeEvent(EventJob& job);
+    void DecodeLoop();
+    void DispatchEvent(EventJob& job);
+    bool IsEventDecoded() const;
+    void WriteEvent(EventJob& job);
+    void WriteDecodedEvents();
 
     void early_exit() const;
 };
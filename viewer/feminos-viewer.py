@@ -1658,7 +1658,15 @@ def get_event(tree: uproot.TTree, entry: int):
         )
 
     events = tree.arrays(entry_start=entry, entry_stop=entry + 1)
-    events["signal_values"] = ak.unflatten(events["signal_values"], 512, axis=1)
+    if "signal_lengths" in events.fields:
+        # each signal has its own number of values
+        events["signal_values"] = ak.unflatten(
+            events["signal_values"], ak.flatten(events["signal_lengths"]), axis=1
+        )
+        events = ak.without_field(events, "signal_lengths")
+    else:
+        # files written without signal lengths (or with --fixed-length-signals) have 512 values per signal
+        events["signal_values"] = ak.unflatten(events["signal_values"], 512, axis=1)
 
     signals = ak.Array(
         {"id": events["signal_ids"], "values": events["signal_values"]},
@@ -1680,7 +1688,6 @@ def compute_energy_estimate(
     baseline_range: float = 0.2,
 ) -> float:
     energy = 0.0
-    baseline_factor = int(baseline_range * len(event.signals.values[0]))
 
     for i in range(len(event.signals.id)):
         signal_id = int(event.signals.id[i])
@@ -1689,6 +1696,7 @@ def compute_energy_estimate(
             continue
 
         values = np.asarray(event.signals.values[i])
+        baseline_factor = max(int(baseline_range * len(values)), 1)
 
         energy += np.max(values) - np.mean(values[:baseline_factor])
 
@@ -1699,7 +1707,7 @@ def compute_energy_estimate(
 def compute_energy_of_waveform(
     waveform: np.ndarray, baseline_range: float = 0.2
 ) -> float:
-    baseline_factor = int(baseline_range * len(waveform))
+    baseline_factor = max(int(baseline_range * len(waveform)), 1)
     return np.max(waveform) - np.mean(waveform[:baseline_factor])
 
 
@@ -2304,20 +2312,17 @@ class EventViewer:
         weights_y = []
 
         baseline_range = 0.2
-        baseline_factor = int(baseline_range * len(event.signals.values[0]))
 
         for signal_id, values in zip(event.signals.id, event.signals.values):
             if int(signal_id) not in self.readout_signal_ids:
                 continue
 
             values = np.asarray(values)
+            baseline_factor = max(int(baseline_range * len(values)), 1)
             baseline_level = np.mean(values[:baseline_factor])
             baseline_sigma = np.std(values[:baseline_factor])
 
             signal_type = readouts[self.readout]["mapping"][int(signal_id)][0]
-            assert len(values) == 512, (
-                f"Signal {signal_id} has {len(values)} bins, not 512"
-            )
             for i in range(len(values)):
                 value = values[i]
                 if not value > baseline_level + 2.0 * baseline_sigma: